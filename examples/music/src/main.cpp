@@ -1,13 +1,25 @@
 #include <M5Unified.h>
 #include <Sampler.h>
 #include <MidiMessage.h>
+#include <MidiParser.h>
 #include <vector>
+#include <atomic>
+#include <cstdlib>
+#include <new>
 #if !defined(ARDUINO) && !defined(M5UNIFIED_PC_BUILD)
 #include <esp_rom_sys.h>
 #endif
 
 #define ENABLE_PRINTING false
 
+// 1にすると、起動時にすべての曲を各経路でレンダリングし、初期化後にメモリを確保したかどうかを確かめて終了する (native-allocation-check環境)
+#ifndef ALLOCATION_CHECK
+#define ALLOCATION_CHECK 0
+#endif
+#if ALLOCATION_CHECK && !SAMPLER_FIXED_CAPACITY
+#error "ALLOCATION_CHECK requires SAMPLER_FIXED_CAPACITY=1"
+#endif
+
 using namespace capsule::sampler;
 typedef std::vector<Timbre::MappedSample> ms;
 
@@ -27,54 +39,98 @@ extern const int16_t crash_data[38879];
 extern const int16_t supersaw_data[30000];
 extern const int16_t epiano_data[124800];
 
-auto pianoSample = std::make_shared<Sample>(
+// サンプルとティンバーは静的に定義しておき、起動時のメモリ確保を避ける
+// ゾーンの配列はconstexprにしてフラッシュに置き、ティンバーは定数初期化される
+static Sample pianoSample(
   piano_data, 24000, 60,
   21608, 21975,
   true, 1.0f, 0.998000f, 0.1f, 0.985000f);
-auto bassSample = std::make_shared<Sample>(
+static Sample bassSample(
   bass_data, 24000, 36,
   21714, 22448,
   true, 1.0f, 0.999000f, 0.25f, 0.970000f);
-auto kickSample = std::make_shared<Sample>(
+static Sample kickSample(
   kick_data, 12000, 36,
   0, 0,
   false, 0, 0, 0, 0);
-auto rimknockSample = std::make_shared<Sample>(
+static Sample rimknockSample(
   rimknock_data, 9800, 37,
   0, 0,
   false, 0, 0, 0, 0);
-auto snareSample = std::make_shared<Sample>(
+static Sample snareSample(
   snare_data, 12000, 38,
   0, 0,
   false, 0, 0, 0, 0);
-auto hihatSample = std::make_shared<Sample>(
+static Sample hihatSample(
   hihat_data, 3200, 42,
   0, 0,
   false, 0, 0, 0, 0);
-auto crashSample = std::make_shared<Sample>(
+static Sample crashSample(
   crash_data, 38800, 49,
   0, 0,
   false, 0, 0, 0, 0);
-auto supersawSample = std::make_shared<Sample>(
+static Sample supersawSample(
   supersaw_data, 30000, 60,
   23979, 25263,
   true, 1.0f, 0.982f, 0, 0.5f);
-auto epianoSample = std::make_shared<Sample>(
+static Sample epianoSample(
   epiano_data, 124800, 60,
   120048, 120415,
   true, 1.0f, 0.98f, 0.5f, 0.95f);
 
-auto piano = std::make_shared<Timbre>(ms{{pianoSample, 0, 127, 0, 127}});
-auto bass = std::make_shared<Timbre>(ms{{bassSample, 0, 127, 0, 127}});
-auto drumset = std::make_shared<Timbre>(ms{
-  {kickSample, 36, 36, 0, 127},
-  {rimknockSample, 37, 37, 0, 127},
-  {snareSample, 38, 38, 0, 127},
-  {hihatSample, 42, 42, 0, 127},
-  {crashSample, 49, 49, 0, 127}
-});
-auto supersaw = std::make_shared<Timbre>(ms{{supersawSample, 0, 127, 0, 127}});
-auto epiano = std::make_shared<Timbre>(ms{{epianoSample, 0, 127, 0, 127}});
+static constexpr Timbre::Zone pianoZones[] = {{&pianoSample, 0, 127, 0, 127}};
+static constexpr Timbre::Zone bassZones[] = {{&bassSample, 0, 127, 0, 127}};
+static constexpr Timbre::Zone drumsetZones[] = {
+  {&kickSample, 36, 36, 0, 127},
+  {&rimknockSample, 37, 37, 0, 127},
+  {&snareSample, 38, 38, 0, 127},
+  {&hihatSample, 42, 42, 0, 127},
+  {&crashSample, 49, 49, 0, 127}
+};
+static constexpr Timbre::Zone supersawZones[] = {{&supersawSample, 0, 127, 0, 127}};
+static constexpr Timbre::Zone epianoZones[] = {{&epianoSample, 0, 127, 0, 127}};
+
+static Timbre piano(pianoZones);
+static Timbre bass(bassZones);
+static Timbre drumset(drumsetZones);
+static Timbre supersaw(supersawZones);
+static Timbre epiano(epianoZones);
+
+// サンプルの格納形式
+// SampleFormat::MULAW や SampleFormat::ADPCM にすると、符号化したサンプルで処理負荷を計測できる
+static constexpr SampleFormat SAMPLE_FORMAT = SampleFormat::PCM16;
+template <size_t N>
+static void setTimbre(Sampler &sampler, uint8_t channel, Timbre &timbre, const Timbre::Zone (&zones)[N])
+{
+  if (SAMPLE_FORMAT == SampleFormat::PCM16)
+  {
+    sampler.SetTimbre(channel, timbre);
+    return;
+  }
+  ms encoded;
+  for (auto &zone : zones)
+    encoded.emplace_back(EncodeSample(*zone.sample, SAMPLE_FORMAT), zone.lowerNoteNo, zone.upperNoteNo, zone.lowerVelocity, zone.upperVelocity);
+  sampler.SetTimbre(channel, std::make_shared<Timbre>(std::move(encoded)));
+}
+
+// 既定のリソースとして使用し、MemoryResourceを経由した確保を数える
+static CountingMemoryResource allocationCounter;
+
+// MemoryResourceを経由しない確保(new・make_shared・STLコンテナなど)も数えるため、グローバルなoperator newを置き換える
+// SAMPLER_FIXED_CAPACITYを1にしてビルドした場合は、再生中の確保はどちらも0回でなければならない
+static std::atomic<uint32_t> globalAllocationCount{0};
+static uint32_t processAllocationCount = 0; // Processの中で行われた確保の回数
+
+void *operator new(size_t size)
+{
+  globalAllocationCount++;
+  void *p = malloc(size != 0 ? size : 1);
+  if (p == nullptr)
+    abort();
+  return p;
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
 
 struct song_table_entry_t
 {
@@ -110,7 +166,9 @@ uint32_t process(Sampler& sampler, int16_t *output)
 #else
   __asm__ __volatile("rsr %0, ccount" : "=r"(cycle_begin)); // 処理前のCPUサイクル値を取得
 #endif
+  uint32_t allocations = globalAllocationCount;
   sampler.Process(output);
+  processAllocationCount += globalAllocationCount - allocations;
 #if defined (M5UNIFIED_PC_BUILD)
   cycle_end = M5.micros();
 #else
@@ -177,72 +235,196 @@ uint32_t benchmark(const std::shared_ptr<Sampler>& sampler, const MidiMessage *s
 
   uint32_t cycle_count = 0;
 
-  sampler->SetTimbre(0, piano);
-  sampler->SetTimbre(1, bass);
-  sampler->SetTimbre(2, supersaw);
-  sampler->SetTimbre(3, epiano);
-  sampler->SetTimbre(9, drumset);
+  setTimbre(*sampler, 0, piano, pianoZones);
+  setTimbre(*sampler, 1, bass, bassZones);
+  setTimbre(*sampler, 2, supersaw, supersawZones);
+  setTimbre(*sampler, 3, epiano, epianoZones);
+  setTimbre(*sampler, 9, drumset, drumsetZones);
 
   // 最初に無音を再生しておくことで先頭のノイズを抑える
   M5.Speaker.playRaw(output[buf_idx], SAMPLE_BUFFER_SIZE, SAMPLE_RATE, false, 16, SPK_CH);
   buf_idx = (buf_idx + 1) & 3;
 
-  uint32_t processedSamples = 0;         // 処理済みのサンプル数
-  const MidiMessage *nextMessage = song; // 次に処理するべきMIDIメッセージ
-  uint32_t nextGoal = nextMessage->time;
-  bool hasReachedEndOfSong = false;  // 多重ループを抜けるために使用
-  while (processedSamples < 2880000) // 長すぎる曲は途中で打ち切る
+  // 曲の再生はSamplerのProcessの中でシーケンサーが行う (イベントはブロックの途中でも発生した位置から反映される)
+  auto sequencer = std::make_shared<Sequencer>(song);
+  sampler->StartSequencer(sequencer);
+
+  uint32_t allocations = allocationCounter.GetAllocationCount();
+  processAllocationCount = 0;
+  uint32_t processedSamples = 0; // 処理済みのサンプル数
+  while (sequencer->IsPlaying() && processedSamples < 2880000) // 長すぎる曲は途中で打ち切る
+  {
+    cycle_count += process(*sampler, output[buf_idx]);
+    buf_idx = (buf_idx + 1) & 3;
+    processedSamples += SAMPLE_BUFFER_SIZE;
+  }
+
+  while (M5.Speaker.isPlaying())
+  {
+    M5.delay(1);
+  }
+
+  allocations = allocationCounter.GetAllocationCount() - allocations;
+  M5.Log.printf("Allocations while rendering: %u in Process (%u through MemoryResource)\n", (unsigned)processAllocationCount, (unsigned)allocations);
+
+  auto footprint = sampler->GetFootprint();
+  M5.Log.printf("Memory: %u bytes (peak %u), voices %u, queues %u (peak %u), effects %u, stack %u, sample data %u\n",
+                (unsigned)footprint.GetOwnedTotal(), (unsigned)footprint.GetOwnedPeak(), (unsigned)footprint.voices.current,
+                (unsigned)footprint.queues.current, (unsigned)footprint.queues.peak, (unsigned)footprint.effects.current,
+                (unsigned)footprint.stack.current, (unsigned)footprint.sampleData.current);
+
+  // CPUサイクル数をマイクロ秒に変換して返す
+  return cycle_count / getCpuFrequencyMhz();
+}
+
+#if ALLOCATION_CHECK
+// 曲のイベントをSamplerに渡す経路
+enum class EventRoute : uint8_t
+{
+  SEQUENCER,      // StartSequencer
+  DIRECT,         // NoteOn・NoteOff・PitchBend
+  POST_EVENTS,    // PostEvents
+  POST_MIDI,      // PostMidi
+  SCHEDULE_EVENT, // ScheduleEvent
+};
+static constexpr const char *event_route_names[] = {"Sequencer", "NoteOn", "PostEvents", "PostMidi", "ScheduleEvent"};
+
+// MIDIメッセージをSamplerのイベントに変換する ノートオン・ノートオフ・ピッチベンド以外はfalseを返す
+static bool to_event(const MidiMessage &m, Sampler::Event &event)
+{
+  event = {};
+  event.channel = m.status & 0x0F;
+  switch (m.status & 0xF0)
   {
-    // MIDIメッセージを処理する
-    while (processedSamples >= nextGoal)
+  case 0x90: event.type = Sampler::Event::NOTE_ON; break;
+  case 0x80: event.type = Sampler::Event::NOTE_OFF; break;
+  case 0xE0:
+    event.type = Sampler::Event::PITCH_BEND;
+    event.pitchBend = ((m.data2 & 0x7F) << 7 | (m.data1 & 0x7F)) - 8192;
+    return true;
+  default:
+    return false;
+  }
+  event.noteNo = m.data1;
+  event.velocity = m.data2;
+  return true;
+}
+
+// songのイベントをrouteでSamplerに渡しながらレンダリングし、初期化後に行われたメモリ確保の回数を返す
+static uint32_t render_song(const MidiMessage *song, EventRoute route)
+{
+  static int16_t output[SAMPLE_BUFFER_SIZE];
+  std::shared_ptr<Sampler> sampler = Sampler::Create();
+  setTimbre(*sampler, 0, piano, pianoZones);
+  setTimbre(*sampler, 1, bass, bassZones);
+  setTimbre(*sampler, 2, supersaw, supersawZones);
+  setTimbre(*sampler, 3, epiano, epianoZones);
+  setTimbre(*sampler, 9, drumset, drumsetZones);
+  std::shared_ptr<Sequencer> sequencer;
+  if (route == EventRoute::SEQUENCER)
+    sequencer = std::make_shared<Sequencer>(song);
+  MidiParser parser;
+
+  // ここから先は再生中の操作のみで、メモリを確保してはならない
+  uint32_t allocations = globalAllocationCount + allocationCounter.GetAllocationCount();
+  if (sequencer)
+    sampler->StartSequencer(sequencer);
+  const MidiMessage *m = song;
+  bool ended = false;
+  for (uint32_t processed = 0; processed < 2880000; processed += SAMPLE_BUFFER_SIZE) // 長すぎる曲は途中で打ち切る
+  {
+    if (sequencer ? !sequencer->IsPlaying() : ended)
+      break;
+    // 次のブロックの間に発生するイベントを渡す (ScheduleEvent以外はブロックの先頭に揃えられる)
+    Sampler::Event events[SAMPLER_POST_BATCH_SIZE];
+    size_t eventCount = 0;
+    uint8_t bytes[SAMPLER_POST_BATCH_SIZE * 3];
+    size_t byteCount = 0;
+    for (; !sequencer && m->time < processed + SAMPLE_BUFFER_SIZE; m++)
     {
-      if ((nextMessage->status & 0xF0) == 0x90)
+      if (m->status == 0xFF && m->data1 == 0x2F)
       {
-        sampler->NoteOn(nextMessage->data1, nextMessage->data2, nextMessage->status & 0x0F);
-      }
-      else if ((nextMessage->status & 0xF0) == 0x80)
-      {
-        sampler->NoteOff(nextMessage->data1, nextMessage->data2, nextMessage->status & 0x0F);
-      }
-      else if ((nextMessage->status & 0xF0) == 0xE0)
-      {
-        uint_fast16_t rawValue = (nextMessage->data2 & 0b01111111) << 7 | (nextMessage->data1 & 0b01111111);
-        int16_t value = rawValue - 8192;
-        sampler->PitchBend(value, nextMessage->status & 0x0F);
+        ended = true;
+        break;
       }
-      if (nextMessage->status == 0xFF && nextMessage->data1 == 0x2F && nextMessage->data2 == 0x00)
+      Sampler::Event event;
+      if (!to_event(*m, event))
+        continue;
+      switch (route)
       {
-        // 0xFF, 0x2F, 0x00 は曲の終わりを意味する
-        hasReachedEndOfSong = true;
+      case EventRoute::DIRECT:
+        if (event.type == Sampler::Event::NOTE_ON)
+          sampler->NoteOn(event.noteNo, event.velocity, event.channel);
+        else if (event.type == Sampler::Event::NOTE_OFF)
+          sampler->NoteOff(event.noteNo, event.velocity, event.channel);
+        else
+          sampler->PitchBend(event.pitchBend, event.channel);
+        break;
+      case EventRoute::POST_EVENTS:
+        events[eventCount++] = event;
+        if (eventCount == SAMPLER_POST_BATCH_SIZE)
+        {
+          sampler->PostEvents(events, eventCount);
+          eventCount = 0;
+        }
+        break;
+      case EventRoute::POST_MIDI:
+        bytes[byteCount++] = m->status;
+        bytes[byteCount++] = m->data1;
+        bytes[byteCount++] = m->data2;
+        if (byteCount == sizeof(bytes))
+        {
+          sampler->PostMidi(parser, bytes, byteCount);
+          byteCount = 0;
+        }
+        break;
+      default:
+        sampler->ScheduleEvent(event, m->time);
         break;
       }
-      nextMessage++;
-      nextGoal = nextMessage->time;
-    }
-    if (hasReachedEndOfSong)
-      break;
-
-    // 音声処理を進める
-    while (processedSamples < nextGoal)
-    {
-      cycle_count += process(*sampler, output[buf_idx]);
-      buf_idx = (buf_idx + 1) & 3;
-      processedSamples += SAMPLE_BUFFER_SIZE;
     }
+    if (eventCount > 0)
+      sampler->PostEvents(events, eventCount);
+    if (byteCount > 0)
+      sampler->PostMidi(parser, bytes, byteCount);
+    sampler->Process(output);
   }
+  return globalAllocationCount + allocationCounter.GetAllocationCount() - allocations;
+}
 
-  while (M5.Speaker.isPlaying())
+// すべての曲をすべての経路でレンダリングし、初期化後にメモリを確保しなかった場合はtrueを返す
+static bool check_allocations()
+{
+  bool ok = true;
+  for (auto &entry : song_table)
   {
-    M5.delay(1);
+    for (uint8_t route = 0; route < sizeof(event_route_names) / sizeof(event_route_names[0]); route++)
+    {
+      uint32_t allocations = render_song(entry.song, (EventRoute)route);
+      M5.Log.printf("%-10s %-13s allocations %u\n", entry.name, event_route_names[route], (unsigned)allocations);
+      if (allocations != 0)
+        ok = false;
+    }
   }
-
-  // CPUサイクル数をマイクロ秒に変換して返す
-  return cycle_count / getCpuFrequencyMhz();
+  if (!ok)
+    M5.Log.printf("Error: the sampler allocated memory after initialization\n");
+  return ok;
 }
+#endif
 
 static void setup_impl()
 {
+  SetDefaultMemoryResource(&allocationCounter);
   M5.begin();
+#if ALLOCATION_CHECK
+  bool ok = check_allocations();
+#if defined(M5UNIFIED_PC_BUILD)
+  exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+#else
+  if (!ok)
+    abort();
+#endif
+#endif
   {
     // 無駄がないようにサンプルレートとバッファ長をSamplerの処理と揃えておく
     auto spk_cfg = M5.Speaker.config();
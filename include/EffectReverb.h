@@ -1,14 +1,9 @@
 #pragma once
 
 #include <cstdio>
-#include <EffectBase.h>
-
-#if defined ( ESP_PLATFORM )
-#include <esp_heap_caps.h>
-#else
-#include <cstdlib>
 #include <cstring>
-#endif
+#include <EffectBase.h>
+#include "MemoryResource.h"
 
 #define REVERB_DELAY_BASIS_COMB_0 3460
 #define REVERB_DELAY_BASIS_COMB_1 2988
@@ -27,23 +22,34 @@ namespace sampler
 class EffectReverb : public EffectBase
 {
 public:
-    EffectReverb(float level, float time, uint32_t bufferSize, uint32_t sampleRate) : level{level}, time{time}, bufferSize{bufferSize}, sampleRate{sampleRate}
+    // 遅延線のメモリはresourceから16バイト境界で確保する (既定ではDMA対応の内部SRAM)
+    EffectReverb(float level, float time, uint32_t bufferSize, uint32_t sampleRate, MemoryResource *resource = GetDmaMemoryResource())
+        : level{level}, time{time}, bufferSize{bufferSize}, sampleRate{sampleRate}, resource{resource}
     {
         Init();
     }
     ~EffectReverb()
     {
-        free(memory);
+        if (memory != nullptr)
+            resource->Deallocate(memory, memorySize, 16);
     }
+    EffectReverb(const EffectReverb &) = delete;
+    EffectReverb &operator=(const EffectReverb &) = delete;
     float level = 0.05f; // リバーブの強さ 入力の音量は変化しません(DRY/WETではありません)
     float time = 1.0f;  // リバーブの持続時間
     uint32_t bufferSize; // Processで渡されるinputおよびoutputの長さ　必ず4の倍数である必要がある
     uint32_t sampleRate;
     void Init();
     void Process(const float *input, float *output);
+    // 確保している遅延線のバイト数
+    size_t GetMemorySize() const { return memorySize; }
+    // Processがスタック上に確保する作業領域のバイト数
+    size_t GetStackSize() const { return bufferSize * 2 * sizeof(float); }
 
 private:
-    float *memory;
+    MemoryResource *resource;
+    float *memory = nullptr;
+    size_t memorySize = 0;
 };
 
 }
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace capsule
+{
+namespace sampler
+{
+
+    // 容量が固定されたコンテナ (SAMPLER_FIXED_CAPACITYが有効な場合にstd::deque・std::listの代わりに使用する)
+    // 要素は本体の中に確保され、初期化後にメモリを確保することはない
+    // 満杯の場合push_backはfalseを返し、要素は追加されない
+
+    // 先頭から取り出すキュー (リングバッファ)
+    template <class T, size_t N>
+    class FixedQueue
+    {
+    public:
+        bool empty() const { return count == 0; }
+        bool full() const { return count == N; }
+        size_t size() const { return count; }
+        static constexpr size_t capacity() { return N; }
+        T &front() { return items[head]; }
+        const T &front() const { return items[head]; }
+        bool push_back(const T &item)
+        {
+            if (count == N)
+                return false;
+            items[(head + count) % N] = item;
+            count++;
+            return true;
+        }
+        void pop_front()
+        {
+            head = (head + 1) % N;
+            count--;
+        }
+
+    private:
+        T items[N];
+        size_t head = 0;
+        size_t count = 0;
+    };
+
+    // 追加した順序を保つ配列 eraseは後ろの要素を詰める
+    template <class T, size_t N>
+    class FixedVector
+    {
+    public:
+        using iterator = T *;
+        using const_iterator = const T *;
+
+        iterator begin() { return items; }
+        iterator end() { return items + count; }
+        const_iterator begin() const { return items; }
+        const_iterator end() const { return items + count; }
+        bool empty() const { return count == 0; }
+        bool full() const { return count == N; }
+        size_t size() const { return count; }
+        static constexpr size_t capacity() { return N; }
+        T &front() { return items[0]; }
+        bool push_back(const T &item)
+        {
+            if (count == N)
+                return false;
+            items[count++] = item;
+            return true;
+        }
+        // 削除した要素の次の要素を指すイテレーターを返す
+        iterator erase(iterator position)
+        {
+            for (iterator p = position; p + 1 < end(); p++)
+                *p = *(p + 1);
+            count--;
+            return position;
+        }
+        void clear() { count = 0; }
+
+    private:
+        T items[N];
+        size_t count = 0;
+    };
+
+}
+}
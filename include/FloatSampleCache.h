@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include "MemoryResource.h"
+
+// 何回目の発音でfloatに変換するか (一度しか使われないサンプルでバジェットを使い切らないようにする)
+#ifndef FLOAT_SAMPLE_CACHE_ADMIT_COUNT
+#define FLOAT_SAMPLE_CACHE_ADMIT_COUNT 2
+#endif
+
+namespace capsule
+{
+namespace sampler
+{
+    struct Sample;
+
+    // よく使われる16bitリニアPCMのサンプルをfloatに変換して保持するキャッシュ
+    // 変換済みのサンプルはカーネルのint16_tからfloatへの変換を省略して再生される
+    // メモリに余裕のあるホスト環境での使用を想定している
+    // 音声処理スレッドからのみ使用すること
+    class FloatSampleCache
+    {
+    public:
+        // 変換したデータはresourceから確保する (既定ではPSRAM、なければ内部SRAM)
+        explicit FloatSampleCache(MemoryResource *resource = GetSlowMemoryResource()) : resource{resource} {}
+        ~FloatSampleCache();
+        FloatSampleCache(const FloatSampleCache &) = delete;
+        FloatSampleCache &operator=(const FloatSampleCache &) = delete;
+
+        // 変換したデータに使用するメモリのバイト数 0の場合はキャッシュを使用しない
+        // 減らした場合は変換済みのデータをすべて破棄する
+        void SetBudget(size_t budget);
+        size_t GetBudget() const { return budget; }
+        // sampleをfloatに変換したデータを返す
+        // FLOAT_SAMPLE_CACHE_ADMIT_COUNT回目に要求された時にバジェットの範囲で変換し、それまではnullptrを返す
+        // 返されたデータはsampleの終端の後ろにSAMPLE_GUARD_LENGTH個の0が続く
+        const float *Get(const Sample &sample);
+        // 保持しているデータをすべて破棄する (再生中のボイスがない時に呼ぶこと)
+        // 所有者を持たないポインターで作成したサンプルの波形データ(サンプルバンクなど)を解放した場合も呼ぶこと
+        void Clear();
+
+        size_t GetUsedSize() const { return used; }
+        size_t GetPeakUsedSize() const { return peakUsed; }
+        uint32_t GetEntryCount() const;
+        uint32_t GetHitCount() const { return hitCount; }
+        uint32_t GetMissCount() const { return missCount; }
+
+    private:
+        struct Entry
+        {
+            const int16_t *data;                // 元の波形データ (ownerの管理ブロックとあわせてキーにする)
+            uint32_t length;
+            std::weak_ptr<const int16_t> owner; // 元の波形データが解放されたかどうかの判定に使用する
+            bool owned;                         // ownerが有効かどうか (静的なデータの場合はfalse)
+            uint32_t uses;
+            float *floats;                      // 変換したデータ (まだ変換していない場合はnullptr)
+            size_t size;
+        };
+        std::vector<Entry> entries;
+        MemoryResource *resource;
+        size_t budget = 0;
+        size_t used = 0;
+        size_t peakUsed = 0;
+        uint32_t hitCount = 0;
+        uint32_t missCount = 0;
+
+        void Free(Entry &entry);
+    };
+
+}
+}
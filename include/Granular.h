@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+// Samplerが保持する粒(グレイン)の数 すべてのグラニュラーのボイスで共有する
+#ifndef GRANULAR_GRAIN_POOL_SIZE
+#define GRANULAR_GRAIN_POOL_SIZE 64
+#endif
+// グラニュラーのボイス1つあたりの処理コストの上限 (通常のボイス1つを1とした概算)
+// 同時に鳴っている粒のコストの合計がこれを超える場合、新しい粒は発生させない
+#ifndef GRANULAR_VOICE_BUDGET
+#define GRANULAR_VOICE_BUDGET 8.0f
+#endif
+
+namespace capsule
+{
+namespace sampler
+{
+    struct Sample;
+
+    // グラニュラー再生のパラメーター
+    // 元のサンプルから短い区間(粒)を次々に切り出し、窓を掛けて重ね合わせる
+    struct GranularSettings
+    {
+        std::shared_ptr<const Sample> source; // 粒を切り出すサンプル (直接参照できる16bitリニアPCMのみ)
+        float position = 0.0f;       // 発音時に粒を切り出す位置 (sourceの長さに対する割合 0〜1)
+        float speed = 1.0f;          // 切り出す位置を進める速さ (1で元の速さ、0で位置を固定する) 終端に達すると先頭に戻る
+        float positionJitter = 0.0f; // 粒ごとの位置のランダムな揺らぎ (sourceの長さに対する割合)
+        float grainLength = 0.05f;   // 粒の長さ (秒)
+        float density = 40.0f;       // 1秒あたりに発生させる粒の数
+        float pitchJitter = 0.0f;    // 粒ごとの音高のランダムな揺らぎ (半音)
+    };
+
+    // 粒1つの1サンプルあたりの処理コスト (通常のボイス1つを1とした概算)
+    // 補間に加えて窓を掛けて足し合わせる処理があり、読み進める量が多いほどメモリの読み出しも増える
+    inline float GetGrainCost(float pitch) { return 1.25f + 0.25f * pitch; }
+
+}
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#if defined(ESP_PLATFORM)
+#include <esp_partition.h>
+#endif
+
+namespace capsule
+{
+namespace sampler
+{
+
+    // ファイルやフラッシュのパーティションを読み取り専用でメモリにマップする
+    // マップできない環境では、全体をメモリに読み込んで同じように扱う
+    class MappedFile
+    {
+    public:
+        ~MappedFile();
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        // ファイルをマップする 失敗した場合はnullptrを返す
+        static std::shared_ptr<MappedFile> Open(const char *path);
+#if defined(ESP_PLATFORM)
+        // パーティションのoffsetバイト目からsizeバイトをマップする sizeが0の場合はパーティションの終端まで
+        static std::shared_ptr<MappedFile> Open(const esp_partition_t *partition, size_t offset = 0, size_t size = 0);
+#endif
+
+        const uint8_t *GetData() const { return data; }
+        size_t GetSize() const { return size; }
+
+    private:
+        MappedFile() {}
+        const uint8_t *data = nullptr;
+        size_t size = 0;
+        enum class Kind : uint8_t
+        {
+            HEAP, // メモリに読み込んだもの
+            MMAP, // mmapでマップしたもの
+            PARTITION, // パーティションをマップしたもの
+        } kind = Kind::HEAP;
+#if defined(ESP_PLATFORM)
+        uint32_t partitionHandle = 0;
+#endif
+    };
+
+}
+}
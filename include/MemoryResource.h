@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+namespace capsule
+{
+namespace sampler
+{
+
+    // メモリの確保と解放を行うインターフェース (std::pmr::memory_resourceに相当)
+    // 配置の方針を差し替えられるように、メモリを確保する処理はこれを受け取る
+    class MemoryResource
+    {
+    public:
+        virtual ~MemoryResource() {}
+        // 確保できなかった場合はnullptrを返す
+        virtual void *Allocate(size_t size, size_t alignment = alignof(std::max_align_t)) = 0;
+        virtual void Deallocate(void *p, size_t size, size_t alignment = alignof(std::max_align_t)) = 0;
+    };
+
+    // 高速なメモリ (ESP32では内部SRAM、ホスト環境ではmalloc)
+    MemoryResource *GetFastMemoryResource();
+    // 大容量だが低速なメモリ (ESP32ではPSRAM、なければ内部SRAM、ホスト環境ではmalloc)
+    MemoryResource *GetSlowMemoryResource();
+    // DMAで転送できるメモリ (ESP32ではDMA対応の内部SRAM、ホスト環境ではmalloc)
+    MemoryResource *GetDmaMemoryResource();
+    // 確保先を指定されなかったメモリの確保に使用するリソース (std::pmr::get_default_resourceに相当)
+    // 初期状態では通常のヒープ(mallocと同じ領域)から確保する
+    MemoryResource *GetDefaultMemoryResource();
+    // 既定のリソースを差し替えて、それまでのリソースを返す nullptrを渡すと初期状態に戻す
+    // 差し替える前に確保されたメモリは、確保したリソースで解放される
+    MemoryResource *SetDefaultMemoryResource(MemoryResource *resource);
+
+    // upstreamへの確保と解放の回数を数えるリソース
+    // SetDefaultMemoryResourceやSamplerMemoryResourcesに渡して、再生中にメモリを確保していないことを確かめるのに使用する
+    class CountingMemoryResource : public MemoryResource
+    {
+    public:
+        CountingMemoryResource(MemoryResource *upstream = GetDefaultMemoryResource()) : upstream{upstream} {}
+
+        void *Allocate(size_t size, size_t alignment = alignof(std::max_align_t)) override
+        {
+            allocationCount.fetch_add(1, std::memory_order_relaxed);
+            allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+            return upstream->Allocate(size, alignment);
+        }
+        void Deallocate(void *p, size_t size, size_t alignment = alignof(std::max_align_t)) override
+        {
+            deallocationCount.fetch_add(1, std::memory_order_relaxed);
+            upstream->Deallocate(p, size, alignment);
+        }
+
+        uint32_t GetAllocationCount() const { return allocationCount.load(std::memory_order_relaxed); }
+        uint32_t GetDeallocationCount() const { return deallocationCount.load(std::memory_order_relaxed); }
+        size_t GetAllocatedBytes() const { return allocatedBytes.load(std::memory_order_relaxed); }
+
+    private:
+        MemoryResource *upstream;
+        std::atomic<uint32_t> allocationCount{0};
+        std::atomic<uint32_t> deallocationCount{0};
+        std::atomic<size_t> allocatedBytes{0};
+    };
+
+    // MemoryResourceから確保するSTLコンテナ用のアロケーター (std::pmr::polymorphic_allocatorに相当)
+    // コンテナの代入やswapではリソースも一緒に移る
+    template <class T>
+    class MemoryResourceAllocator
+    {
+    public:
+        using value_type = T;
+        using propagate_on_container_copy_assignment = std::true_type;
+        using propagate_on_container_move_assignment = std::true_type;
+        using propagate_on_container_swap = std::true_type;
+
+        MemoryResourceAllocator() noexcept : resource{GetDefaultMemoryResource()} {}
+        MemoryResourceAllocator(MemoryResource *resource) noexcept : resource{resource} {}
+        template <class U>
+        MemoryResourceAllocator(const MemoryResourceAllocator<U> &other) noexcept : resource{other.GetResource()} {}
+
+        T *allocate(size_t n)
+        {
+            void *p = resource->Allocate(n * sizeof(T), alignof(T));
+            if (p == nullptr)
+            {
+#if defined(__cpp_exceptions)
+                throw std::bad_alloc();
+#else
+                abort();
+#endif
+            }
+            return static_cast<T *>(p);
+        }
+        void deallocate(T *p, size_t n)
+        {
+            resource->Deallocate(p, n * sizeof(T), alignof(T));
+        }
+        MemoryResource *GetResource() const { return resource; }
+
+    private:
+        MemoryResource *resource;
+    };
+    template <class T, class U>
+    bool operator==(const MemoryResourceAllocator<T> &a, const MemoryResourceAllocator<U> &b) { return a.GetResource() == b.GetResource(); }
+    template <class T, class U>
+    bool operator!=(const MemoryResourceAllocator<T> &a, const MemoryResourceAllocator<U> &b) { return a.GetResource() != b.GetResource(); }
+
+    // upstreamから最初に確保した固定容量の領域を先頭から順に切り出す
+    // 個別の解放は行わず、アリーナを破棄した時にまとめて解放する
+    class MemoryArena : public MemoryResource
+    {
+    public:
+        MemoryArena(size_t capacity, MemoryResource *upstream = GetFastMemoryResource());
+        ~MemoryArena();
+        MemoryArena(const MemoryArena &) = delete;
+        MemoryArena &operator=(const MemoryArena &) = delete;
+
+        void *Allocate(size_t size, size_t alignment = alignof(std::max_align_t)) override;
+        void Deallocate(void *, size_t, size_t = alignof(std::max_align_t)) override {}
+
+        size_t GetCapacity() const { return capacity; }
+        size_t GetUsed() const { return used; }
+
+    private:
+        MemoryResource *upstream;
+        uint8_t *memory;
+        size_t capacity;
+        size_t used = 0;
+    };
+
+}
+}
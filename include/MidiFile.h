@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include "MappedFile.h"
+#include "MidiMessage.h"
+
+namespace capsule
+{
+namespace sampler
+{
+
+    // スタンダードMIDIファイル (フォーマット0・1) を、変換せずにそのまま再生するためのクラス
+    // 読み込み時はトラックの位置を調べるだけで、イベントはCursorで再生しながら読み出す
+    // 必要なメモリはトラックの数に比例する分のみで、ファイルの大きさにはよらない
+    // 下記の制約があります
+    // * フォーマット2(独立した複数のシーケンス)には対応しない
+    // * チャンネルメッセージとテンポの変更(FF 51)のみ使用し、その他のメタイベントとシステムエクスクルーシブは読み飛ばす
+    class MidiFile
+    {
+    public:
+        // ファイルを読み込む 失敗した場合はnullptrを返す
+        static std::shared_ptr<MidiFile> Load(const char *path);
+        static std::shared_ptr<MidiFile> Load(std::shared_ptr<MappedFile> file);
+        // メモリ上のデータを参照する (コピーしないので、MidiFileを使用している間は呼び出し側で保持すること)
+        static std::shared_ptr<MidiFile> Load(const uint8_t *data, size_t size);
+
+        // トラックを時刻順に併合しながら、チャンネルメッセージを1つずつ読み出す
+        // 各トラックの読み出し位置を、次のイベントの時刻が小さい順に二分ヒープで管理する (k-way merge)
+        // 同じ時刻のイベントはトラック番号順に読み出される
+        // 作成時にトラックの数に比例するメモリを確保し、Reset・Next・コピー代入ではメモリを確保しない
+        class Cursor
+        {
+        public:
+            explicit Cursor(const MidiFile &file);
+            // 先頭に戻る
+            void Reset();
+            // 次のチャンネルメッセージをmessageに格納する timeはテンポの変更を反映した、先頭からのサンプル数(SAMPLE_RATE基準)
+            // すべてのトラックの終わりに達した場合はfalseを返す
+            bool Next(MidiMessage &message);
+            // 最後に読んだイベント(メタイベントを含む)の時刻
+            uint32_t GetTime() const { return time; }
+
+        private:
+            struct Track
+            {
+                const uint8_t *pos;    // 次のイベントの位置 (デルタタイムの後)
+                const uint8_t *end;
+                uint64_t tick;         // 次のイベントのティック
+                uint8_t runningStatus;
+            };
+            const MidiFile *file;
+            std::vector<Track> tracks;
+            std::vector<uint16_t> heap; // tracksの番号の二分ヒープ
+            size_t heapSize = 0;
+            uint64_t tempoTick = 0;       // 最後にテンポが変わったティック
+            double tempoTime = 0.0;       // tempoTickの時刻 (サンプル数)
+            double samplesPerTick = 0.0;  // 現在のテンポでの1ティックあたりのサンプル数
+            uint32_t time = 0;
+
+            bool Less(uint16_t a, uint16_t b) const { return tracks[a].tick < tracks[b].tick || (tracks[a].tick == tracks[b].tick && a < b); }
+            void SiftDown(size_t index);
+            // デルタタイムを読んで次のイベントのティックに進める トラックの終わりに達した場合はfalseを返す
+            static bool ReadDelta(Track &track);
+            // ヒープの先頭のトラックを次のイベントに進める 終わりに達した場合はヒープから取り除く
+            void AdvanceTop();
+            // 壊れたデータに達したヒープの先頭のトラックを終わらせる
+            void EndTop();
+            double GetTickTime(uint64_t tick) const { return tempoTime + (tick - tempoTick) * samplesPerTick; }
+            void SetTempo(uint32_t microsecondsPerQuarter);
+        };
+
+        uint16_t GetFormat() const { return format; }
+        size_t GetTrackCount() const { return tracks.size(); }
+        // 4分音符あたりのティック数 (SMPTE形式の場合は0)
+        uint16_t GetTicksPerQuarter() const { return division & 0x8000 ? 0 : division; }
+        // 最後のイベント(トラックの終わりを含む)の時刻 (サンプル数)
+        uint32_t GetLength() const { return length; }
+
+    private:
+        MidiFile() {}
+        bool Parse(const uint8_t *data, size_t size);
+
+        // トラックチャンクのデータの範囲
+        struct TrackRange
+        {
+            const uint8_t *begin;
+            const uint8_t *end;
+        };
+        std::shared_ptr<MappedFile> file;
+        std::vector<TrackRange> tracks;
+        uint16_t format = 0;
+        uint16_t division = 0;
+        uint32_t length = 0;
+    };
+
+}
+}
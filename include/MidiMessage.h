@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+
+// 時刻付きのMIDIメッセージ (examples/music/MidiToArray.pyでMIDIファイルから生成できる)
+// 曲はtimeの昇順に並べた配列で表し、末尾に曲の終わりを表す {time, 0xFF, 0x2F, 0x00} を置く
+struct MidiMessage
+{
+    uint32_t time; // 曲の先頭からのサンプル数 (SAMPLE_RATE基準)
+    uint8_t status;
+    uint8_t data1;
+    uint8_t data2;
+};
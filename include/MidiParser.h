@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+
+namespace capsule
+{
+namespace sampler
+{
+
+    // MIDI 1.0のバイト列を1バイトずつ解釈してチャンネルメッセージを取り出す
+    // ランニングステータス、メッセージの途中に挟まれたリアルタイムメッセージ(0xF8〜0xFF)、
+    // システムエクスクルーシブとシステムコモンメッセージの読み飛ばしに対応する
+    // メモリの確保もロックも行わないので、割り込みハンドラーからも使用できる
+    // 入力ごと(UART・USBなど)に別々のインスタンスを使用すること
+    class MidiParser
+    {
+    public:
+        // 完成したチャンネルメッセージ (statusの下位4bitがチャンネル)
+        // データバイトが1つのメッセージ(プログラムチェンジなど)ではdata2は0になる
+        struct Message
+        {
+            uint8_t status;
+            uint8_t data1;
+            uint8_t data2;
+        };
+
+        // byteを解釈し、チャンネルメッセージが完成した場合はtrueを返してmessageに格納する
+        // ベロシティ0のノートオンはノートオフ(ベロシティ0)として返す
+        bool Parse(uint8_t byte, Message &message);
+        // 解釈の途中の状態とランニングステータスを破棄する (受信エラーの後などに呼ぶ)
+        void Reset();
+
+    private:
+        uint8_t status = 0;   // 解釈中のメッセージのステータス (0の場合はデータバイトを読み飛ばす)
+        uint8_t data1 = 0;
+        uint8_t dataCount = 0; // 受け取ったデータバイトの数
+        uint8_t dataLength = 0; // statusのメッセージのデータバイトの数
+    };
+
+}
+}
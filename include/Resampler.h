@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include "Sampler.h"
+
+namespace capsule
+{
+namespace sampler
+{
+
+    // 読み込み時にサンプリング周波数を変換するためのリサンプラー
+    // 窓関数(Blackman)付きのsinc補間を使用するため高品質だが、再生中に使用できるほど高速ではない
+
+    // srcRateのlength個のサンプルをdstRateに変換した時の長さ
+    uint32_t GetResampledLength(uint32_t length, uint32_t srcRate, uint32_t dstRate);
+    // srcをdstRateに変換してdstに書き込む dstにはGetResampledLength個の領域が必要
+    // floatの場合は[-1.0, 1.0]の範囲を16bitに変換する
+    void Resample(const float *src, uint32_t length, uint32_t srcRate, uint32_t dstRate, int16_t *dst);
+    void Resample(const int16_t *src, uint32_t length, uint32_t srcRate, uint32_t dstRate, int16_t *dst);
+
+    // 16bitリニアPCMのサンプルをdstRateに変換した新しいサンプルを作成する 失敗した場合はnullptrを返す
+    // ループポイントは変換後の最も近い位置に移し、その他のパラメーターは引き継ぐ
+    // サンプルバンクの作成時や読み込み時に一度変換しておくことで、再生時のピッチの補正が不要になる
+    // 波形データの後ろには、highestNoteまで再生できる分の無音(GetSampleGuardLength)を確保する
+    std::shared_ptr<Sample> ResampleSample(const Sample &sample, uint32_t dstRate = SAMPLE_RATE, uint8_t highestNote = 127);
+
+    // 16bitリニアPCMのサンプルに、サンプリング周波数を1/2ずつ下げたlevelCount個のレベル(halfRate)を作成する
+    // 高い音高で再生するボイスは読み進める間隔が1サンプル以下になるレベルを使用するため、折り返しが抑えられメモリの読み出しも減る
+    // ループするサンプルはループ長が整数になるように変換の比を調整し、その分の音高の差はtuneで補正する
+    // 再生に使用する前に呼ぶこと 作成できなかった場合はfalseを返す
+    bool GenerateMipmaps(Sample &sample, uint32_t levelCount = 2);
+
+}
+}
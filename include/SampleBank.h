@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include "Sampler.h"
+#include "MappedFile.h"
+#include "SampleEdit.h"
+
+#define SAMPLE_BANK_VERSION 2
+// バージョン1のサンプルテーブルの1項目のバイト数 (sampleRateとtuneがない)
+#define SAMPLE_BANK_V1_SAMPLE_ENTRY_SIZE 48
+// テーブルと波形データの配置境界 (SIMD命令でそのまま読めるようにする)
+#define SAMPLE_BANK_ALIGNMENT 16
+
+namespace capsule
+{
+namespace sampler
+{
+
+    // サンプルバンクのファイル形式
+    // [ヘッダー][サンプルテーブル][ティンバーテーブル][ゾーンテーブル][波形データ...]
+    // 値はすべてリトルエンディアンで、各テーブルと各サンプルの波形データはSAMPLE_BANK_ALIGNMENTバイト境界に配置される
+    // 16bitリニアPCMの波形データの後ろには、ゾーンの最も高いノートまで再生できる分(GetSampleGuardLength)の無音が置かれる
+    // オフセットはすべてファイル先頭からのバイト数
+    struct SampleBankHeader
+    {
+        char magic[4]; // "CSBK"
+        uint16_t version;
+        uint16_t headerSize;
+        uint32_t fileSize;
+        uint32_t sampleCount;
+        uint32_t sampleTableOffset;
+        uint32_t timbreCount;
+        uint32_t timbreTableOffset;
+        uint32_t zoneCount;
+        uint32_t zoneTableOffset;
+        uint32_t reserved[3];
+    };
+    struct SampleBankSampleEntry
+    {
+        uint32_t dataOffset;
+        uint32_t dataSize;
+        uint32_t length;
+        uint32_t loopStart;
+        uint32_t loopEnd;
+        float attack;
+        float decay;
+        float sustain;
+        float release;
+        uint8_t root;
+        uint8_t format; // SampleFormat
+        uint8_t flags;  // SAMPLE_BANK_FLAG_*
+        uint8_t reserved;
+        AdpcmState adpcmStart;
+        AdpcmState adpcmLoop;
+        uint32_t sampleRate; // 以下はバージョン2で追加
+        float tune;
+    };
+    struct SampleBankTimbreEntry
+    {
+        uint32_t firstZone; // ゾーンテーブル上の最初のゾーンの番号
+        uint32_t zoneCount;
+    };
+    struct SampleBankZoneEntry
+    {
+        uint32_t sampleIndex;
+        uint8_t lowerNoteNo;
+        uint8_t upperNoteNo;
+        uint8_t lowerVelocity;
+        uint8_t upperVelocity;
+    };
+    static constexpr uint8_t SAMPLE_BANK_FLAG_ADSR_ENABLED = 0x01;
+    static_assert(sizeof(SampleBankHeader) == 48, "SampleBankHeader must be 48 bytes");
+    static_assert(sizeof(SampleBankSampleEntry) == 56, "SampleBankSampleEntry must be 56 bytes");
+    static_assert(sizeof(SampleBankZoneEntry) == 8, "SampleBankZoneEntry must be 8 bytes");
+
+    // サンプルバンクを読み込み、マップされたデータを直接参照するサンプルとティンバーを提供する
+    // 波形データはコピーされず、サンプルごとのメモリ確保も行われない
+    // 各サンプルやティンバーが使用されている間はバンクも解放されない
+    class SampleBank : public std::enable_shared_from_this<SampleBank>
+    {
+    public:
+        // ファイルを読み込む (mmapできる環境ではmmapを使用する) 失敗した場合はnullptrを返す
+        static std::shared_ptr<SampleBank> Load(const char *path);
+#if defined(ESP_PLATFORM)
+        // パーティションをマップして読み込む
+        static std::shared_ptr<SampleBank> Load(const esp_partition_t *partition);
+#endif
+        static std::shared_ptr<SampleBank> Load(std::shared_ptr<MappedFile> file);
+
+        size_t GetSampleCount() const { return samples.size(); }
+        std::shared_ptr<const Sample> GetSample(size_t index);
+        size_t GetTimbreCount() const { return timbreCount; }
+        // ゾーンテーブルからティンバーを作成する
+        std::shared_ptr<Timbre> GetTimbre(size_t index);
+        // 各サンプルのループ区間と先頭headLengthサンプルを、fastから確保した領域(MemoryArenaなど)にコピーする
+        // すべてのサンプルのループ区間を先頭部分より優先し、確保できなかった部分はマップされた領域から再生される
+        // コピーしたバイト数を返す 再生を始める前に呼ぶこと
+        size_t PlaceHotRegions(std::shared_ptr<MemoryResource> fast, uint32_t headLength = SAMPLE_FAST_HEAD_LENGTH);
+        // 16bitリニアPCMの各サンプルにミップマップ(GenerateMipmaps)を作成する 作成されたレベルはメモリ上に置かれる
+        // 再生を始める前に呼ぶこと
+        void GenerateMipmaps(uint32_t levelCount = 2);
+
+        explicit SampleBank(std::shared_ptr<MappedFile> file) : file{std::move(file)} {}
+
+    private:
+        bool Parse();
+        std::shared_ptr<MappedFile> file;
+        std::vector<Sample> samples;
+        const SampleBankTimbreEntry *timbres = nullptr;
+        const SampleBankZoneEntry *zones = nullptr;
+        uint32_t timbreCount = 0;
+    };
+
+    // サンプルバンクのファイルを作成する
+    class SampleBankWriter
+    {
+    public:
+        struct Zone
+        {
+            uint32_t sampleIndex; // AddSampleが返した番号
+            uint8_t lowerNoteNo;
+            uint8_t upperNoteNo;
+            uint8_t lowerVelocity;
+            uint8_t upperVelocity;
+        };
+        // サンプルを追加してその番号を返す (ストリーミング再生するサンプルは追加できない)
+        // 他のサンプルの波形データの一部を参照しているスライスは、波形データを複製せずにその範囲を参照するように書き込まれる
+        uint32_t AddSample(std::shared_ptr<const Sample> sample);
+        // ゾーンの集合をティンバーとして追加してその番号を返す (ゾーンの制約はTimbreと同じ)
+        uint32_t AddTimbre(std::vector<Zone> zones);
+        // ループする16bitリニアPCMのサンプルのloopEndより後ろを、guardLengthサンプルだけ残して書き込むかどうか (TrimAfterLoop)
+        // guardLengthが0の場合は、サンプルを参照するゾーンの最も高いノートまで再生できる分(GetSampleGuardLength)を残す 既定で有効
+        void SetTrimAfterLoop(bool enabled, uint32_t guardLength = 0);
+        // ループする16bitリニアPCMのサンプルのループ末尾に、fadeLengthサンプルのクロスフェード(BakeLoopCrossfade)を書き込むかどうか
+        // 加工した波形がファイルに書き込まれるため、読み込み時にコピーは発生しない 既定で無効
+        void SetLoopCrossfade(bool enabled, uint32_t fadeLength = SAMPLE_LOOP_CROSSFADE_LENGTH);
+        // ファイルの内容を作成する
+        std::vector<uint8_t> Build() const;
+        bool Write(const char *path) const;
+        // 書き込まれる各サンプル・各ティンバーの波形データのバイト数と、切り詰めで削減されるバイト数を出力する
+        void PrintReport() const;
+
+    private:
+        std::vector<std::shared_ptr<const Sample>> samples;
+        std::vector<std::vector<Zone>> timbres;
+        bool trimAfterLoop = true;
+        uint32_t trimGuardLength = 0;
+        bool loopCrossfade = false;
+        uint32_t loopCrossfadeLength = SAMPLE_LOOP_CROSSFADE_LENGTH;
+
+        // 書き込むサンプル(クロスフェードを書き込み、切り詰めた後のもの)と、各サンプルが波形データを参照するサンプルの番号を求める
+        void Prepare(std::vector<std::shared_ptr<const Sample>> &prepared, std::vector<size_t> &owners) const;
+        // 各サンプルを参照するゾーンの最も高いノート (どのゾーンからも参照されないサンプルは127)
+        std::vector<uint8_t> GetHighestNotes() const;
+    };
+
+}
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include "SampleCodec.h"
+#include "MemoryResource.h"
+
+// デコード済みのブロックを保持しておくキャッシュのブロック数
+#ifndef SAMPLE_BLOCK_CACHE_SIZE
+#define SAMPLE_BLOCK_CACHE_SIZE 64
+#endif
+
+namespace capsule
+{
+namespace sampler
+{
+    struct Sample;
+
+    // ロスレス形式のサンプルをブロック単位でデコードして保持するLRUキャッシュ
+    // 同じサンプルを再生するボイス間でデコード結果が共有されるため、持続するループは一度デコードすれば以降はキャッシュから再生される
+    // 符号化データの所有者が解放されたブロックは参照されなくなり、次に追い出すブロックとして優先して再利用される
+    // Initを除き、音声処理スレッドからのみ使用すること
+    class SampleBlockCache
+    {
+    public:
+        // キャッシュ用のメモリはresourceから確保する
+        explicit SampleBlockCache(MemoryResource *resource = GetDefaultMemoryResource()) : resource{resource} {}
+        ~SampleBlockCache();
+
+        // キャッシュ用のメモリを確保する (既に確保している場合は何もしない)
+        void Init();
+        bool IsInitialized() const { return memory != nullptr; }
+        // 確保しているキャッシュ用のメモリのバイト数 (Initを呼ぶまでは0)
+        size_t GetMemorySize() const { return memory ? SAMPLE_BLOCK_CACHE_SIZE * LOSSLESS_BLOCK_SIZE * sizeof(int16_t) : 0; }
+        // 保持しているブロックをすべて破棄する
+        void Clear();
+        // sampleのblock番目のデコード済みデータを返す キャッシュになければデコードしてから返す
+        // hintに前回返されたエントリーの番号を渡すと検索を省略できる (呼び出し後に今回のエントリーの番号に更新される)
+        const int16_t *Get(const Sample &sample, uint32_t block, int16_t &hint);
+
+        uint32_t GetHitCount() const { return hitCount; }
+        uint32_t GetDecodeCount() const { return decodeCount; }
+
+    private:
+        struct Entry
+        {
+            const uint8_t *data = nullptr; // サンプルの符号化データ (同じデータを参照するサンプル間でも共有される)
+            std::weak_ptr<const uint8_t> owner; // 符号化データの所有者 (解放された後に同じアドレスへ確保されたデータと区別する)
+            bool owned = false;                 // ownerが有効かどうか (静的なデータの場合はfalse)
+            uint32_t block = 0;
+            uint32_t lastUsed = 0;
+        };
+        // entryがsampleの符号化データのblock番目を保持しているかどうか
+        static bool Matches(const Entry &entry, const Sample &sample, uint32_t block);
+
+        Entry entries[SAMPLE_BLOCK_CACHE_SIZE];
+        MemoryResource *resource;
+        int16_t *memory = nullptr;
+        uint32_t clock = 0;
+        uint32_t hitCount = 0;
+        uint32_t decodeCount = 0;
+    };
+
+}
+}
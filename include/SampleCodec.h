@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+// ロスレス形式で1ブロックに格納するサンプル数
+#ifndef LOSSLESS_BLOCK_SIZE
+#define LOSSLESS_BLOCK_SIZE 256
+#endif
+
+namespace capsule
+{
+namespace sampler
+{
+    struct Sample;
+
+    // サンプルの波形データの格納形式
+    enum class SampleFormat : uint8_t
+    {
+        PCM16, // 16bitリニアPCM
+        MULAW, // 8bit μ-law (ITU-T G.711) 1サンプルにつき1バイト
+        ADPCM, // 4bit IMA ADPCM 1バイトに2サンプル (下位4bitが先)
+        LOSSLESS, // 固定長ブロックごとの線形予測+Rice符号による可逆圧縮 デコード結果はSampleBlockCacheに保持される
+    };
+
+    // IMA ADPCMのデコーダーの状態
+    struct AdpcmState
+    {
+        int16_t predictor; // 直前にデコードしたサンプルの値
+        uint8_t stepIndex;
+    };
+
+    // 符号化されたcount個のサンプルが占めるバイト数 (ロスレス形式は可変長なので0を返す)
+    uint32_t GetEncodedSize(SampleFormat format, uint32_t count);
+
+    // dataのpos番目からcount個のサンプルをデコードしてdstに書き込む
+    void DecodeMulaw(const uint8_t *data, uint32_t pos, uint32_t count, int16_t *dst);
+    // stateはpos番目のサンプルをデコードする直前の状態で、デコード後の状態に更新される
+    void DecodeAdpcm(const uint8_t *data, uint32_t pos, uint32_t count, AdpcmState &state, int16_t *dst);
+    // ロスレス形式のblock番目のブロックをデコードしてdstに書き込む lengthはサンプル全体の長さ
+    void DecodeLosslessBlock(const uint8_t *data, uint32_t length, uint32_t block, int16_t *dst);
+    // ロスレス形式の符号化データ全体のバイト数 (ブロックのインデックスを含む)
+    uint32_t GetLosslessSize(const uint8_t *data);
+    // ファイルなどから読み込んだsizeバイトのロスレス形式のデータ(長さlength)が、デコードしても範囲外を読まないかどうかを調べる
+    // ブロックのインデックス、各ブロックのヘッダー、符号がそれぞれのブロック内に収まっていることを確かめる
+    bool ValidateLosslessData(const uint8_t *data, uint32_t size, uint32_t length);
+
+    // 16bitリニアPCMのサンプルを指定した形式に符号化した新しいサンプルを作成する
+    // ループポイントとADSRは引き継がれ、ADPCMの場合はloopStartでのデコーダーの状態も記録される
+    std::shared_ptr<Sample> EncodeSample(const Sample &sample, SampleFormat format);
+
+}
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include "Sampler.h"
+
+// BakeLoopCrossfadeの既定のクロスフェードの長さ (サンプル数)
+#ifndef SAMPLE_LOOP_CROSSFADE_LENGTH
+#define SAMPLE_LOOP_CROSSFADE_LENGTH 512
+#endif
+
+namespace capsule
+{
+namespace sampler
+{
+
+    // 読み込み時やサンプルバンクの作成時にサンプルの波形データを加工する関数
+    // いずれも16bitリニアPCMのサンプルのみに対応し、元のサンプルは変更せずに新しいサンプルを返す (失敗した場合はnullptr)
+    // ミップマップ・高速なメモリへの配置などは引き継がれないので、加工した後に行うこと
+
+    // ループ区間の末尾fadeLengthサンプルを、loopStartの直前の波形へ等パワーでクロスフェードさせたサンプルを作成する
+    // loopEndからloopStartに戻る時の不連続がなくなるため、再生時の処理を増やさずにループのクリックノイズを抑えられる
+    // fadeLengthはループ長とloopStartを超えないように短縮される ループしないサンプルはそのまま複製される
+    std::shared_ptr<Sample> BakeLoopCrossfade(const Sample &sample, uint32_t fadeLength = SAMPLE_LOOP_CROSSFADE_LENGTH);
+    // ループするサンプルのloopEndより後ろの波形データを、guardLengthサンプルだけ残して切り詰めたサンプルを作成する
+    // ループが有効なサンプルはloopEndを超えて再生されないが、カーネルは折り返す前にADSR_UPDATE_SAMPLE_COUNT * pitch + 2サンプル先まで読むため、
+    // 再生する最も高い音高に応じた分を残す必要がある guardLengthが0の場合はGetSampleGuardLength(sample)を残す
+    // 波形データは複製せずに元のサンプルのデータを参照する ループしないサンプルはそのまま参照する
+    std::shared_ptr<Sample> TrimAfterLoop(const Sample &sample, uint32_t guardLength = 0);
+
+}
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <memory>
+#include <vector>
+#if defined(FREERTOS)
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#else
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
+#include "SampleStream.h"
+#include "MemoryResource.h"
+
+namespace capsule
+{
+namespace sampler
+{
+    struct Sample;
+
+    // メモリ使用量の上限(バジェット)を設けてサンプルの波形データを管理する
+    // 各サンプルは先頭部分のみを常駐させたストリーミング再生用のサンプルとして作成され、
+    // 初めて発音された時に残りの部分(本体)がバックグラウンドでメモリに読み込まれる
+    // 本体が読み込まれるまではストリーミング再生され、読み込まれた後はメモリから再生される
+    // バジェットを超える場合は、再生中でないサンプルのうち最も長く使われていないものから本体を解放する
+    // 読み込みと解放はすべて管理スレッドで行われるため、音色の変更や発音で音声処理スレッドが待たされることはない
+    class SampleManager
+    {
+    public:
+        // budgetは本体の読み込みに使用するメモリのバイト数 (常駐する先頭部分は含まない)
+        // 本体はresourceから確保する (既定ではPSRAM、なければ内部SRAM)
+        SampleManager(size_t budget, MemoryResource *resource = GetSlowMemoryResource());
+        ~SampleManager();
+        SampleManager(const SampleManager &) = delete;
+        SampleManager &operator=(const SampleManager &) = delete;
+
+        // 管理されるサンプルを作成する 引数はCreateStreamingSampleと同じ
+        // 作成されたサンプルはSampleManagerより長く存在しても構わない (その場合は読み込みと解放が行われなくなる)
+        std::shared_ptr<Sample> AddSample(std::shared_ptr<StreamSource> source, uint32_t length, uint32_t headLength, uint8_t root, uint32_t loopStart, uint32_t loopEnd, bool adsrEnabled, float attack, float decay, float sustain, float release);
+
+        // バジェットを変更する 超過している分は管理スレッドで解放される
+        void SetBudget(size_t budget);
+        size_t GetBudget() const;
+        // 読み込まれている本体の合計バイト数
+        size_t GetResidentSize() const;
+        // 本体を読み込んだ回数と解放した回数
+        uint32_t GetLoadCount() const;
+        uint32_t GetEvictionCount() const;
+
+    private:
+        struct Core;
+        class ManagedSource;
+        std::shared_ptr<Core> core; // 作成したサンプルと共有する
+        std::atomic<bool> running{false};
+
+        void Run();
+        bool Load(const std::vector<std::shared_ptr<ManagedSource>> &sources, ManagedSource &source);
+        void Evict(ManagedSource &source);
+        // 合計がバジェット以下になるように、再生中でない本体を古い順に解放する excludeは解放しない
+        bool MakeRoom(const std::vector<std::shared_ptr<ManagedSource>> &sources, size_t required, const ManagedSource *exclude);
+#if defined(FREERTOS)
+        TaskHandle_t task = NULL;
+        std::atomic<bool> taskFinished{false};
+        static void TaskEntry(void *arg);
+#else
+        std::thread thread;
+        std::mutex wakeMutex;
+        std::condition_variable wakeCondition;
+#endif
+    };
+
+}
+}
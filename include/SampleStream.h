@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include "MemoryResource.h"
+#if defined(FREERTOS)
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#else
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
+#if defined(ESP_PLATFORM)
+#include <esp_partition.h>
+#endif
+
+// ストリーミング再生時にローダーが一度に読み込むサンプル数
+#ifndef STREAM_BLOCK_SIZE
+#define STREAM_BLOCK_SIZE 512
+#endif
+
+// ボイスごとのリングバッファが持つブロック数
+// 再生位置よりこのブロック数ぶん先までを先読みしておく
+#ifndef STREAM_BLOCK_COUNT
+#define STREAM_BLOCK_COUNT 4
+#endif
+
+// ストリーミング再生を同時に行えるボイス数
+#ifndef STREAM_SLOT_COUNT
+#define STREAM_SLOT_COUNT 32
+#endif
+
+namespace capsule
+{
+namespace sampler
+{
+    struct Sample;
+
+    // ストリーミング再生するサンプルのデータ供給元
+    // Readはローダースレッドからのみ呼ばれます
+    class StreamSource
+    {
+    public:
+        virtual ~StreamSource() {}
+        // offset(サンプル単位)から最大count個のサンプルをdstに読み込み、読み込めたサンプル数を返す
+        virtual uint32_t Read(uint32_t offset, int16_t *dst, uint32_t count) = 0;
+        // ボイスがストリーミング再生を始める時(音声処理スレッド)と終えた時(ローダースレッド)に呼ばれる
+        // 待ち時間が発生する処理は行わないこと
+        virtual void Acquire() {}
+        virtual void Release() {}
+    };
+
+    // ファイルから16bitリニアPCM(リトルエンディアン)を読み込む
+    // ホスト環境の通常のファイルのほか、ESP-IDFのVFSにマウントされたファイルにも使用できる
+    class FileStreamSource : public StreamSource
+    {
+    public:
+        // dataOffsetはファイル先頭から波形データまでのバイト数 (WAVファイルのヘッダーを読み飛ばす場合などに使用)
+        FileStreamSource(const char *path, uint32_t dataOffset = 0);
+        ~FileStreamSource();
+        bool IsOpen() const { return file != nullptr; }
+        uint32_t Read(uint32_t offset, int16_t *dst, uint32_t count) override;
+
+    private:
+        FILE *file;
+        uint32_t dataOffset;
+    };
+
+#if defined(ESP_PLATFORM)
+    // フラッシュのパーティションから16bitリニアPCMを読み込む
+    class PartitionStreamSource : public StreamSource
+    {
+    public:
+        // dataOffsetはパーティション先頭から波形データまでのバイト数
+        PartitionStreamSource(const esp_partition_t *partition, uint32_t dataOffset = 0) : partition{partition}, dataOffset{dataOffset} {}
+        uint32_t Read(uint32_t offset, int16_t *dst, uint32_t count) override;
+
+    private:
+        const esp_partition_t *partition;
+        uint32_t dataOffset;
+    };
+#endif
+
+    // 先頭 headLength サンプルのみをメモリに読み込んだストリーミング再生用のサンプルを作成する
+    // 残りのデータは再生中にSampleStreamerによってsourceから読み込まれる
+    // headLengthはローダーがリングバッファを満たすまでの時間を稼げる長さにしておくこと
+    std::shared_ptr<Sample> CreateStreamingSample(std::shared_ptr<StreamSource> source, uint32_t length, uint32_t headLength, uint8_t root, uint32_t loopStart, uint32_t loopEnd, bool adsrEnabled, float attack, float decay, float sustain, float release);
+
+    // ストリーミング再生するボイスのために、バックグラウンドでデータを先読みする
+    // ボイスごとにリングバッファ(スロット)を割り当て、再生位置の数ブロック先までを埋めておく
+    // データの到着が間に合わなかった場合は、待たずに無音として扱う
+    class SampleStreamer
+    {
+    public:
+        // リングバッファはresourceから確保する (既定ではPSRAM、なければ内部SRAM)
+        explicit SampleStreamer(MemoryResource *resource = GetSlowMemoryResource()) : resource{resource} {}
+        ~SampleStreamer();
+
+        // リングバッファを確保し、ローダースレッドを起動する (既に起動している場合は何もしない)
+        // 音声処理スレッド以外から呼ぶこと
+        void Start();
+        // ローダースレッドを停止する
+        void Stop();
+        bool IsRunning() const { return running.load(); }
+
+        // 以下は音声処理スレッドから呼ばれる
+        // 空いているスロットをsampleのために確保し、先読みを開始する 空きがない場合は-1を返す
+        int8_t Open(const std::shared_ptr<const Sample> &sample);
+        // スロットを解放する
+        void Close(int8_t slot);
+        // スロットからcount個のサンプルを取り出してdstに書き込む
+        // 先読みが間に合っていない部分は0で埋める 実際に読み出せたサンプル数を返す
+        uint32_t Consume(int8_t slot, int16_t *dst, uint32_t count);
+
+        // 先読みが間に合わず無音で埋めた回数
+        uint32_t GetUnderrunCount() const { return underrunCount.load(std::memory_order_relaxed); }
+        // 確保しているリングバッファのバイト数 (Startを呼ぶまでは0)
+        size_t GetMemorySize() const { return memory ? STREAM_SLOT_COUNT * RING_SIZE * sizeof(int16_t) : 0; }
+
+    private:
+        static constexpr uint32_t RING_SIZE = STREAM_BLOCK_SIZE * STREAM_BLOCK_COUNT;
+        enum SlotState : uint8_t
+        {
+            FREE,    // 未使用
+            ACTIVE,  // 再生中 (ローダーが先読みを行う)
+            CLOSING, // 再生終了 (ローダーがFREEに戻す)
+        };
+        struct Slot
+        {
+            std::atomic<uint8_t> state{FREE};
+            std::shared_ptr<const Sample> sample; // ACTIVEの間はローダーのみが参照する
+            int16_t *ring = nullptr;
+            // 以下の位置はストリーム先頭(サンプルのheadLength)からの通算サンプル数
+            std::atomic<uint32_t> written{0};  // ローダーが書き込み済みの位置
+            std::atomic<uint32_t> consumed{0}; // ボイスが読み出し済みの位置
+            uint32_t fetchPos = 0;             // ローダーが次に読み込むサンプル上の位置
+        };
+        Slot slots[STREAM_SLOT_COUNT];
+        MemoryResource *resource;
+        int16_t *memory = nullptr;
+        std::atomic<bool> running{false};
+        std::atomic<uint32_t> underrunCount{0};
+
+        void Run();
+        bool Fill(Slot &slot);
+        void Wake();
+#if defined(FREERTOS)
+        TaskHandle_t task = NULL;
+        std::atomic<bool> taskFinished{false};
+        static void TaskEntry(void *arg);
+#else
+        std::thread thread;
+        std::mutex wakeMutex;
+        std::condition_variable wakeCondition;
+#endif
+    };
+
+}
+}
@@ -16,6 +16,17 @@
 #endif
 
 #include "EffectReverb.h"
+#include "SampleStream.h"
+#include "SampleCodec.h"
+#include "SampleBlockCache.h"
+#include "MemoryResource.h"
+#include "FloatSampleCache.h"
+#include "FixedContainer.h"
+#include "Wavetable.h"
+#include "Granular.h"
+#include "MidiParser.h"
+#include "Sequencer.h"
+#include "TimerWheel.h"
 
 // ADSR更新周期 (サンプル数)
 // ※ ADSRの更新周期が短いほど、ADSRの変化が滑らかになりますが、CPU負荷が増加します
@@ -26,9 +37,48 @@
 #define SAMPLE_BUFFER_SIZE (ADSR_UPDATE_SAMPLE_COUNT * 2)
 #define SAMPLE_RATE 48000
 
+// 直接参照できないサンプル(ストリーミング再生など)を再生する際に、ボイスごとに波形を展開しておくバッファのサンプル数
+// 補間のために1サンプル余分に必要となるため、カーネルが一度に処理する4サンプル+1より大きいこと
+#define SAMPLE_WINDOW_SIZE (ADSR_UPDATE_SAMPLE_COUNT * 2 + 4)
+
+// PlaceHotRegionsで高速なメモリにコピーする先頭部分(アタック)のサンプル数の既定値
+#ifndef SAMPLE_FAST_HEAD_LENGTH
+#define SAMPLE_FAST_HEAD_LENGTH 2048
+#endif
+// 波形データの終端(ループする場合はloopEnd)より後ろに確保しておくサンプル数の既定値
+// カーネルは終端を判定する前に最大でADSR_UPDATE_SAMPLE_COUNT * pitch + 2サンプル先まで読み進めるため、再生する最も高い音高に比例して必要になる
+// 既定値はpitch 16 (4オクターブ上) まで再生できる量で、それより高く再生する場合はGetSampleGuardLengthで求める
+#ifndef SAMPLE_GUARD_LENGTH
+#define SAMPLE_GUARD_LENGTH (ADSR_UPDATE_SAMPLE_COUNT * 16 + 2)
+#endif
+
 #define MAX_SOUND 32 // 最大同時発音数
 #define CH_COUNT 16  // サンプラーはMIDIと同様に16個のチャンネルを持つ
 
+// 1にすると、メッセージのキューと発音中のノートの一覧を固定容量のコンテナにする
+// 初期化後はProcessやNoteOnなどの呼び出しでメモリを確保しなくなる
+#ifndef SAMPLER_FIXED_CAPACITY
+#define SAMPLER_FIXED_CAPACITY 0
+#endif
+// SAMPLER_FIXED_CAPACITYが有効な場合に、Processまでに溜めておけるメッセージの数 (超えた分は破棄される)
+#ifndef SAMPLER_MESSAGE_QUEUE_CAPACITY
+#define SAMPLER_MESSAGE_QUEUE_CAPACITY 256
+#endif
+// PostMidi・PostEventsでまとめてキューに追加するメッセージの数、およびProcessがキューからまとめて取り出す数
+// スタック上に1メッセージあたり6バイトの領域を使用する
+#ifndef SAMPLER_POST_BATCH_SIZE
+#define SAMPLER_POST_BATCH_SIZE 32
+#endif
+// SAMPLER_FIXED_CAPACITYが有効な場合に、1チャンネルで離鍵を待っておけるノートの数 (超えた場合は最も古いノートを離鍵させる)
+#ifndef SAMPLER_CHANNEL_NOTE_CAPACITY
+#define SAMPLER_CHANNEL_NOTE_CAPACITY MAX_SOUND
+#endif
+// ScheduleEventで予約しておけるイベントの数 (超えた分は予約されない)
+// 1イベントあたり約40バイトの領域をSampler本体の中に確保する
+#ifndef SAMPLER_SCHEDULE_CAPACITY
+#define SAMPLER_SCHEDULE_CAPACITY 128
+#endif
+
 namespace capsule
 {
 namespace sampler
@@ -43,9 +93,15 @@ namespace sampler
         release,
     };
 
+    // 秒単位で表されたエンベロープをSampleのADSRのパラメーターに変換する
+    // アタックは無音から最大音量まで、ディケイとリリースは100dB減衰するまでの時間 (SoundFont 2と同じ定義)
+    float GetAttackFromSeconds(float seconds);
+    float GetDecayFromSeconds(float seconds);
+    inline float GetReleaseFromSeconds(float seconds) { return GetDecayFromSeconds(seconds); }
+
     struct Sample
     {
-        std::unique_ptr<const int16_t> sample;
+        std::shared_ptr<const int16_t> sample;
         uint32_t length;
         uint8_t root;
         uint32_t loopStart;
@@ -56,6 +112,43 @@ namespace sampler
         float decay;
         float sustain;
         float release;
+
+        // ストリーミング再生を行う場合のデータ供給元
+        // この場合sampleには先頭headLengthサンプルのみが格納されており、残りは再生中にstreamから読み込まれる
+        std::shared_ptr<StreamSource> stream;
+        uint32_t headLength = 0;
+
+        // 波形データの格納形式 PCM16以外の場合はsampleを使用せず、encodedに符号化されたデータが格納される
+        SampleFormat format = SampleFormat::PCM16;
+        std::shared_ptr<const uint8_t> encoded;
+        AdpcmState adpcmStart = {0, 0}; // ADPCMの先頭のサンプルをデコードする直前の状態
+        AdpcmState adpcmLoop = {0, 0};  // ADPCMのloopStartのサンプルをデコードする直前の状態
+
+        // rootに対する音高の補正 (セント単位) SoundFontのファインチューンなどに使用する
+        float tune = 0.0f;
+        // 波形データのサンプリング周波数 SAMPLE_RATEと異なる場合は音高の計算でその比を補正する
+        uint32_t sampleRate = SAMPLE_RATE;
+
+        // 高速なメモリに置いた先頭部分とループ区間のコピー (PlaceHotRegionsで作成する)
+        // 再生位置から読み進める範囲がコピーに収まる間は、sampleの代わりにこちらが参照される
+        std::shared_ptr<const int16_t> fastHead; // [0, fastHeadLength)
+        uint32_t fastHeadLength = 0;
+        std::shared_ptr<const int16_t> fastLoop; // [loopStart, loopEnd + SAMPLE_GUARD_LENGTH)
+
+        // サンプリング周波数を半分にして帯域制限したコピー (GenerateMipmapsで作成する)
+        // rootより高い音高で再生する時に、読み進める間隔が1サンプル以下になるように選ばれる
+        std::shared_ptr<const Sample> halfRate;
+
+        // ウェーブテーブルを再生する場合のテーブル (CreateWavetableSampleで作成する)
+        // この場合sampleは使用せず、テーブルを位相で読むオシレーターとして再生される
+        std::shared_ptr<const Wavetable> wavetable;
+        float wavetableFrame = 0.0f;    // 発音時のフレームの位置
+        float wavetableScan = 0.0f;     // 1秒あたりに進めるフレーム数 (最後のフレームで止まる)
+        bool wavetableCrossfade = true; // フレームの間をクロスフェードするかどうか (falseの場合は最も近いフレームを再生する)
+
+        // グラニュラー再生を行う場合のパラメーター (CreateGranularSampleで作成する)
+        // この場合sampleは使用せず、granular->sourceから切り出した粒を重ね合わせて再生される
+        std::shared_ptr<const GranularSettings> granular;
     
         // 通常はこちらのコンストラクタを使用してください
         Sample(std::unique_ptr<const int16_t> sample, uint32_t length, uint8_t root, uint32_t loopStart, uint32_t loopEnd, bool adsrEnabled, float attack, float decay, float sustain, float release)
@@ -63,10 +156,61 @@ namespace sampler
         // このコンストラクタを使用することで簡潔な初期化が可能です
         // データが解放されないことが保証されている場合にのみ使用してください
         Sample(const int16_t *sample, uint32_t length, uint8_t root, uint32_t loopStart, uint32_t loopEnd, bool adsrEnabled, float attack, float decay, float sustain, float release)
-            : sample{sample}, length{length}, root{root}, loopStart{loopStart}, loopEnd{loopEnd}, adsrEnabled{adsrEnabled}, attack{attack}, decay{decay}, sustain{sustain}, release{release} {}
-        Sample(Sample&& other) : sample{std::move(other.sample)}, length{other.length}, root{other.root}, loopStart{other.loopStart}, loopEnd{other.loopEnd}, adsrEnabled{other.adsrEnabled}, attack{other.attack}, decay{other.decay}, sustain{other.sustain}, release{other.release} {}
+            : sample{std::shared_ptr<const int16_t>(), sample}, length{length}, root{root}, loopStart{loopStart}, loopEnd{loopEnd}, adsrEnabled{adsrEnabled}, attack{attack}, decay{decay}, sustain{sustain}, release{release} {}
+        // 波形データを他のオブジェクトと共有する場合のコンストラクタ
+        // マップしたファイルの一部を参照する場合などは、ファイルを所有するshared_ptrのエイリアスを渡してください
+        Sample(std::shared_ptr<const int16_t> sample, uint32_t length, uint8_t root, uint32_t loopStart, uint32_t loopEnd, bool adsrEnabled, float attack, float decay, float sustain, float release)
+            : sample{std::move(sample)}, length{length}, root{root}, loopStart{loopStart}, loopEnd{loopEnd}, adsrEnabled{adsrEnabled}, attack{attack}, decay{decay}, sustain{sustain}, release{release} {}
+        // ストリーミング再生用のコンストラクタ
+        // 通常はCreateStreamingSampleを使用してください
+        Sample(std::shared_ptr<const int16_t> head, uint32_t headLength, std::shared_ptr<StreamSource> stream, uint32_t length, uint8_t root, uint32_t loopStart, uint32_t loopEnd, bool adsrEnabled, float attack, float decay, float sustain, float release)
+            : sample{std::move(head)}, length{length}, root{root}, loopStart{loopStart}, loopEnd{loopEnd}, adsrEnabled{adsrEnabled}, attack{attack}, decay{decay}, sustain{sustain}, release{release}, stream{std::move(stream)}, headLength{headLength} {}
+        // μ-law・ADPCMで符号化されたサンプル用のコンストラクタ
+        // 符号化は通常EncodeSampleで行います
+        Sample(SampleFormat format, std::shared_ptr<const uint8_t> encoded, uint32_t length, uint8_t root, uint32_t loopStart, uint32_t loopEnd, bool adsrEnabled, float attack, float decay, float sustain, float release, AdpcmState adpcmStart = {0, 0}, AdpcmState adpcmLoop = {0, 0})
+            : length{length}, root{root}, loopStart{loopStart}, loopEnd{loopEnd}, adsrEnabled{adsrEnabled}, attack{attack}, decay{decay}, sustain{sustain}, release{release}, format{format}, encoded{std::move(encoded)}, adpcmStart{adpcmStart}, adpcmLoop{adpcmLoop} {}
+        // 符号化済みのデータが解放されないことが保証されている場合にのみ使用してください
+        Sample(SampleFormat format, const uint8_t *encoded, uint32_t length, uint8_t root, uint32_t loopStart, uint32_t loopEnd, bool adsrEnabled, float attack, float decay, float sustain, float release, AdpcmState adpcmStart = {0, 0}, AdpcmState adpcmLoop = {0, 0})
+            : Sample(format, std::shared_ptr<const uint8_t>(std::shared_ptr<const uint8_t>(), encoded), length, root, loopStart, loopEnd, adsrEnabled, attack, decay, sustain, release, adpcmStart, adpcmLoop) {}
+        Sample(Sample&& other) : sample{std::move(other.sample)}, length{other.length}, root{other.root}, loopStart{other.loopStart}, loopEnd{other.loopEnd}, adsrEnabled{other.adsrEnabled}, attack{other.attack}, decay{other.decay}, sustain{other.sustain}, release{other.release}, stream{std::move(other.stream)}, headLength{other.headLength},
+              format{other.format}, encoded{std::move(other.encoded)}, adpcmStart{other.adpcmStart}, adpcmLoop{other.adpcmLoop}, tune{other.tune}, sampleRate{other.sampleRate},
+              fastHead{std::move(other.fastHead)}, fastHeadLength{other.fastHeadLength}, fastLoop{std::move(other.fastLoop)}, halfRate{std::move(other.halfRate)},
+              wavetable{std::move(other.wavetable)}, wavetableFrame{other.wavetableFrame}, wavetableScan{other.wavetableScan}, wavetableCrossfade{other.wavetableCrossfade}, granular{std::move(other.granular)} {}
+
+        // 波形データがすべて16bitリニアPCMでメモリ上にあり、カーネルから直接参照できるかどうか
+        bool IsDirect() const { return !stream && !wavetable && !granular && format == SampleFormat::PCM16; }
     };
 
+    // sampleをhighestNoteまで(ピッチベンドの上限を含めて)再生する場合に、波形データの終端より後ろに必要なサンプル数
+    // SAMPLE_GUARD_LENGTHより小さい値は返さない
+    uint32_t GetSampleGuardLength(const Sample &sample, uint8_t highestNote = 127);
+    // sampleRateの波形データをルートからsemitones半音上(tuneを含む)まで再生する場合の、上と同じ値
+    uint32_t GetSampleGuardLength(float semitones, uint32_t sampleRate = SAMPLE_RATE);
+
+    // parentの波形データのoffsetサンプル目からlengthサンプルを参照するサンプル(スライス)を作成する
+    // 波形データはコピーされずparentと共有され、root・ループポイント・エンベロープはスライスごとに指定できる
+    // ループポイントはスライスの先頭からの位置で指定する 1つの録音にまとめたドラムキットなどを複製せずに使用できる
+    // parentが16bitリニアPCMでない場合や範囲が不正な場合はnullptrを返す
+    std::shared_ptr<Sample> CreateSampleSlice(const std::shared_ptr<const Sample> &parent, uint32_t offset, uint32_t length, uint8_t root, uint32_t loopStart, uint32_t loopEnd, bool adsrEnabled, float attack, float decay, float sustain, float release);
+
+    // 直接参照できるサンプルの先頭headLengthサンプルとループ区間を、fastから確保した領域にコピーする
+    // PSRAMなど低速なメモリに置かれたサンプルでも、発音直後と持続音のループ中は高速なメモリから再生されるようになる
+    // 既にコピーされている部分と、確保できなかった部分はそのままにする コピーしたバイト数を返す
+    // 再生に使用する前に呼ぶこと
+    size_t PlaceHotRegions(Sample &sample, std::shared_ptr<MemoryResource> fast, uint32_t headLength = SAMPLE_FAST_HEAD_LENGTH);
+
+    // wavetableを再生するサンプルを作成する ADSRは常に有効で、離鍵されるまで鳴り続ける
+    // ルートのノートでは、フレームをsampleRateで再生した時の音高 (sampleRate / フレームのサンプル数 Hz) になる
+    std::shared_ptr<Sample> CreateWavetableSample(std::shared_ptr<const Wavetable> wavetable, uint8_t root, float attack, float decay, float sustain, float release, uint32_t sampleRate = SAMPLE_RATE);
+
+    // settings.sourceをグラニュラー再生するサンプルを作成する ADSRは常に有効で、離鍵されるまで鳴り続ける
+    // root・tune・サンプリング周波数はsourceから引き継ぐ sourceが直接参照できるサンプルでない場合はnullptrを返す
+    std::shared_ptr<Sample> CreateGranularSample(const GranularSettings &settings, float attack, float decay, float sustain, float release);
+
+    // sampleが参照している波形データのバイト数 (符号化データ・高速なメモリへのコピー・halfRateの各段を含む)
+    // ストリーミング再生するサンプルはメモリ上にある先頭部分のみを数える
+    size_t GetSampleDataSize(const Sample &sample);
+
     // MIDI規格のプログラムに対応する概念
     // いわゆる音色(おんしょく)
     // サンプルの集合からなり、ノートナンバーとベロシティを指定するとサンプルがただ一つ定まる
@@ -110,9 +254,33 @@ namespace sampler
                 samples->push_back(std::make_unique<MappedSample>(std::move(ms)));
             }
         }
+        // 静的なティンバーの定義に使用するゾーン
+        // constexprな配列にするとフラッシュ(.rodata)に置かれ、起動時の初期化もメモリ確保も発生しない
+        struct Zone
+        {
+            const Sample *sample;
+            uint8_t lowerNoteNo;
+            uint8_t upperNoteNo;
+            uint8_t lowerVelocity;
+            uint8_t upperVelocity;
+        };
+        // ゾーンの配列を参照するティンバーを作成する (静的な変数にすると定数初期化される)
+        // zonesは下記の制約を満たしていること zonesとそのサンプルが解放されないことが保証されている場合にのみ使用してください
+        constexpr Timbre(const Zone *zones, size_t zoneCount) : samples{}, zones{zones}, zoneCount{zoneCount} {}
+        template <size_t N>
+        constexpr Timbre(const Zone (&zones)[N]) : Timbre(zones, N) {}
+        // 範囲が重なっていたり順序が揃っていないゾーンの集合から、下記の制約を満たすティンバーを作成する
+        // 重なっている部分では先に現れたゾーンが優先される
+        static std::shared_ptr<Timbre> CreateFromZones(std::vector<MappedSample> zones);
         // 指定したノートナンバーとベロシティが範囲に含まれているサンプルへのshared_ptrを返す
         // 該当するサンプルがない場合はnullptrを返す
         std::shared_ptr<const Sample> GetAppropriateSample(uint8_t noteNo, uint8_t velocity);
+        // ストリーミング再生を行うサンプルを含んでいるかどうか
+        bool HasStreamingSample() const;
+        // 指定した形式のサンプルを含んでいるかどうか
+        bool HasSampleFormat(SampleFormat format) const;
+        // 含まれているサンプルをoutの末尾に追加する (重複は取り除かない)
+        void CollectSamples(std::vector<const Sample *> &out) const;
 
     private:
         // サンプルの集合
@@ -121,6 +289,42 @@ namespace sampler
         // * 同じlowerNoteNoを持つ任意の2つを取り出したとき、それらのベロシティの範囲が重複していない
         // * lowerNoteNoの低い順に並んでおり、同じlowerNoteNoを持つ項目はlowerVelocityの低い順に並んでいる
         std::unique_ptr<std::vector<std::unique_ptr<MappedSample>>> samples;
+        // ゾーンの配列から作成した場合はsamplesの代わりにこちらを使用する
+        const Zone *zones = nullptr;
+        size_t zoneCount = 0;
+    };
+
+    // Samplerが使用するメモリの確保先
+    struct SamplerMemoryResources
+    {
+        MemoryResource *sampler = GetDefaultMemoryResource();    // Sampler本体・メッセージのキュー・発音中のノートの一覧
+        MemoryResource *reverb = GetDmaMemoryResource();         // リバーブの遅延線 (約54KB)
+        MemoryResource *stream = GetSlowMemoryResource();        // ストリーミング再生のリングバッファ
+        MemoryResource *blockCache = GetDefaultMemoryResource(); // ロスレス形式のデコード済みブロックのキャッシュ
+        MemoryResource *floatCache = GetSlowMemoryResource();    // floatに変換したサンプルのキャッシュ
+    };
+
+    // Samplerが使用しているメモリのバイト数 (Sampler::GetFootprintで取得する)
+    // currentは取得した時点の値、peakはSamplerを作成してからの最大値 (常に確保されている項目は両者が等しい)
+    struct SamplerFootprint
+    {
+        struct Usage
+        {
+            size_t current = 0;
+            size_t peak = 0;
+        };
+        Usage object;     // Sampler本体のうち下記のvoices・queuesに含まれない部分 (チャンネル・ミューテックスなど)
+        Usage voices;     // ボイス(SamplePlayer)の配列
+        Usage queues;     // メッセージのキュー・予約したイベントのタイマーホイールと発音中のノートの一覧 (std::deque・std::listの場合は要素の分のみの概算)
+        Usage effects;    // リバーブの遅延線
+        Usage streaming;  // ストリーミング再生のリングバッファ
+        Usage caches;     // デコード済みブロックのキャッシュとfloatに変換したサンプルのキャッシュ
+        Usage stack;      // Processがスタック上に確保する作業領域 (リバーブの処理を含む)
+        Usage sampleData; // 各チャンネルのティンバーが参照している波形データ (フラッシュやマップしたファイル上のものを含む)
+
+        // 上記のうちSamplerが確保しているメモリ(object〜caches)の合計
+        size_t GetOwnedTotal() const { return object.current + voices.current + queues.current + effects.current + streaming.current + caches.current; }
+        size_t GetOwnedPeak() const { return object.peak + voices.peak + queues.peak + effects.peak + streaming.peak + caches.peak; }
     };
 
     class Sampler : public std::enable_shared_from_this<Sampler>
@@ -150,7 +354,24 @@ namespace sampler
             float pos_f = 0.0f;
             float gain = 0.0f; // volumeとADSR処理により算出される値
             float pitch = 1.0f; // noteNoとpitchBendにより算出される値
+            const Sample *level = nullptr; // 波形データを読み出すサンプル (sample自身かそのhalfRate)
+            const Sample *floatLevel = nullptr; // floatDataを取得した時のlevel
+            const float *floatData = nullptr;   // levelをfloatに変換したデータ (FloatSampleCacheにない場合はnullptr)
             enum SampleAdsr adsrState = SampleAdsr::attack;
+            uint8_t delay = 0;  // 次のブロックで発音を始める位置 (シーケンサーがブロックの途中で発音させた場合)
+            float frame = 0.0f; // ウェーブテーブルを再生する場合のフレームの位置 (posは1周期を2^32とした位相として使用する)
+            // 以下はグラニュラー再生を行う場合にのみ使用する
+            float grainPosition = 0.0f;  // 次の粒を切り出す位置 (sourceのサンプル数)
+            float grainCountdown = 0.0f; // 次の粒を発生させるまでの出力サンプル数
+            uint32_t grainSeed = 1;      // 揺らぎに使用する乱数の状態
+
+            // 以下は直接参照できないサンプルを再生する場合にのみ使用する
+            int8_t streamSlot = -1;       // SampleStreamerのスロット番号 (確保できていない場合は-1)
+            AdpcmState adpcm = {0, 0};    // fetchPosのサンプルをデコードする直前のADPCMデコーダーの状態
+            int16_t cacheEntry = -1;      // 直前に参照したSampleBlockCacheのエントリー
+            uint32_t fetchPos = 0;        // 次にwindowへ読み込むサンプル上の位置
+            uint16_t windowLength = 0;    // window内の有効なサンプル数
+            int16_t window[SAMPLE_WINDOW_SIZE]; // window[0]がposの位置に対応する
 
             void UpdateGain();
             void UpdatePitch();
@@ -161,39 +382,67 @@ namespace sampler
         class Channel
         {
         public:
+            struct PlayingNote
+            {
+                uint8_t noteNo;
+                uint_fast8_t playerId;
+            };
             Channel() {}
-            Channel(std::weak_ptr<Sampler> sampler) : sampler{std::move(sampler)} {}
+#if SAMPLER_FIXED_CAPACITY
+            Channel(std::weak_ptr<Sampler> sampler, MemoryResource *) : sampler{std::move(sampler)} {}
+#else
+            Channel(std::weak_ptr<Sampler> sampler, MemoryResource *resource) : sampler{std::move(sampler)}, playingNotes{MemoryResourceAllocator<PlayingNote>(resource)} {}
+#endif
             void NoteOn(uint8_t noteNo, uint8_t velocity);
             void NoteOff(uint8_t noteNo, uint8_t velocity);
             void PitchBend(int16_t pitchBend);
             void SetTimbre(std::shared_ptr<Timbre> t);
+            const std::shared_ptr<Timbre> &GetTimbre() const { return timbre; }
+            size_t GetPlayingNoteCount() const { return playingNotes.size(); }
+            size_t GetPeakPlayingNoteCount() const { return peakPlayingNoteCount; }
 
         private:
             std::weak_ptr<Sampler> sampler; // 循環参照を避けるために弱参照を使用
-            struct PlayingNote
-            {
-                uint8_t noteNo;
-                uint_fast8_t playerId;
-            };
             std::shared_ptr<Timbre> timbre;
             float pitchBend = 0.0f;
-            std::list<PlayingNote> playingNotes; // このチャンネルで現在再生しているノート
+            // このチャンネルで現在再生しているノート
+#if SAMPLER_FIXED_CAPACITY
+            FixedVector<PlayingNote, SAMPLER_CHANNEL_NOTE_CAPACITY> playingNotes;
+#else
+            std::list<PlayingNote, MemoryResourceAllocator<PlayingNote>> playingNotes;
+#endif
+            size_t peakPlayingNoteCount = 0; // playingNotesの要素数の最大値
+            void AddPlayingNote(Sampler &sampler, PlayingNote note);
+            // 以下はsamplerのplayersMutexを取得した状態で呼ぶ (Processがまとめて処理する場合に使用する)
+            friend class Sampler;
+            // 発音させたプレイヤーの番号を返す
+            uint_fast8_t NoteOn(Sampler &sampler, uint8_t noteNo, uint8_t velocity);
+            void NoteOff(Sampler &sampler, uint8_t noteNo, uint8_t velocity);
+            void PitchBend(Sampler &sampler, int16_t pitchBend);
         };
         
         // shared_ptrを生成するファクトリー関数
         // コンストラクタではなくこちらを使用しないと正しく動作しません
-        static std::shared_ptr<Sampler> Create()
+        // Sampler本体と制御ブロックもresources.samplerから確保される
+        static std::shared_ptr<Sampler> Create(const SamplerMemoryResources &resources = SamplerMemoryResources())
         {
-            auto sampler = std::make_shared<Sampler>();
+            auto sampler = std::allocate_shared<Sampler>(MemoryResourceAllocator<Sampler>(resources.sampler), resources);
             sampler->initialize();
             return sampler;
         }
+        explicit Sampler(const SamplerMemoryResources &resources = SamplerMemoryResources())
+            :
+#if !SAMPLER_FIXED_CAPACITY
+              messageQueue{MemoryResourceAllocator<Message>(resources.sampler)},
+#endif
+              resource{resources.sampler},
+              reverb{0.4f, 0.5f, SAMPLE_BUFFER_SIZE, SAMPLE_RATE, resources.reverb}, streamer{resources.stream}, blockCache{resources.blockCache}, floatCache{resources.floatCache} {}
         
     private:        
         void initialize()
         {
             for (uint_fast8_t i = 0; i < CH_COUNT; i++)
-                channels[i] = Channel(weak_from_this());
+                channels[i] = Channel(weak_from_this(), resource);
 #if defined(FREERTOS)
             InitializeMutexes();
 #endif
@@ -204,12 +453,77 @@ namespace sampler
         void NoteOn(uint8_t noteNo, uint8_t velocity, uint8_t channel);
         void NoteOff(uint8_t noteNo, uint8_t velocity, uint8_t channel);
         void PitchBend(int16_t pitchBend, uint8_t channel);
+
+        // PostEventsでまとめて送るイベント
+        struct Event
+        {
+            enum Type : uint8_t
+            {
+                NOTE_ON,
+                NOTE_OFF,
+                PITCH_BEND
+            };
+            Type type;
+            uint8_t channel;
+            uint8_t noteNo;    // NOTE_ON・NOTE_OFFのみ
+            uint8_t velocity;  // NOTE_ON・NOTE_OFFのみ
+            int16_t pitchBend; // PITCH_BENDのみ (-8192〜8191)
+        };
+        // 和音やドラムの同時打ちなど、複数のイベントをまとめてキューに追加する
+        // NoteOn・NoteOff・PitchBendと同じ検証を行い、SAMPLER_POST_BATCH_SIZE個ごとに1回のロックで追加する
+        // 追加する前にチャンネル順に並べ替えるため、同じチャンネルのイベントはProcessで続けて処理される (同じチャンネル内の順序は保たれる)
+        void PostEvents(const Event *events, size_t count);
+        template <size_t N>
+        void PostEvents(const Event (&events)[N]) { PostEvents(events, N); }
+
+        // Processが出力したサンプル数 (次のProcessが出力する先頭のサンプルの時刻) ScheduleEventの時刻の基準になる
+        uint64_t GetSampleTime();
+        // eventをtime(GetSampleTimeと同じ基準のサンプル数)に処理するように予約する
+        // 予約はタイマーホイールに保持され、Processの中でADSRの更新周期ごとに取り出される
+        // ノートオンはtimeの位置(4サンプル単位)から発音し、同じ周期のイベントは時刻順(同じ時刻は予約した順)に処理される
+        // 既に過ぎた時刻の場合は次のProcessで処理する NoteOnなどと同じ検証を行い、無効なイベントと、
+        // SAMPLER_SCHEDULE_CAPACITY個の予約が溜まっている場合はfalseを返す
+        // メモリを確保しないため、割り込みハンドラーからも呼び出せる
+        bool ScheduleEvent(const Event &event, uint64_t time);
+        // 予約されていて、まだ処理されていないイベントの数
+        size_t GetScheduledEventCount();
+
         void SetTimbre(uint8_t channel, std::shared_ptr<Timbre> t);
+        // 静的なティンバーをセットする 所有権を持たずに参照するため、参照カウントの操作もメモリ確保も発生しない
+        void SetTimbre(uint8_t channel, Timbre &t);
+        // MIDI 1.0のバイト列をparserで解釈し、ノートオン・ノートオフ・ピッチベンドをまとめてキューに追加する
+        // UART・USBの受信バッファをそのまま渡してよく、途中で切れたメッセージは次の呼び出しで続きから解釈される
+        // その他のメッセージは読み飛ばす キューに追加したメッセージの数を返す
+        // SAMPLER_FIXED_CAPACITYが有効な場合はメモリを確保しないため、割り込みハンドラーやDMAの完了コールバックから呼び出せる
+        size_t PostMidi(MidiParser &parser, const uint8_t *data, size_t length);
 
         void Process(int16_t *output);
 
+        // sequencerを先頭から再生する Processの中でイベントの発生する位置まで処理を進めながら再生される
+        // 同じシーケンサーが登録済みの場合は、鳴っているノートを離鍵させて先頭から再生し直す
+        // SAMPLER_SEQUENCER_COUNT個まで同時に再生でき、空きがない場合はfalseを返す (停止したシーケンサーの枠は再利用される)
+        // 音声処理スレッド以外から呼ぶこと
+        bool StartSequencer(std::shared_ptr<Sequencer> sequencer);
+
         float masterVolume = 0.4f;
 
+        // キューが満杯で破棄されたメッセージの数 (SAMPLER_FIXED_CAPACITYが有効な場合のみ) と、予約できなかったイベントの数の合計
+        uint32_t GetDroppedMessageCount() const { return droppedMessageCount; }
+
+        // ストリーミング再生で先読みが間に合わず無音になった回数
+        uint32_t GetStreamUnderrunCount() const { return streamer.GetUnderrunCount(); }
+        // ロスレス形式のサンプルのデコード済みブロックのキャッシュ
+        const SampleBlockCache &GetBlockCache() const { return blockCache; }
+        // 16bitリニアPCMのサンプルをfloatに変換して保持するキャッシュのバジェット(バイト数)を設定する
+        // 0(既定値)の場合はキャッシュを使用しない 変換済みのサンプルはint16_tからの変換を省略して再生される
+        void SetFloatCacheBudget(size_t budget);
+        const FloatSampleCache &GetFloatCache() const { return floatCache; }
+
+        // 使用しているメモリのバイト数を項目ごとに返す 音声処理スレッド以外から呼ぶこと
+        // 波形データはチャンネルにセットされているティンバーが参照するものを、サンプルごとに重複なく数える
+        // (スライスのように波形データを共有するサンプルは、共有部分も別々に数えられる)
+        SamplerFootprint GetFootprint();
+
     private:
         // 各メッセージのキューイングに使用する
         // MIDIのメッセージとは互換性がない
@@ -230,10 +544,39 @@ namespace sampler
         };
         Channel channels[CH_COUNT]; // コンストラクタで初期化する
         SamplePlayer players[MAX_SOUND] = {SamplePlayer()};
+        // グラニュラー再生の粒 ボイスの間で共有し、再生中にメモリを確保しないように固定数を保持する
+        struct Grain
+        {
+            int8_t player = -1;  // 粒を所有するボイスの番号 (-1は未使用)
+            uint8_t offset = 0;  // 次のブロックで書き込みを始める位置 (発生したブロックでのみ0以外)
+            uint32_t pos = 0;    // sourceの読み出し位置
+            float pos_f = 0.0f;
+            float pitch = 1.0f;
+            uint32_t age = 0;    // 発生してから出力したサンプル数
+            uint32_t length = 0; // 粒の長さ (出力サンプル数)
+            float cost = 0.0f;   // GetGrainCostで求めた処理コスト
+        };
+        Grain grains[GRANULAR_GRAIN_POOL_SIZE];
         // 受け取ったNoteOn/NoteOff/PitchBendなどは一旦キューに入れておき、Processのタイミングで処理する
         // これにより、Processを別スレッドで動かすことができる
         // TODO: messageQueue自体の排他制御は必要ない？
-        std::deque<Message> messageQueue;
+#if SAMPLER_FIXED_CAPACITY
+        FixedQueue<Message, SAMPLER_MESSAGE_QUEUE_CAPACITY> messageQueue;
+#else
+        std::deque<Message, MemoryResourceAllocator<Message>> messageQueue;
+#endif
+        // ScheduleEventで予約されたメッセージ (1ティックはADSR_UPDATE_SAMPLE_COUNTサンプル messageQueueMutexで保護する)
+        struct ScheduledMessage
+        {
+            Message message;
+            uint32_t sequence; // 同じ時刻のメッセージを予約した順に処理するための通し番号
+            uint64_t time;
+        };
+        TimerWheel<ScheduledMessage, SAMPLER_SCHEDULE_CAPACITY> scheduler;
+        uint32_t scheduleSequence = 0;
+        uint32_t droppedMessageCount = 0; // キューまたはタイマーホイールが満杯で破棄したメッセージの数 (messageQueueMutexで保護する)
+        size_t peakMessageQueueLength = 0; // messageQueueの要素数の最大値 (messageQueueMutexで保護する)
+        MemoryResource *resource; // チャンネルのノートの一覧の確保先
 #if defined(FREERTOS)
         portMUX_TYPE messageQueueMutex = portMUX_INITIALIZER_UNLOCKED;
         SemaphoreHandle_t playersMutex = NULL;
@@ -242,10 +585,43 @@ namespace sampler
         std::mutex playersMutex;
 #endif
 
-        EffectReverb reverb = EffectReverb(0.4f, 0.5f, SAMPLE_BUFFER_SIZE, SAMPLE_RATE);
+        // 再生中のシーケンサー (StartSequencerでplayersMutexを取得して登録し、Processが進める)
+        std::shared_ptr<Sequencer> sequencers[SAMPLER_SEQUENCER_COUNT];
+
+        EffectReverb reverb;
+        SampleStreamer streamer; // ストリーミング再生するサンプルを含む音色がセットされた時に起動する
+        SampleBlockCache blockCache; // ロスレス形式のサンプルを含む音色がセットされた時に確保する
+        FloatSampleCache floatCache; // バジェットが設定された場合のみ使用する
         
+        // メッセージをキューに追加する
+        void PostMessage(const Message &message);
+        // 複数のメッセージを1回のロックでキューに追加する キューに追加できたメッセージの数を返す
+        size_t PostMessages(const Message *messages, size_t count);
+        // 同じチャンネル内の順序を保ったままチャンネル順に並べ替える
+        static void SortByChannel(Message *messages, size_t count);
+        // eventを検証してmessageに変換する キューに追加しないイベントの場合はfalseを返す
+        static bool ToMessage(const Event &event, Message &message);
         // コンストラクタでFreeRTOSセマフォを初期化するためのメソッド
         void InitializeMutexes();
+        // プレイヤーの再生を始める際に、サンプルの種類に応じた準備を行う
+        void StartPlayer(SamplePlayer &player);
+        // プレイヤーの再生を終える際に、プレイヤーが確保しているリソースを解放する
+        void ReleasePlayer(SamplePlayer &player);
+        // メッセージを反映する ノートオンはoffsetサンプル後(4サンプル単位)から発音させる
+        // playersMutexを取得した状態で、ブロックの波形生成の前に呼ぶ
+        void ApplyMessage(const Message &message, uint32_t offset);
+        // シーケンサーのMIDIメッセージをApplyMessageで反映する
+        friend class Sequencer;
+        void ApplySequencerEvent(uint32_t offset, uint8_t status, uint8_t data1, uint8_t data2);
+        // 予約されたメッセージのうち、次のADSRの更新周期のものを反映する (playersMutexを取得した状態で呼ぶ)
+        void ApplyScheduledMessages();
+        // 直接参照できないサンプルについて、windowに波形を展開しながら波形生成を行う
+        bool ProcessWindowed(SamplePlayer &player, const Sample &sample, float *dst, uint32_t remain, float gain, float pitch);
+        void FillWindow(SamplePlayer &player, const Sample &sample, uint32_t need);
+        // ウェーブテーブルを再生するサンプルの波形生成を行う
+        void ProcessWavetable(SamplePlayer &player, const Sample &sample, float *dst, uint32_t length, float gain, float pitch);
+        // グラニュラー再生を行うサンプルの波形生成を行う 粒の発生も行う
+        void ProcessGranular(SamplePlayer &player, const Sample &sample, float *dst, float gain, float pitch);
     };
     
 }
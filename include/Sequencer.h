@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include "MidiMessage.h"
+#include "MidiFile.h"
+
+// Samplerが同時に再生できるシーケンスの数
+#ifndef SAMPLER_SEQUENCER_COUNT
+#define SAMPLER_SEQUENCER_COUNT 4
+#endif
+
+namespace capsule
+{
+namespace sampler
+{
+    class Sampler;
+
+    // MidiMessageの配列(曲)またはスタンダードMIDIファイルを再生するシーケンサー
+    // Sampler::StartSequencerで登録すると、SamplerのProcessの中でイベントが発生する位置まで処理を進めながら再生される
+    // キューを経由せず、再生中にロックもメモリの確保も行わない
+    // ノートオンは4サンプル単位、ノートオフとピッチベンドはADSRの更新周期(ADSR_UPDATE_SAMPLE_COUNT)単位の精度で反映される
+    class Sequencer
+    {
+    public:
+        // songは再生が終わるまで参照されるので、静的に確保しておくこと
+        explicit Sequencer(const MidiMessage *song);
+        // スタンダードMIDIファイルを再生する イベントは再生しながらファイルから読み出し、配列には変換しない
+        // 再生中に確保するメモリはなく、必要なメモリはトラックの数に比例する分のみ
+        explicit Sequencer(std::shared_ptr<const MidiFile> file);
+        Sequencer(const Sequencer &) = delete;
+        Sequencer &operator=(const Sequencer &) = delete;
+
+        // 再生速度の倍率 (1で元の速さ) 音高は変わらない 再生中に変更してよい
+        void SetTempo(float tempo);
+        float GetTempo() const { return tempo; }
+        // 曲の先頭からのサンプル数でループ区間を設定する endに達するとstartに戻る
+        // endが曲の終わりより後の場合は、曲の終わりでstartに戻る 再生中に変更してよい
+        // MIDIファイルの場合は、startを通過する時に読み出し位置を保存しておき、そこへ戻る
+        // 再生位置がstartを過ぎてから設定した場合は、最初に戻る時のみ先頭から読み直す
+        // start >= end の場合は何もせずfalseを返す
+        bool SetLoop(uint32_t start, uint32_t end);
+        // ループを解除する 曲の終わりに達すると停止する
+        void ClearLoop();
+        // 次のProcessで、このシーケンスが発音させて離鍵していないノートを離鍵させて停止する
+        void Stop();
+
+        bool IsPlaying() const { return playing; }
+        // 再生位置 (曲の先頭からのサンプル数)
+        uint32_t GetPosition() const { return position; }
+        // 再生している配列 (MIDIファイルの場合はnullptr)
+        const MidiMessage *GetSong() const { return song; }
+        const std::shared_ptr<const MidiFile> &GetFile() const { return file; }
+
+    private:
+        friend class Sampler;
+        // 先頭から再生を始める状態にする (Samplerのロックを取得した状態で呼ばれる)
+        void Rewind();
+        // 出力lengthサンプルぶん再生位置を進め、その間に発生するイベントをsamplerに渡す (音声処理スレッドから呼ばれる)
+        void Advance(Sampler &sampler, uint32_t length);
+        // 発生するまでの出力サンプル数offsetとともに、メッセージをsamplerに渡す
+        void Dispatch(Sampler &sampler, uint32_t offset, uint8_t status, uint8_t data1, uint8_t data2);
+        // 発音させて離鍵していないノートをすべて離鍵させる
+        void ReleaseHeldNotes(Sampler &sampler, uint32_t offset);
+        // 次のメッセージを読み出してnextに格納する
+        void Fetch();
+        // ループの先頭以降の最初のメッセージから読み出す状態にする
+        void Seek(uint32_t start);
+        static bool IsEndOfSong(const MidiMessage &message) { return message.status == 0xFF && message.data1 == 0x2F && message.data2 == 0x00; }
+
+        // 配列を再生する場合
+        const MidiMessage *song = nullptr;
+        const MidiMessage *songEnd = nullptr;    // 曲の終わりを表すメッセージ
+        const MidiMessage *songCursor = nullptr; // 次に読み出すメッセージ
+        // MIDIファイルを再生する場合
+        std::shared_ptr<const MidiFile> file;
+        std::optional<MidiFile::Cursor> fileCursor;
+        std::optional<MidiFile::Cursor> loopFileCursor; // loopNextを読み出した直後の状態
+        MidiMessage loopNext = {};
+        uint32_t loopNextStart = 0;
+        bool loopNextValid = false;
+        int64_t previousTime = -1;              // 最後に処理したメッセージの時刻 (先頭から読み出す場合は-1)
+
+        MidiMessage next = {};                  // 次に処理するメッセージ
+        bool hasNext = false;
+        uint32_t songLength = 0;                // 曲の終わりの時刻
+        uint32_t position = 0;                  // 再生位置の整数部
+        float positionFraction = 0.0f;          // 再生位置の小数部 (テンポを変えた場合に使用する)
+        std::atomic<float> tempo{1.0f};
+        std::atomic<uint32_t> loopStart{0};
+        std::atomic<uint32_t> loopEnd{0};       // 0はループしない
+        std::atomic<bool> playing{false};
+        std::atomic<bool> stopRequested{false};
+        uint32_t heldNotes[16][4] = {};     // チャンネルごとの離鍵していないノートのビット集合
+    };
+
+}
+}
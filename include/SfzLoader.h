@@ -0,0 +1,21 @@
+#pragma once
+
+#include <memory>
+#include "Sampler.h"
+
+namespace capsule
+{
+namespace sampler
+{
+
+    // SFZ形式の音色定義を読み込み、ティンバーを作成する 失敗した場合はnullptrを返す
+    // 参照されているWAVファイルは重複なく1回ずつ読み込まれ、threadCount個のスレッドで並列にデコードされる (0の場合はCPUのコア数)
+    // WAVファイルはモノラルに変換され、SAMPLE_RATEにリサンプリングされる
+    // 対応しているオペコード:
+    // sample, default_path, lokey, hikey, key, pitch_keycenter, lovel, hivel, tune, transpose, offset, end,
+    // loop_mode, loop_start, loop_end, ampeg_attack, ampeg_decay, ampeg_sustain, ampeg_release
+    // (#define, #includeにも対応 release triggerのリージョンと組み込みの波形(*sineなど)は無視される)
+    std::shared_ptr<Timbre> LoadSfz(const char *path, unsigned threadCount = 0);
+
+}
+}
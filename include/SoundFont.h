@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include "Sampler.h"
+#include "MappedFile.h"
+
+namespace capsule
+{
+namespace sampler
+{
+
+    // SoundFont 2 (.sf2) ファイルを読み込み、プリセットをティンバーに変換する
+    // 波形データ(smplチャンク)はマップされた領域を直接参照するため、コピーされない
+    // ただし、サンプルの後ろの無音がゾーンの最も高いノートまで再生するのに足りない場合は、無音を付け足してメモリ上にコピーする
+    // 下記の制約があります
+    // * 同じノートナンバー・ベロシティに複数のゾーンが重なっている場合(レイヤーやステレオのサンプル)は最初のゾーンのみ使用する
+    // * 音量エンベロープのアタック・ディケイ・サスティン・リリースのみ使用し、ディレイ・ホールド・モジュレーター・フィルター・音量などは無視する
+    // * 24bitのサンプル(sm24チャンク)は上位16bitのみ使用する
+    class SoundFont
+    {
+    public:
+        struct Preset
+        {
+            char name[21];
+            uint16_t bank;
+            uint16_t program;
+        };
+
+        // ファイルを読み込む 失敗した場合はnullptrを返す
+        static std::shared_ptr<SoundFont> Load(const char *path);
+        static std::shared_ptr<SoundFont> Load(std::shared_ptr<MappedFile> file);
+
+        size_t GetPresetCount() const { return presets.size(); }
+        const Preset &GetPreset(size_t index) const { return presets[index]; }
+        // プリセットをティンバーに変換する 見つからない場合はnullptrを返す
+        // 作成されたサンプルはファイルを参照し続けるため、使用されている間はファイルも解放されない
+        std::shared_ptr<Timbre> GetTimbre(size_t presetIndex) const;
+        std::shared_ptr<Timbre> GetTimbre(uint16_t bank, uint8_t program) const;
+
+    private:
+        SoundFont(std::shared_ptr<MappedFile> file) : file{std::move(file)} {}
+        bool Parse();
+
+        // pdtaチャンク内の各サブチャンク
+        struct Records
+        {
+            const uint8_t *data = nullptr;
+            uint32_t count = 0;
+        };
+        struct Zone;
+        // バッグの範囲[bag, bagEnd)にあるゾーンを読み込む
+        void ReadZones(const Records &bags, const Records &gens, uint32_t bag, uint32_t bagEnd, uint16_t terminal, std::vector<Zone> &zones, Zone &global) const;
+
+        std::shared_ptr<MappedFile> file;
+        std::vector<Preset> presets;
+        const int16_t *smpl = nullptr;
+        uint32_t smplCount = 0;
+        Records phdr, pbag, pgen, inst, ibag, igen, shdr;
+    };
+
+}
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace capsule
+{
+namespace sampler
+{
+
+    // ティック(時刻)を指定して要素を予約し、1ティックずつ取り出す階層型タイマーホイール
+    // 64スロットの階層を4段持ち、64^4ティック先まで区別する (それより先の要素は最上位の階層で待たせる)
+    // 要素は本体の中に確保され、メモリを確保することはない
+    // 予約はO(1)で、上位の階層から下位の階層へ移す処理も要素あたり最大で階層の数だけ行われる
+    // 取り出す際は同じティックの要素を挿入ソートで並べるため、要素あたりO(k)になる (kはそのティックに予約された要素の数)
+    // 排他制御は行わないので、複数のスレッドから使用する場合は呼び出し側でロックを取得すること
+    // (PopNextで取り出したリストの要素はReleaseするまで書き換えられないので、ロックの外で読んでよい)
+    template <class T, size_t N>
+    class TimerWheel
+    {
+        static_assert(N > 0 && N < 0xFFFF, "TimerWheel capacity must be 1 to 65534");
+
+    public:
+        static constexpr uint32_t SLOT_BITS = 6;
+        static constexpr uint32_t SLOT_COUNT = 1 << SLOT_BITS;
+        static constexpr uint32_t LEVEL_COUNT = 4;
+        static constexpr uint16_t NONE = 0xFFFF;
+
+        // PopNextで取り出した要素のリスト GetNextで辿り、使い終わったらReleaseに渡す
+        struct List
+        {
+            uint16_t head = NONE;
+            uint16_t tail = NONE;
+        };
+
+        TimerWheel()
+        {
+            for (uint16_t i = 0; i < N; i++)
+                nodes[i].next = (size_t)i + 1 < N ? i + 1 : NONE;
+        }
+
+        // tickにvalueを予約する 既に取り出したティックの場合は次に取り出すティックに予約する
+        // 満杯の場合はfalseを返し、予約しない
+        bool Schedule(uint64_t tick, const T &value)
+        {
+            if (freeList == NONE)
+                return false;
+            uint16_t index = freeList;
+            freeList = nodes[index].next;
+            nodes[index].value = value;
+            nodes[index].tick = tick;
+            Insert(index);
+            count++;
+            if (count > peakCount)
+                peakCount = count;
+            return true;
+        }
+
+        // 次のティックに予約された要素を、lessで比較して昇順(等しい要素は予約した順)に並べて取り出し、ティックを1つ進める
+        template <class Less>
+        List PopNext(Less less)
+        {
+            // 下位の階層が1周したら、上位の階層の次のスロットを下位へ移す
+            if ((currentTick & (SLOT_COUNT - 1)) == 0)
+            {
+                for (uint32_t level = 1; level < LEVEL_COUNT; level++)
+                {
+                    uint32_t slot = (currentTick >> (level * SLOT_BITS)) & (SLOT_COUNT - 1);
+                    Cascade(slots[level][slot]);
+                    if (slot != 0)
+                        break;
+                }
+            }
+            Slot &slot = slots[0][currentTick & (SLOT_COUNT - 1)];
+            currentTick++;
+
+            // 1ティックぶんの要素は少ないので、挿入ソートで並べ替える
+            List list;
+            uint16_t index = slot.head;
+            slot = Slot();
+            while (index != NONE)
+            {
+                uint16_t next = nodes[index].next;
+                nodes[index].next = NONE;
+                count--;
+                if (list.head == NONE || !less(nodes[index].value, nodes[list.tail].value))
+                {
+                    (list.head == NONE ? list.head : nodes[list.tail].next) = index;
+                    list.tail = index;
+                }
+                else if (less(nodes[index].value, nodes[list.head].value))
+                {
+                    nodes[index].next = list.head;
+                    list.head = index;
+                }
+                else
+                {
+                    uint16_t prev = list.head;
+                    while (!less(nodes[index].value, nodes[nodes[prev].next].value))
+                        prev = nodes[prev].next;
+                    nodes[index].next = nodes[prev].next;
+                    nodes[prev].next = index;
+                }
+                index = next;
+            }
+            return list;
+        }
+
+        const T &Get(uint16_t index) const { return nodes[index].value; }
+        uint16_t GetNext(uint16_t index) const { return nodes[index].next; }
+        // PopNextで取り出したリストの要素を空きに戻す
+        void Release(const List &list)
+        {
+            if (list.head == NONE)
+                return;
+            nodes[list.tail].next = freeList;
+            freeList = list.head;
+        }
+
+        // 次にPopNextで取り出すティック
+        uint64_t GetCurrentTick() const { return currentTick; }
+        size_t GetCount() const { return count; }
+        size_t GetPeakCount() const { return peakCount; }
+        static constexpr size_t GetCapacity() { return N; }
+
+    private:
+        struct Node
+        {
+            T value;
+            uint64_t tick;
+            uint16_t next;
+        };
+        struct Slot
+        {
+            uint16_t head = NONE;
+            uint16_t tail = NONE;
+        };
+
+        // 現在のティックからの距離に応じた階層のスロットの末尾に追加する
+        void Insert(uint16_t index)
+        {
+            uint64_t tick = nodes[index].tick < currentTick ? currentTick : nodes[index].tick;
+            uint64_t delta = tick - currentTick;
+            uint32_t level = 0;
+            while (level + 1 < LEVEL_COUNT && delta >= ((uint64_t)1 << ((level + 1) * SLOT_BITS)))
+                level++;
+            // 最上位の階層にも収まらない場合は、最も後に移されるスロットに入れておき、移す際に入れ直す
+            if (delta >= ((uint64_t)1 << (LEVEL_COUNT * SLOT_BITS)))
+                tick = currentTick + ((uint64_t)1 << (LEVEL_COUNT * SLOT_BITS)) - 1;
+            Slot &slot = slots[level][(tick >> (level * SLOT_BITS)) & (SLOT_COUNT - 1)];
+            nodes[index].next = NONE;
+            (slot.head == NONE ? slot.head : nodes[slot.tail].next) = index;
+            slot.tail = index;
+        }
+
+        // スロットの要素を、現在のティックからの距離に応じて入れ直す
+        void Cascade(Slot &slot)
+        {
+            uint16_t index = slot.head;
+            slot = Slot();
+            while (index != NONE)
+            {
+                uint16_t next = nodes[index].next;
+                Insert(index);
+                index = next;
+            }
+        }
+
+        Node nodes[N];
+        Slot slots[LEVEL_COUNT][SLOT_COUNT];
+        uint16_t freeList = 0;
+        uint64_t currentTick = 0;
+        size_t count = 0;
+        size_t peakCount = 0;
+    };
+
+}
+}
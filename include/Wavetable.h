@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include "MemoryResource.h"
+
+// 最も倍音の多い(最も長い)テーブルのサンプル数 2のべき乗であること
+// 長いほど低い音まで高域の倍音が残るが、フレームあたりのメモリは約2倍のサンプル数ぶん必要になる
+#ifndef WAVETABLE_TABLE_LENGTH
+#define WAVETABLE_TABLE_LENGTH 2048
+#endif
+// 最も短いテーブルのサンプル数 (基音のみを含む)
+#define WAVETABLE_MIN_TABLE_LENGTH 4
+
+namespace capsule
+{
+namespace sampler
+{
+
+    // 1周期ぶんの波形(フレーム)を並べたウェーブテーブル
+    // フレームごとに、1オクターブずつ倍音を減らして帯域制限したテーブル(ミップテーブル)を保持する
+    // テーブルの長さはオクターブごとに半分になり、各テーブルは長さの1/4までの倍音を含む
+    // 再生時は1サンプルあたりに読み進める量が2以下になるテーブルが選ばれるため、どの音高でも折り返し雑音が発生しない
+    class Wavetable
+    {
+    public:
+        // framesにframeLengthサンプルずつ並べたframeCount個のフレームからテーブルを作成する
+        // frameLengthは任意の長さでよい (ループ区間が1周期になっているサンプルのループ区間などをそのまま使用できる)
+        // フレームごとに離散フーリエ変換を行うため時間がかかる 読み込み時に呼ぶこと
+        // 引数が不正な場合や確保に失敗した場合はnullptrを返す
+        static std::shared_ptr<Wavetable> Create(const int16_t *frames, uint32_t frameLength, uint32_t frameCount, uint32_t tableLength = WAVETABLE_TABLE_LENGTH, MemoryResource *resource = GetDefaultMemoryResource());
+        ~Wavetable();
+        Wavetable(const Wavetable &) = delete;
+        Wavetable &operator=(const Wavetable &) = delete;
+
+        // 作成元のフレームのサンプル数 (音高の計算に使用する)
+        uint32_t GetFrameLength() const { return frameLength; }
+        uint32_t GetFrameCount() const { return frameCount; }
+        // 最も長いテーブルのサンプル数
+        uint32_t GetTableLength() const { return tableLength; }
+        uint32_t GetLevelCount() const { return levelCount; }
+        // frame番目のフレームのlevel番目のテーブル
+        // 長さはGetTableLength() >> levelで、末尾に先頭のサンプルのコピーが1つ続く (補間で読まれる分)
+        const int16_t *GetTable(uint32_t frame, uint32_t level) const { return &memory[frame * frameStride + levelOffsets[level]]; }
+        // 確保しているテーブルのバイト数
+        size_t GetMemorySize() const { return memorySize; }
+
+    private:
+        Wavetable(uint32_t frameLength, uint32_t frameCount, uint32_t tableLength, MemoryResource *resource);
+
+        uint32_t frameLength;
+        uint32_t frameCount;
+        uint32_t tableLength;
+        uint32_t levelCount = 0;
+        uint32_t levelOffsets[32];
+        uint32_t frameStride = 0; // 1フレームぶんのテーブルのサンプル数
+        MemoryResource *resource;
+        int16_t *memory = nullptr;
+        size_t memorySize = 0;
+    };
+
+}
+}
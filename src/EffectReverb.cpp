@@ -1,5 +1,6 @@
 #include <EffectReverb.h>
 #include <cmath>
+#include "Utils.h"
 
 #if __has_include("bits/stdc++.h")
 #include <bits/stdc++.h>
@@ -75,12 +76,18 @@ void EffectReverb::Init()
                     15 * 8) &
                    ~0b11) *
                   sizeof(float);
-#if defined ( ESP_PLATFORM )
-    // DRAMに16バイトアラインされた状態でメモリを確保する (SIMDを使用するには16バイトアラインされている必要がある)
-    memory = (float *)heap_caps_aligned_calloc(16, 1, size, MALLOC_CAP_DMA);
-#else
-    memory = (float *)calloc(1, size);
-#endif
+    // 16バイトアラインされた状態でメモリを確保する (SIMDを使用するには16バイトアラインされている必要がある)
+    if (memory == nullptr)
+    {
+        memory = (float *)resource->Allocate(size, 16);
+        if (memory == nullptr)
+        {
+            LOGE("EffectReverb", "Failed to allocate %u bytes", (unsigned)size);
+            return;
+        }
+        memorySize = size;
+    }
+    memset(memory, 0, size);
 
     // 現状、timeは0.11〜1.0のみ対応
     if (time > 1.0) time = 1.0;
@@ -0,0 +1,116 @@
+#include "FloatSampleCache.h"
+
+#include <cstdlib>
+#include <algorithm>
+#include "MemoryResource.h"
+#include "Sampler.h"
+#include "Utils.h"
+
+namespace capsule
+{
+namespace sampler
+{
+
+FloatSampleCache::~FloatSampleCache()
+{
+    Clear();
+}
+
+void FloatSampleCache::SetBudget(size_t budget)
+{
+    if (budget < this->budget)
+        Clear();
+    this->budget = budget;
+}
+
+void FloatSampleCache::Free(Entry &entry)
+{
+    if (entry.floats != nullptr)
+    {
+        resource->Deallocate(entry.floats, entry.size, 16);
+        used -= entry.size;
+        entry.floats = nullptr;
+    }
+}
+
+void FloatSampleCache::Clear()
+{
+    for (auto &entry : entries)
+        Free(entry);
+    entries.clear();
+}
+
+uint32_t FloatSampleCache::GetEntryCount() const
+{
+    uint32_t count = 0;
+    for (auto &entry : entries)
+    {
+        if (entry.floats != nullptr)
+            count++;
+    }
+    return count;
+}
+
+const float *FloatSampleCache::Get(const Sample &sample)
+{
+    if (budget == 0 || !sample.IsDirect() || !sample.sample)
+        return nullptr;
+    const int16_t *data = sample.sample.get();
+    Entry *found = nullptr;
+    for (auto &entry : entries)
+    {
+        if (entry.data != data || entry.length != sample.length)
+            continue;
+        // 元のデータが解放された後に同じアドレスへ別のデータが確保された場合は、古いエントリーを作り直す
+        if (entry.owned && (entry.owner.expired() || entry.owner.owner_before(sample.sample) || sample.sample.owner_before(entry.owner)))
+        {
+            Free(entry);
+            entry = Entry{data, sample.length, sample.sample, sample.sample.use_count() > 0, 0, nullptr, 0};
+        }
+        found = &entry;
+        break;
+    }
+    if (found != nullptr && found->floats != nullptr)
+    {
+        hitCount++;
+        return found->floats;
+    }
+    missCount++;
+
+    if (found == nullptr)
+    {
+        // 元のデータが解放されたエントリーを取り除いてから追加する
+        for (auto &entry : entries)
+        {
+            if (entry.owned && entry.owner.expired())
+                Free(entry);
+        }
+        entries.erase(std::remove_if(entries.begin(), entries.end(), [](const Entry &entry) { return entry.owned && entry.owner.expired(); }), entries.end());
+        entries.push_back({data, sample.length, sample.sample, sample.sample.use_count() > 0, 0, nullptr, 0});
+        found = &entries.back();
+    }
+    if (++found->uses < FLOAT_SAMPLE_CACHE_ADMIT_COUNT)
+        return nullptr;
+
+    size_t size = (sample.length + SAMPLE_GUARD_LENGTH) * sizeof(float);
+    if (size > budget - used)
+        return nullptr;
+    float *floats = (float *)resource->Allocate(size, 16);
+    if (floats == nullptr)
+    {
+        LOGE("FloatSampleCache", "Failed to allocate %u bytes", (unsigned)size);
+        return nullptr;
+    }
+    for (uint32_t i = 0; i < sample.length; i++)
+        floats[i] = data[i];
+    std::fill(&floats[sample.length], &floats[sample.length + SAMPLE_GUARD_LENGTH], 0.0f);
+    found->floats = floats;
+    found->size = size;
+    used += size;
+    if (used > peakUsed)
+        peakUsed = used;
+    return floats;
+}
+
+}
+}
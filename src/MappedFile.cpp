@@ -0,0 +1,137 @@
+#include "MappedFile.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include "Utils.h"
+
+#if defined(ESP_PLATFORM)
+#include <esp_idf_version.h>
+#include <esp_heap_caps.h>
+#if ESP_IDF_VERSION_MAJOR < 5
+#include <esp_spi_flash.h>
+#endif
+#elif __has_include(<sys/mman.h>)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define MAPPED_FILE_USE_MMAP
+#endif
+
+namespace capsule
+{
+namespace sampler
+{
+
+MappedFile::~MappedFile()
+{
+    switch (kind)
+    {
+    case Kind::HEAP:
+        free((void *)data);
+        break;
+    case Kind::MMAP:
+#if defined(MAPPED_FILE_USE_MMAP)
+        munmap((void *)data, size);
+#endif
+        break;
+    case Kind::PARTITION:
+#if defined(ESP_PLATFORM)
+#if ESP_IDF_VERSION_MAJOR >= 5
+        esp_partition_munmap(partitionHandle);
+#else
+        spi_flash_munmap(partitionHandle);
+#endif
+#endif
+        break;
+    }
+}
+
+std::shared_ptr<MappedFile> MappedFile::Open(const char *path)
+{
+    std::shared_ptr<MappedFile> mapped(new MappedFile());
+#if defined(MAPPED_FILE_USE_MMAP)
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0)
+    {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                close(fd);
+                mapped->data = (const uint8_t *)p;
+                mapped->size = st.st_size;
+                mapped->kind = Kind::MMAP;
+                return mapped;
+            }
+        }
+        close(fd);
+    }
+#endif
+    // マップできない場合は全体を読み込む
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr)
+    {
+        LOGE("MappedFile", "Failed to open %s", path);
+        return nullptr;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t *buffer = nullptr;
+    if (size > 0)
+    {
+#if defined(ESP_PLATFORM)
+        buffer = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+        if (buffer == nullptr)
+#endif
+        buffer = (uint8_t *)malloc(size);
+    }
+    if (buffer == nullptr || fread(buffer, 1, size, file) != (size_t)size)
+    {
+        LOGE("MappedFile", "Failed to read %s", path);
+        free(buffer);
+        fclose(file);
+        return nullptr;
+    }
+    fclose(file);
+    mapped->data = buffer;
+    mapped->size = size;
+    mapped->kind = Kind::HEAP;
+    return mapped;
+}
+
+#if defined(ESP_PLATFORM)
+std::shared_ptr<MappedFile> MappedFile::Open(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    if (partition == nullptr || offset > partition->size)
+        return nullptr;
+    if (size == 0 || offset + size > partition->size)
+        size = partition->size - offset;
+    const void *p = nullptr;
+    esp_err_t err;
+#if ESP_IDF_VERSION_MAJOR >= 5
+    esp_partition_mmap_handle_t handle;
+    err = esp_partition_mmap(partition, offset, size, ESP_PARTITION_MMAP_DATA, &p, &handle);
+#else
+    spi_flash_mmap_handle_t handle;
+    err = esp_partition_mmap(partition, offset, size, SPI_FLASH_MMAP_DATA, &p, &handle);
+#endif
+    if (err != ESP_OK)
+    {
+        LOGE("MappedFile", "Failed to map partition %s (%d)", partition->label, err);
+        return nullptr;
+    }
+    std::shared_ptr<MappedFile> mapped(new MappedFile());
+    mapped->data = (const uint8_t *)p;
+    mapped->size = size;
+    mapped->kind = Kind::PARTITION;
+    mapped->partitionHandle = handle;
+    return mapped;
+}
+#endif
+
+}
+}
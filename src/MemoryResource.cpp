@@ -0,0 +1,150 @@
+#include "MemoryResource.h"
+
+#include <atomic>
+#include <cstdlib>
+#include "Utils.h"
+
+#if defined(ESP_PLATFORM)
+#include <esp_idf_version.h>
+#include <esp_heap_caps.h>
+#endif
+
+namespace capsule
+{
+namespace sampler
+{
+
+#if defined(ESP_PLATFORM)
+class HeapCapsMemoryResource : public MemoryResource
+{
+public:
+    HeapCapsMemoryResource(uint32_t caps, uint32_t fallbackCaps) : caps{caps}, fallbackCaps{fallbackCaps} {}
+    void *Allocate(size_t size, size_t alignment) override
+    {
+        void *p = heap_caps_aligned_alloc(alignment, size, caps);
+        if (p == nullptr && fallbackCaps != 0)
+            p = heap_caps_aligned_alloc(alignment, size, fallbackCaps);
+        return p;
+    }
+    void Deallocate(void *p, size_t, size_t) override
+    {
+#if ESP_IDF_VERSION_MAJOR >= 5
+        heap_caps_free(p);
+#else
+        heap_caps_aligned_free(p);
+#endif
+    }
+
+private:
+    uint32_t caps;
+    uint32_t fallbackCaps;
+};
+
+MemoryResource *GetFastMemoryResource()
+{
+    static HeapCapsMemoryResource resource(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT, 0);
+    return &resource;
+}
+
+MemoryResource *GetSlowMemoryResource()
+{
+    static HeapCapsMemoryResource resource(MALLOC_CAP_SPIRAM, MALLOC_CAP_8BIT);
+    return &resource;
+}
+
+MemoryResource *GetDmaMemoryResource()
+{
+    static HeapCapsMemoryResource resource(MALLOC_CAP_DMA, 0);
+    return &resource;
+}
+
+static MemoryResource *get_heap_memory_resource()
+{
+    static HeapCapsMemoryResource resource(MALLOC_CAP_DEFAULT, 0);
+    return &resource;
+}
+#else
+class MallocMemoryResource : public MemoryResource
+{
+public:
+    void *Allocate(size_t size, size_t alignment) override
+    {
+        // 確保した領域の直前に元のポインターを保存しておく
+        uint8_t *raw = (uint8_t *)malloc(size + alignment + sizeof(void *));
+        if (raw == nullptr)
+            return nullptr;
+        uintptr_t p = ((uintptr_t)raw + sizeof(void *) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        ((void **)p)[-1] = raw;
+        return (void *)p;
+    }
+    void Deallocate(void *p, size_t, size_t) override
+    {
+        if (p != nullptr)
+            free(((void **)p)[-1]);
+    }
+};
+
+MemoryResource *GetFastMemoryResource()
+{
+    static MallocMemoryResource resource;
+    return &resource;
+}
+
+MemoryResource *GetSlowMemoryResource()
+{
+    return GetFastMemoryResource();
+}
+
+MemoryResource *GetDmaMemoryResource()
+{
+    return GetFastMemoryResource();
+}
+
+static MemoryResource *get_heap_memory_resource()
+{
+    return GetFastMemoryResource();
+}
+#endif
+
+static std::atomic<MemoryResource *> default_memory_resource{nullptr};
+
+MemoryResource *GetDefaultMemoryResource()
+{
+    MemoryResource *resource = default_memory_resource.load(std::memory_order_acquire);
+    return resource != nullptr ? resource : get_heap_memory_resource();
+}
+
+MemoryResource *SetDefaultMemoryResource(MemoryResource *resource)
+{
+    MemoryResource *previous = default_memory_resource.exchange(resource, std::memory_order_acq_rel);
+    return previous != nullptr ? previous : get_heap_memory_resource();
+}
+
+MemoryArena::MemoryArena(size_t capacity, MemoryResource *upstream) : upstream{upstream}, capacity{capacity}
+{
+    memory = (uint8_t *)upstream->Allocate(capacity, alignof(std::max_align_t));
+    if (memory == nullptr)
+    {
+        LOGE("MemoryArena", "Failed to allocate %u bytes", (unsigned)capacity);
+        this->capacity = 0;
+    }
+}
+
+MemoryArena::~MemoryArena()
+{
+    if (memory != nullptr)
+        upstream->Deallocate(memory, capacity, alignof(std::max_align_t));
+}
+
+void *MemoryArena::Allocate(size_t size, size_t alignment)
+{
+    uintptr_t base = (uintptr_t)memory;
+    uintptr_t p = (base + used + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (p - base > capacity || size > capacity - (p - base))
+        return nullptr;
+    used = p - base + size;
+    return (void *)p;
+}
+
+}
+}
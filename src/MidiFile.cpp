@@ -0,0 +1,279 @@
+#include "MidiFile.h"
+
+#include <cmath>
+#include <cstring>
+#include "Sampler.h"
+#include "Utils.h"
+
+namespace capsule
+{
+namespace sampler
+{
+
+// SMFの数値はビッグエンディアン
+static uint16_t read_be16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+static uint32_t read_be32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// 可変長の数値を読む 範囲を超える場合や4バイトを超える場合はfalseを返す
+static bool read_varlen(const uint8_t *&p, const uint8_t *end, uint32_t &value)
+{
+    value = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        if (p >= end)
+            return false;
+        uint8_t byte = *p++;
+        value = value << 7 | (byte & 0x7F);
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+std::shared_ptr<MidiFile> MidiFile::Load(const char *path)
+{
+    auto file = MappedFile::Open(path);
+    if (!file)
+    {
+        LOGE("MidiFile", "Failed to open %s", path);
+        return nullptr;
+    }
+    return Load(std::move(file));
+}
+
+std::shared_ptr<MidiFile> MidiFile::Load(std::shared_ptr<MappedFile> file)
+{
+    if (!file)
+        return nullptr;
+    std::shared_ptr<MidiFile> midi(new MidiFile());
+    if (!midi->Parse(file->GetData(), file->GetSize()))
+        return nullptr;
+    midi->file = std::move(file);
+    return midi;
+}
+
+std::shared_ptr<MidiFile> MidiFile::Load(const uint8_t *data, size_t size)
+{
+    if (data == nullptr)
+        return nullptr;
+    std::shared_ptr<MidiFile> midi(new MidiFile());
+    if (!midi->Parse(data, size))
+        return nullptr;
+    return midi;
+}
+
+bool MidiFile::Parse(const uint8_t *data, size_t size)
+{
+    if (size < 14 || memcmp(data, "MThd", 4) != 0 || read_be32(&data[4]) < 6)
+    {
+        LOGE("MidiFile", "Invalid MIDI file");
+        return false;
+    }
+    format = read_be16(&data[8]);
+    uint16_t trackCount = read_be16(&data[10]);
+    division = read_be16(&data[12]);
+    if (format > 1)
+    {
+        LOGE("MidiFile", "Unsupported MIDI file format %u", (unsigned)format);
+        return false;
+    }
+    if (division == 0 || (division & 0x8000 && (division & 0xFF) == 0))
+    {
+        LOGE("MidiFile", "Invalid time division");
+        return false;
+    }
+
+    // トラックチャンクの位置を調べる 知らないチャンクは読み飛ばす
+    uint32_t headerSize = read_be32(&data[4]);
+    if (headerSize > size - 8)
+    {
+        LOGE("MidiFile", "MIDI file is truncated");
+        return false;
+    }
+    const uint8_t *end = data + size;
+    const uint8_t *p = data + 8 + headerSize;
+    tracks.reserve(trackCount);
+    while (end - p >= 8 && tracks.size() < trackCount)
+    {
+        uint32_t chunkSize = read_be32(&p[4]);
+        if (chunkSize > (size_t)(end - p - 8))
+        {
+            LOGE("MidiFile", "MIDI file is truncated");
+            return false;
+        }
+        if (memcmp(p, "MTrk", 4) == 0)
+            tracks.push_back(TrackRange{p + 8, p + 8 + chunkSize});
+        p += 8 + chunkSize;
+    }
+    if (tracks.empty())
+    {
+        LOGE("MidiFile", "MIDI file has no tracks");
+        return false;
+    }
+
+    // 最後まで読み進めて長さを求める
+    Cursor cursor(*this);
+    MidiMessage message;
+    while (cursor.Next(message))
+    {
+    }
+    length = cursor.GetTime();
+    return true;
+}
+
+MidiFile::Cursor::Cursor(const MidiFile &file) : file{&file}, tracks(file.tracks.size()), heap(file.tracks.size())
+{
+    Reset();
+}
+
+void MidiFile::Cursor::Reset()
+{
+    // 最初のデルタタイムを読んだトラックからヒープを作る
+    heapSize = 0;
+    for (size_t i = 0; i < tracks.size(); i++)
+    {
+        tracks[i] = Track{file->tracks[i].begin, file->tracks[i].end, 0, 0};
+        if (ReadDelta(tracks[i]))
+            heap[heapSize++] = i;
+    }
+    for (size_t i = heapSize / 2; i-- > 0;)
+        SiftDown(i);
+    tempoTick = 0;
+    tempoTime = 0.0;
+    SetTempo(500000); // 既定値は120BPM
+    time = 0;
+}
+
+void MidiFile::Cursor::SetTempo(uint32_t microsecondsPerQuarter)
+{
+    uint16_t division = file->division;
+    if (division & 0x8000)
+    { // SMPTE形式: 上位バイトがフレームレート(負の値)、下位バイトが1フレームあたりのティック数
+        int8_t fps = (int8_t)(division >> 8);
+        float frameRate = fps == -29 ? 29.97f : (float)-fps;
+        samplesPerTick = SAMPLE_RATE / (frameRate * (division & 0xFF));
+        return;
+    }
+    samplesPerTick = (double)microsecondsPerQuarter * SAMPLE_RATE / (1000000.0 * division);
+}
+
+void MidiFile::Cursor::SiftDown(size_t index)
+{
+    while (true)
+    {
+        size_t smallest = index;
+        size_t left = index * 2 + 1;
+        size_t right = left + 1;
+        if (left < heapSize && Less(heap[left], heap[smallest]))
+            smallest = left;
+        if (right < heapSize && Less(heap[right], heap[smallest]))
+            smallest = right;
+        if (smallest == index)
+            return;
+        std::swap(heap[index], heap[smallest]);
+        index = smallest;
+    }
+}
+
+bool MidiFile::Cursor::ReadDelta(Track &track)
+{
+    uint32_t delta;
+    if (!read_varlen(track.pos, track.end, delta) || track.pos >= track.end)
+        return false;
+    track.tick += delta;
+    return true;
+}
+
+void MidiFile::Cursor::AdvanceTop()
+{
+    if (!ReadDelta(tracks[heap[0]]))
+        heap[0] = heap[--heapSize];
+    SiftDown(0);
+}
+
+void MidiFile::Cursor::EndTop()
+{
+    heap[0] = heap[--heapSize];
+    SiftDown(0);
+}
+
+bool MidiFile::Cursor::Next(MidiMessage &message)
+{
+    while (heapSize > 0)
+    {
+        Track &track = tracks[heap[0]];
+        const uint8_t *p = track.pos;
+        const uint8_t *end = track.end;
+        uint64_t tick = track.tick;
+        time = (uint32_t)llround(GetTickTime(tick));
+
+        uint8_t status = *p;
+        if (status & 0x80)
+            p++;
+        else
+            status = track.runningStatus; // ランニングステータス
+        if (status == 0xFF)
+        { // メタイベント
+            uint32_t length;
+            if (p >= end)
+            {
+                EndTop();
+                continue;
+            }
+            uint8_t type = *p++;
+            if (!read_varlen(p, end, length) || length > (size_t)(end - p))
+            {
+                EndTop();
+                continue;
+            }
+            if (type == 0x51 && length == 3)
+            {
+                // テンポが変わるティックまでの時刻を確定させてから、以降の換算に使用する
+                tempoTime = GetTickTime(tick);
+                tempoTick = tick;
+                SetTempo((uint32_t)p[0] << 16 | p[1] << 8 | p[2]);
+            }
+            track.pos = p + length;
+            if (type == 0x2F)
+                track.pos = end; // トラックの終わり
+            AdvanceTop();
+            continue;
+        }
+        if (status == 0xF0 || status == 0xF7)
+        { // システムエクスクルーシブ
+            uint32_t length;
+            if (!read_varlen(p, end, length) || length > (size_t)(end - p))
+            {
+                EndTop();
+                continue;
+            }
+            track.pos = p + length;
+            AdvanceTop();
+            continue;
+        }
+        size_t dataLength = (status & 0xE0) == 0xC0 ? 1 : 2; // プログラムチェンジとチャンネルプレッシャーのみ1バイト
+        if (status < 0x80 || status > 0xEF || (size_t)(end - p) < dataLength)
+        { // ランニングステータスがない、トラック内に現れないメッセージ、または途中で切れている
+            EndTop();
+            continue;
+        }
+        track.runningStatus = status;
+        message.time = time;
+        message.status = status;
+        message.data1 = p[0];
+        message.data2 = dataLength == 2 ? p[1] : 0;
+        track.pos = p + dataLength;
+        AdvanceTop();
+        return true;
+    }
+    return false;
+}
+
+}
+}
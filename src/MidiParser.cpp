@@ -0,0 +1,73 @@
+#include "MidiParser.h"
+
+namespace capsule
+{
+namespace sampler
+{
+
+// ステータスバイトに続くデータバイトの数
+static uint8_t get_data_length(uint8_t status)
+{
+    switch (status & 0xF0)
+    {
+    case 0xC0: // プログラムチェンジ
+    case 0xD0: // チャンネルプレッシャー
+        return 1;
+    case 0xF0:
+        if (status == 0xF1 || status == 0xF3) // MTCクォーターフレーム・ソングセレクト
+            return 1;
+        if (status == 0xF2) // ソングポジションポインター
+            return 2;
+        return 0;
+    default:
+        return 2;
+    }
+}
+
+bool MidiParser::Parse(uint8_t byte, Message &message)
+{
+    if (byte >= 0xF8)
+    { // リアルタイムメッセージはどこにでも挟まれうるが、解釈中のメッセージには影響しない
+        return false;
+    }
+    if (byte & 0x80)
+    { // ステータスバイト システムエクスクルーシブの終端(0xF7)を含め、解釈中のメッセージは破棄される
+        dataCount = 0;
+        dataLength = get_data_length(byte);
+        // システムエクスクルーシブとデータバイトのないシステムコモンメッセージは、次のステータスバイトまでデータバイトを読み飛ばす
+        status = (byte >= 0xF0 && dataLength == 0) ? 0 : byte;
+        return false;
+    }
+    if (status == 0)
+        return false;
+    if (dataCount == 0 && dataLength == 2)
+    {
+        data1 = byte;
+        dataCount = 1;
+        return false;
+    }
+    uint8_t first = dataLength == 2 ? data1 : byte;
+    uint8_t second = dataLength == 2 ? byte : 0;
+    dataCount = 0;
+    if (status >= 0xF0)
+    { // システムコモンメッセージはランニングステータスの対象ではない
+        status = 0;
+        return false;
+    }
+    message.status = status;
+    message.data1 = first;
+    message.data2 = second;
+    if ((status & 0xF0) == 0x90 && second == 0)
+        message.status = 0x80 | (status & 0x0F);
+    return true;
+}
+
+void MidiParser::Reset()
+{
+    status = 0;
+    dataCount = 0;
+    dataLength = 0;
+}
+
+}
+}
@@ -0,0 +1,253 @@
+#include "Resampler.h"
+
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#include "Utils.h"
+
+#if !defined(M_PI)
+#define M_PI 3.14159265359
+#endif
+
+// sinc関数の片側のゼロ交差の数 (フィルターのタップ数は両側でこの2倍)
+#define RESAMPLER_ZERO_CROSSINGS 32
+// sinc関数の表の1区間あたりの分割数 (間は線形補間する)
+#define RESAMPLER_PHASES 256
+// 係数を事前に計算しておく位相の数の上限
+#define RESAMPLER_MAX_POLYPHASE 1024
+
+namespace capsule
+{
+namespace sampler
+{
+
+// 窓関数を掛けたsinc関数の表 (0からRESAMPLER_ZERO_CROSSINGSまで)
+struct sinc_table_t
+{
+    float values[RESAMPLER_ZERO_CROSSINGS * RESAMPLER_PHASES + 2];
+    sinc_table_t()
+    {
+        for (int i = 0; i <= RESAMPLER_ZERO_CROSSINGS * RESAMPLER_PHASES; i++)
+        {
+            double x = (double)i / RESAMPLER_PHASES;
+            double u = x / RESAMPLER_ZERO_CROSSINGS;
+            double window = 0.42 + 0.5 * cos(M_PI * u) + 0.08 * cos(2.0 * M_PI * u);
+            values[i] = (i == 0 ? 1.0 : sin(M_PI * x) / (M_PI * x)) * window;
+        }
+        values[RESAMPLER_ZERO_CROSSINGS * RESAMPLER_PHASES + 1] = 0.0f;
+    }
+};
+
+static const sinc_table_t &get_sinc_table()
+{
+    static const sinc_table_t table;
+    return table;
+}
+
+uint32_t GetResampledLength(uint32_t length, uint32_t srcRate, uint32_t dstRate)
+{
+    return (uint32_t)(((uint64_t)length * dstRate + srcRate - 1) / srcRate);
+}
+
+// 窓関数付きsinc関数の値 xはゼロ交差の間隔を1とした中心からの距離
+static float sinc_kernel(const float *table, double x)
+{
+    float d = (float)(fabs(x) * RESAMPLER_PHASES);
+    int index = (int)d;
+    if (index >= RESAMPLER_ZERO_CROSSINGS * RESAMPLER_PHASES)
+        return 0.0f;
+    float frac = d - index;
+    return table[index] + (table[index + 1] - table[index]) * frac;
+}
+
+static uint32_t gcd(uint32_t a, uint32_t b)
+{
+    while (b != 0)
+    {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+template <typename T>
+static int16_t to_int16(T value)
+{
+    return (int16_t)std::min(std::max(lrintf(value), -32768L), 32767L);
+}
+
+template <typename T>
+static void resample(const T *src, uint32_t length, uint32_t srcRate, uint32_t dstRate, int16_t *dst, float scale)
+{
+    uint32_t dstLength = GetResampledLength(length, srcRate, dstRate);
+    if (srcRate == dstRate)
+    {
+        for (uint32_t i = 0; i < length; i++)
+            dst[i] = to_int16(src[i] * scale);
+        return;
+    }
+    const float *table = get_sinc_table().values;
+    // ダウンサンプリングの場合は折り返しを防ぐためにカットオフ周波数を下げる
+    double cutoff = std::min(1.0, (double)dstRate / srcRate);
+    double halfWidth = RESAMPLER_ZERO_CROSSINGS / cutoff;
+    float gain = cutoff * scale;
+
+    // 周波数の比が単純な場合(44100→48000は147:160)は、出力のサンプルが取りうる位相ごとにフィルターの係数を事前に計算しておく
+    uint32_t g = gcd(srcRate, dstRate);
+    uint32_t up = dstRate / g;
+    uint32_t down = srcRate / g;
+    if (up <= RESAMPLER_MAX_POLYPHASE)
+    {
+        int taps = 2 * (int)ceil(halfWidth);
+        int before = taps / 2 - 1; // 各出力サンプルの直前にあるタップの数
+        std::vector<float> filters((size_t)up * taps);
+        for (uint32_t phase = 0; phase < up; phase++)
+        {
+            double frac = (double)phase / up;
+            for (int k = 0; k < taps; k++)
+                filters[(size_t)phase * taps + k] = sinc_kernel(table, (frac - (k - before)) * cutoff) * gain;
+        }
+        for (uint32_t i = 0; i < dstLength; i++)
+        {
+            uint64_t pos = (uint64_t)i * down;
+            int64_t base = (int64_t)(pos / up) - before;
+            const float *filter = &filters[(size_t)(pos % up) * taps];
+            float acc = 0.0f;
+            if (base >= 0 && base + taps <= length)
+            {
+                const T *s = &src[base];
+                for (int k = 0; k < taps; k++)
+                    acc += s[k] * filter[k];
+            }
+            else
+            {
+                // 端では範囲外を0とみなす
+                for (int k = 0; k < taps; k++)
+                {
+                    int64_t j = base + k;
+                    if (j >= 0 && j < length)
+                        acc += src[j] * filter[k];
+                }
+            }
+            dst[i] = to_int16(acc);
+        }
+        return;
+    }
+
+    double step = (double)srcRate / dstRate;
+    for (uint32_t i = 0; i < dstLength; i++)
+    {
+        double t = i * step;
+        int64_t first = std::max<int64_t>((int64_t)ceil(t - halfWidth), 0);
+        int64_t last = std::min<int64_t>((int64_t)floor(t + halfWidth), (int64_t)length - 1);
+        float acc = 0.0f;
+        for (int64_t j = first; j <= last; j++)
+            acc += src[j] * sinc_kernel(table, (t - j) * cutoff);
+        dst[i] = to_int16(acc * gain);
+    }
+}
+
+void Resample(const float *src, uint32_t length, uint32_t srcRate, uint32_t dstRate, int16_t *dst)
+{
+    resample(src, length, srcRate, dstRate, dst, 32767.0f);
+}
+
+void Resample(const int16_t *src, uint32_t length, uint32_t srcRate, uint32_t dstRate, int16_t *dst)
+{
+    resample(src, length, srcRate, dstRate, dst, 1.0f);
+}
+
+// 位置posをsrcRateからdstRateに変換し、最も近いサンプルの位置を返す
+static uint32_t convert_position(uint32_t pos, uint32_t srcRate, uint32_t dstRate, uint32_t length)
+{
+    return std::min((uint32_t)(((uint64_t)pos * dstRate + srcRate / 2) / srcRate), length);
+}
+
+// sampleのサンプリング周波数を約1/2にしたレベルを作成する
+static std::shared_ptr<Sample> create_half_rate(const Sample &sample)
+{
+    bool looping = sample.adsrEnabled && sample.loopStart != sample.loopEnd;
+    // ループ長が整数のまま半分になるように、ループする場合はループ長の比で変換する
+    uint32_t srcRate = 2;
+    uint32_t dstRate = 1;
+    if (looping)
+    {
+        srcRate = sample.loopEnd - sample.loopStart;
+        dstRate = (srcRate + 1) / 2;
+    }
+    uint32_t length = GetResampledLength(sample.length, srcRate, dstRate);
+    uint32_t loopStart = length;
+    uint32_t loopEnd = length;
+    if (looping)
+    {
+        // ループ開始位置は元のループ区間の内側に切り上げる
+        loopStart = (uint32_t)(((uint64_t)sample.loopStart * dstRate + srcRate - 1) / srcRate);
+        loopEnd = loopStart + dstRate;
+        if (loopEnd > length)
+            return nullptr;
+    }
+    // 整数にしたサンプリング周波数と実際の比との差はtuneで補正する
+    double rate = (double)sample.sampleRate * dstRate / srcRate;
+    uint32_t levelRate = std::max<uint32_t>((uint32_t)lround(rate), 1);
+    float tune = sample.tune + 1200.0 * log2(rate / levelRate);
+    int16_t *buffer = new int16_t[length + GetSampleGuardLength(127 - sample.root + tune * 0.01f, levelRate)]();
+    Resample(sample.sample.get(), sample.length, srcRate, dstRate, buffer);
+    auto result = std::make_shared<Sample>(std::shared_ptr<const int16_t>(buffer, std::default_delete<int16_t[]>()), length, sample.root, loopStart, loopEnd, sample.adsrEnabled, sample.attack, sample.decay, sample.sustain, sample.release);
+    result->sampleRate = levelRate;
+    result->tune = tune;
+    return result;
+}
+
+bool GenerateMipmaps(Sample &sample, uint32_t levelCount)
+{
+    if (!sample.IsDirect() || !sample.sample || sample.sampleRate == 0)
+    {
+        LOGE("Resampler", "Mipmaps can only be generated for 16-bit linear PCM samples");
+        return false;
+    }
+    // 低いレベルから順に作成し、上のレベルのhalfRateとしてつないでいく
+    std::vector<std::shared_ptr<Sample>> levels;
+    const Sample *current = &sample;
+    for (uint32_t i = 0; i < levelCount; i++)
+    {
+        auto level = create_half_rate(*current);
+        if (!level)
+            break;
+        levels.push_back(level);
+        current = level.get();
+    }
+    if (levels.empty())
+        return false;
+    for (size_t i = levels.size() - 1; i > 0; i--)
+        levels[i - 1]->halfRate = levels[i];
+    sample.halfRate = levels[0];
+    return true;
+}
+
+std::shared_ptr<Sample> ResampleSample(const Sample &sample, uint32_t dstRate, uint8_t highestNote)
+{
+    if (!sample.IsDirect() || !sample.sample || sample.sampleRate == 0 || dstRate == 0)
+    {
+        LOGE("Resampler", "Only 16-bit linear PCM samples can be resampled");
+        return nullptr;
+    }
+    uint32_t srcRate = sample.sampleRate;
+    uint32_t length = GetResampledLength(sample.length, srcRate, dstRate);
+    int16_t *buffer = new int16_t[length + GetSampleGuardLength(highestNote - sample.root + sample.tune * 0.01f, dstRate)]();
+    Resample(sample.sample.get(), sample.length, srcRate, dstRate, buffer);
+    uint32_t loopStart = convert_position(sample.loopStart, srcRate, dstRate, length);
+    uint32_t loopEnd = convert_position(sample.loopEnd, srcRate, dstRate, length);
+    // ループしないサンプルは終端を指していたループポイントも終端に揃える
+    if (sample.loopStart == sample.length)
+        loopStart = length;
+    if (sample.loopEnd == sample.length)
+        loopEnd = length;
+    auto result = std::make_shared<Sample>(std::shared_ptr<const int16_t>(buffer, std::default_delete<int16_t[]>()), length, sample.root, loopStart, loopEnd, sample.adsrEnabled, sample.attack, sample.decay, sample.sustain, sample.release);
+    result->tune = sample.tune;
+    result->sampleRate = dstRate;
+    return result;
+}
+
+}
+}
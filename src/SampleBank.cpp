@@ -0,0 +1,494 @@
+#include "SampleBank.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "Resampler.h"
+#include "Utils.h"
+
+// ESP32・x86・ARMなどリトルエンディアンの環境でのみ使用できる (各構造体をファイル上のバイト列として直接参照する)
+
+namespace capsule
+{
+namespace sampler
+{
+
+static const char SAMPLE_BANK_MAGIC[4] = {'C', 'S', 'B', 'K'};
+
+static uint32_t align_offset(uint32_t offset)
+{
+    return (offset + SAMPLE_BANK_ALIGNMENT - 1) & ~(uint32_t)(SAMPLE_BANK_ALIGNMENT - 1);
+}
+
+// offsetからsizeバイトがファイル内に収まっているかどうか
+static bool in_range(uint32_t offset, uint64_t size, size_t fileSize)
+{
+    return offset <= fileSize && size <= fileSize - offset;
+}
+
+// サンプルが参照している波形データのバイト数
+static uint32_t get_data_size(const Sample &sample)
+{
+    if (sample.format == SampleFormat::PCM16)
+        return sample.length * sizeof(int16_t);
+    if (sample.format == SampleFormat::LOSSLESS)
+        return GetLosslessSize(sample.encoded.get()) + 8; // 符号化時の余白も含める
+    return GetEncodedSize(sample.format, sample.length);
+}
+
+static const void *get_data(const Sample &sample)
+{
+    if (sample.format == SampleFormat::PCM16)
+        return sample.sample.get();
+    return sample.encoded.get();
+}
+
+std::shared_ptr<SampleBank> SampleBank::Load(const char *path)
+{
+    auto file = MappedFile::Open(path);
+    if (!file)
+        return nullptr;
+    return Load(std::move(file));
+}
+
+#if defined(ESP_PLATFORM)
+std::shared_ptr<SampleBank> SampleBank::Load(const esp_partition_t *partition)
+{
+    auto file = MappedFile::Open(partition);
+    if (!file)
+        return nullptr;
+    return Load(std::move(file));
+}
+#endif
+
+std::shared_ptr<SampleBank> SampleBank::Load(std::shared_ptr<MappedFile> file)
+{
+    auto bank = std::make_shared<SampleBank>(std::move(file));
+    if (!bank->Parse())
+        return nullptr;
+    return bank;
+}
+
+bool SampleBank::Parse()
+{
+    const uint8_t *data = file->GetData();
+    size_t size = file->GetSize();
+    if (size < sizeof(SampleBankHeader) || ((uintptr_t)data & 3) != 0)
+    {
+        LOGE("SampleBank", "Invalid sample bank");
+        return false;
+    }
+    const SampleBankHeader *header = (const SampleBankHeader *)data;
+    if (memcmp(header->magic, SAMPLE_BANK_MAGIC, 4) != 0 || header->headerSize < sizeof(SampleBankHeader))
+    {
+        LOGE("SampleBank", "Invalid sample bank");
+        return false;
+    }
+    if (header->version != SAMPLE_BANK_VERSION && header->version != 1)
+    {
+        LOGE("SampleBank", "Unsupported sample bank version %d", header->version);
+        return false;
+    }
+    // パーティションをマップした場合などはファイルの後ろに余分な領域が続いている
+    if (header->fileSize > size)
+    {
+        LOGE("SampleBank", "Sample bank is truncated (%u < %u)", (unsigned)size, (unsigned)header->fileSize);
+        return false;
+    }
+    size = header->fileSize;
+    size_t entrySize = header->version == 1 ? SAMPLE_BANK_V1_SAMPLE_ENTRY_SIZE : sizeof(SampleBankSampleEntry);
+    if (!in_range(header->sampleTableOffset, (uint64_t)header->sampleCount * entrySize, size) ||
+        !in_range(header->timbreTableOffset, (uint64_t)header->timbreCount * sizeof(SampleBankTimbreEntry), size) ||
+        !in_range(header->zoneTableOffset, (uint64_t)header->zoneCount * sizeof(SampleBankZoneEntry), size) ||
+        (header->sampleTableOffset & 3) != 0 || (header->timbreTableOffset & 3) != 0 || (header->zoneTableOffset & 3) != 0)
+    {
+        LOGE("SampleBank", "Sample bank tables are out of range");
+        return false;
+    }
+
+    samples.clear();
+    samples.reserve(header->sampleCount);
+    for (uint32_t i = 0; i < header->sampleCount; i++)
+    {
+        // バージョン1の項目は後ろのフィールドを既定値で補う
+        SampleBankSampleEntry e = {};
+        e.sampleRate = SAMPLE_RATE;
+        memcpy(&e, &data[header->sampleTableOffset + i * entrySize], entrySize);
+        SampleFormat format = (SampleFormat)e.format;
+        if (e.format > (uint8_t)SampleFormat::LOSSLESS || !in_range(e.dataOffset, e.dataSize, size) ||
+            e.loopStart > e.loopEnd || e.loopEnd > e.length || e.sampleRate == 0)
+        {
+            LOGE("SampleBank", "Sample %u is invalid", (unsigned)i);
+            return false;
+        }
+        const uint8_t *p = &data[e.dataOffset];
+        // ロスレス形式はデコード時にブロックの位置と符号をそのまま信用するので、すべてのブロックを検証しておく
+        bool valid = format == SampleFormat::LOSSLESS ? ValidateLosslessData(p, e.dataSize, e.length) : e.dataSize >= GetEncodedSize(format, e.length);
+        // 16bitリニアPCMはスライスが他のサンプルの途中を参照していることがあるので、2バイト境界でよい
+        if (!valid || (e.dataOffset & (format == SampleFormat::PCM16 ? 1 : 3)) != 0)
+        {
+            LOGE("SampleBank", "Sample %u has not enough data", (unsigned)i);
+            return false;
+        }
+        bool adsrEnabled = e.flags & SAMPLE_BANK_FLAG_ADSR_ENABLED;
+        // 波形データはマップされた領域を直接参照する (所有権はバンクが持つ)
+        if (format == SampleFormat::PCM16)
+            samples.emplace_back((const int16_t *)p, e.length, e.root, e.loopStart, e.loopEnd, adsrEnabled, e.attack, e.decay, e.sustain, e.release);
+        else
+            samples.emplace_back(format, p, e.length, e.root, e.loopStart, e.loopEnd, adsrEnabled, e.attack, e.decay, e.sustain, e.release, e.adpcmStart, e.adpcmLoop);
+        samples.back().sampleRate = e.sampleRate;
+        samples.back().tune = e.tune;
+    }
+
+    timbres = (const SampleBankTimbreEntry *)&data[header->timbreTableOffset];
+    zones = (const SampleBankZoneEntry *)&data[header->zoneTableOffset];
+    for (uint32_t i = 0; i < header->timbreCount; i++)
+    {
+        if (timbres[i].firstZone > header->zoneCount || timbres[i].zoneCount > header->zoneCount - timbres[i].firstZone)
+        {
+            LOGE("SampleBank", "Timbre %u is invalid", (unsigned)i);
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < header->zoneCount; i++)
+    {
+        if (zones[i].sampleIndex >= header->sampleCount)
+        {
+            LOGE("SampleBank", "Zone %u refers to missing sample", (unsigned)i);
+            return false;
+        }
+    }
+
+    // カーネルは終端を超えて読み進めるため、16bitリニアPCMの波形データの後ろに書き込まれている無音がファイル内に収まっていることを確かめる
+    // 無音の長さはSampleBankWriterと同じく、サンプルを参照するゾーンの最も高いノートから求める
+    std::vector<uint8_t> highestNotes(samples.size(), 0);
+    std::vector<bool> referenced(samples.size(), false);
+    for (uint32_t i = 0; i < header->zoneCount; i++)
+    {
+        highestNotes[zones[i].sampleIndex] = std::max(highestNotes[zones[i].sampleIndex], zones[i].upperNoteNo);
+        referenced[zones[i].sampleIndex] = true;
+    }
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        const Sample &s = samples[i];
+        if (s.format != SampleFormat::PCM16)
+            continue;
+        uint32_t offset = (const uint8_t *)s.sample.get() - data;
+        uint64_t guardLength = GetSampleGuardLength(s, referenced[i] ? highestNotes[i] : 127);
+        if (!in_range(offset, ((uint64_t)s.length + guardLength) * sizeof(int16_t), size))
+        {
+            LOGE("SampleBank", "Sample %u has no guard after its data", (unsigned)i);
+            return false;
+        }
+    }
+    timbreCount = header->timbreCount;
+    return true;
+}
+
+std::shared_ptr<const Sample> SampleBank::GetSample(size_t index)
+{
+    if (index >= samples.size())
+        return nullptr;
+    // バンク自体の参照カウントを共有する
+    return std::shared_ptr<const Sample>(shared_from_this(), &samples[index]);
+}
+
+std::shared_ptr<Timbre> SampleBank::GetTimbre(size_t index)
+{
+    if (index >= timbreCount)
+        return nullptr;
+    std::vector<Timbre::MappedSample> mss;
+    const SampleBankTimbreEntry &t = timbres[index];
+    mss.reserve(t.zoneCount);
+    for (uint32_t i = 0; i < t.zoneCount; i++)
+    {
+        const SampleBankZoneEntry &z = zones[t.firstZone + i];
+        mss.emplace_back(GetSample(z.sampleIndex), z.lowerNoteNo, z.upperNoteNo, z.lowerVelocity, z.upperVelocity);
+    }
+    return std::make_shared<Timbre>(std::move(mss));
+}
+
+size_t SampleBank::PlaceHotRegions(std::shared_ptr<MemoryResource> fast, uint32_t headLength)
+{
+    size_t placed = 0;
+    // 持続音はループ区間だけを読み続けるので、先にすべてのループ区間を配置する
+    for (auto &sample : samples)
+        placed += sampler::PlaceHotRegions(sample, fast, 0);
+    for (auto &sample : samples)
+        placed += sampler::PlaceHotRegions(sample, fast, headLength);
+    return placed;
+}
+
+void SampleBank::GenerateMipmaps(uint32_t levelCount)
+{
+    for (auto &sample : samples)
+    {
+        if (sample.format == SampleFormat::PCM16)
+            sampler::GenerateMipmaps(sample, levelCount);
+    }
+}
+
+uint32_t SampleBankWriter::AddSample(std::shared_ptr<const Sample> sample)
+{
+    if (!sample || sample->stream)
+    {
+        LOGE("SampleBank", "Streaming samples cannot be added to a sample bank");
+        return UINT32_MAX;
+    }
+    if (sample->wavetable || sample->granular)
+    {
+        LOGE("SampleBank", "Wavetable and granular samples cannot be added to a sample bank");
+        return UINT32_MAX;
+    }
+    samples.push_back(std::move(sample));
+    return samples.size() - 1;
+}
+
+uint32_t SampleBankWriter::AddTimbre(std::vector<Zone> zones)
+{
+    timbres.push_back(std::move(zones));
+    return timbres.size() - 1;
+}
+
+void SampleBankWriter::SetTrimAfterLoop(bool enabled, uint32_t guardLength)
+{
+    trimAfterLoop = enabled;
+    trimGuardLength = guardLength;
+}
+
+void SampleBankWriter::SetLoopCrossfade(bool enabled, uint32_t fadeLength)
+{
+    loopCrossfade = enabled;
+    loopCrossfadeLength = fadeLength;
+}
+
+void SampleBankWriter::Prepare(std::vector<std::shared_ptr<const Sample>> &samples, std::vector<size_t> &owners) const
+{
+    samples = this->samples;
+    // クロスフェードはloopEndより後ろの波形も書き換えるので、切り詰めるより先に行う
+    if (loopCrossfade)
+    {
+        for (auto &sample : samples)
+        {
+            // ループ長かloopStartが0でクロスフェードの長さが0に短縮されるサンプルは、そのまま書き込む
+            if (sample->format != SampleFormat::PCM16 || !sample->adsrEnabled || sample->loopStart == sample->loopEnd || sample->loopStart == 0 || loopCrossfadeLength == 0)
+                continue;
+            if (auto baked = BakeLoopCrossfade(*sample, loopCrossfadeLength))
+                sample = std::move(baked);
+        }
+    }
+    if (trimAfterLoop)
+    {
+        std::vector<uint8_t> highestNotes = GetHighestNotes();
+        for (size_t i = 0; i < samples.size(); i++)
+        {
+            auto &sample = samples[i];
+            if (sample->format != SampleFormat::PCM16)
+                continue;
+            uint32_t guardLength = trimGuardLength != 0 ? trimGuardLength : GetSampleGuardLength(*sample, highestNotes[i]);
+            if (auto trimmed = TrimAfterLoop(*sample, guardLength))
+                sample = std::move(trimmed);
+        }
+    }
+
+    // 他のサンプルの波形データの範囲に含まれているサンプル(スライスなど)は、そのサンプルの波形データを参照させる
+    // 含んでいるサンプルが複数ある場合は最も長いもの(同じ長さなら先に追加されたもの)を選ぶ
+    owners.resize(samples.size());
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        owners[i] = i;
+        const Sample &s = *samples[i];
+        if (s.format != SampleFormat::PCM16)
+            continue;
+        for (size_t j = 0; j < samples.size(); j++)
+        {
+            const Sample &o = *samples[j];
+            const Sample &owner = *samples[owners[i]];
+            if (o.format != SampleFormat::PCM16 || s.sample.get() < o.sample.get() || s.sample.get() + s.length > o.sample.get() + o.length)
+                continue;
+            if (o.length > owner.length || (o.length == owner.length && j < owners[i]))
+                owners[i] = j;
+        }
+    }
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        while (owners[owners[i]] != owners[i])
+            owners[i] = owners[owners[i]];
+    }
+}
+
+std::vector<uint8_t> SampleBankWriter::GetHighestNotes() const
+{
+    std::vector<uint8_t> notes(samples.size(), 0);
+    std::vector<bool> referenced(samples.size(), false);
+    for (auto &zones : timbres)
+    {
+        for (auto &zone : zones)
+        {
+            if (zone.sampleIndex >= samples.size())
+                continue;
+            notes[zone.sampleIndex] = std::max(notes[zone.sampleIndex], zone.upperNoteNo);
+            referenced[zone.sampleIndex] = true;
+        }
+    }
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        if (!referenced[i])
+            notes[i] = 127;
+    }
+    return notes;
+}
+
+std::vector<uint8_t> SampleBankWriter::Build() const
+{
+    std::vector<std::shared_ptr<const Sample>> samples;
+    std::vector<size_t> owners;
+    Prepare(samples, owners);
+
+    // カーネルは終端を超えて読み進めるため、16bitリニアPCMの波形データの後ろに無音を置き、隣のサンプルの波形やファイルの終わりの先を読まないようにする
+    // 長さは波形データを共有するサンプルのうち、最も先まで読み進めるものに合わせる
+    std::vector<uint8_t> highestNotes = GetHighestNotes();
+    std::vector<uint32_t> guardLengths(samples.size(), 0);
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        const Sample &s = *samples[i];
+        if (s.format != SampleFormat::PCM16)
+            continue;
+        const Sample &owner = *samples[owners[i]];
+        int64_t reach = (s.sample.get() - owner.sample.get()) + (int64_t)s.length + GetSampleGuardLength(s, highestNotes[i]);
+        guardLengths[owners[i]] = std::max<int64_t>(guardLengths[owners[i]], reach - owner.length);
+    }
+
+    uint32_t zoneCount = 0;
+    for (auto &t : timbres)
+        zoneCount += t.size();
+
+    SampleBankHeader header = {};
+    memcpy(header.magic, SAMPLE_BANK_MAGIC, 4);
+    header.version = SAMPLE_BANK_VERSION;
+    header.headerSize = sizeof(SampleBankHeader);
+    header.sampleCount = samples.size();
+    header.sampleTableOffset = align_offset(sizeof(SampleBankHeader));
+    header.timbreCount = timbres.size();
+    header.timbreTableOffset = align_offset(header.sampleTableOffset + samples.size() * sizeof(SampleBankSampleEntry));
+    header.zoneCount = zoneCount;
+    header.zoneTableOffset = align_offset(header.timbreTableOffset + timbres.size() * sizeof(SampleBankTimbreEntry));
+    uint32_t offset = align_offset(header.zoneTableOffset + zoneCount * sizeof(SampleBankZoneEntry));
+
+    std::vector<SampleBankSampleEntry> entries(samples.size());
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        const Sample &s = *samples[i];
+        SampleBankSampleEntry &e = entries[i];
+        memset(&e, 0, sizeof(e));
+        e.dataOffset = offset;
+        e.dataSize = get_data_size(s);
+        e.length = s.length;
+        e.loopStart = s.loopStart;
+        e.loopEnd = s.loopEnd;
+        e.attack = s.attack;
+        e.decay = s.decay;
+        e.sustain = s.sustain;
+        e.release = s.release;
+        e.root = s.root;
+        e.format = (uint8_t)s.format;
+        e.flags = s.adsrEnabled ? SAMPLE_BANK_FLAG_ADSR_ENABLED : 0;
+        e.adpcmStart = s.adpcmStart;
+        e.adpcmLoop = s.adpcmLoop;
+        e.sampleRate = s.sampleRate;
+        e.tune = s.tune;
+        if (owners[i] == i)
+            offset = align_offset(offset + e.dataSize + guardLengths[i] * sizeof(int16_t));
+    }
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        if (owners[i] != i)
+            entries[i].dataOffset = entries[owners[i]].dataOffset + (samples[i]->sample.get() - samples[owners[i]]->sample.get()) * sizeof(int16_t);
+    }
+    header.fileSize = offset;
+
+    std::vector<uint8_t> out(offset, 0);
+    memcpy(&out[0], &header, sizeof(header));
+    if (!entries.empty())
+        memcpy(&out[header.sampleTableOffset], entries.data(), entries.size() * sizeof(SampleBankSampleEntry));
+    uint32_t zoneIndex = 0;
+    for (size_t i = 0; i < timbres.size(); i++)
+    {
+        SampleBankTimbreEntry t = {zoneIndex, (uint32_t)timbres[i].size()};
+        memcpy(&out[header.timbreTableOffset + i * sizeof(t)], &t, sizeof(t));
+        for (auto &zone : timbres[i])
+        {
+            SampleBankZoneEntry z = {zone.sampleIndex, zone.lowerNoteNo, zone.upperNoteNo, zone.lowerVelocity, zone.upperVelocity};
+            memcpy(&out[header.zoneTableOffset + zoneIndex * sizeof(z)], &z, sizeof(z));
+            zoneIndex++;
+        }
+    }
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        // ストリーミング再生しないサンプルの波形データは常にメモリ上にある
+        if (owners[i] == i && entries[i].dataSize > 0)
+            memcpy(&out[entries[i].dataOffset], get_data(*samples[i]), entries[i].dataSize);
+    }
+    return out;
+}
+
+void SampleBankWriter::PrintReport() const
+{
+    std::vector<std::shared_ptr<const Sample>> prepared;
+    std::vector<size_t> owners;
+    Prepare(prepared, owners);
+
+    // 波形データを他のサンプルと共有しているサンプルは、参照先のサンプルに含めて数える
+    size_t totalSize = 0;
+    size_t totalTrimmed = 0;
+    printf("sample  length  loopEnd    bytes  trimmed  owner\n");
+    for (size_t i = 0; i < prepared.size(); i++)
+    {
+        const Sample &s = *prepared[i];
+        size_t size = owners[i] == i ? get_data_size(s) : 0;
+        size_t trimmed = owners[i] == i ? get_data_size(*samples[i]) - size : 0;
+        totalSize += size;
+        totalTrimmed += trimmed;
+        printf("%6u %7u %8u %8u %8u", (unsigned)i, (unsigned)s.length, (unsigned)s.loopEnd, (unsigned)size, (unsigned)trimmed);
+        if (owners[i] != i)
+            printf("  %5u", (unsigned)owners[i]);
+        printf("\n");
+    }
+    printf("total  %25u %8u\n", (unsigned)totalSize, (unsigned)totalTrimmed);
+
+    printf("timbre  zones  samples    bytes\n");
+    for (size_t i = 0; i < timbres.size(); i++)
+    {
+        std::vector<size_t> used;
+        for (auto &zone : timbres[i])
+        {
+            if (zone.sampleIndex < owners.size())
+                used.push_back(owners[zone.sampleIndex]);
+        }
+        std::sort(used.begin(), used.end());
+        used.erase(std::unique(used.begin(), used.end()), used.end());
+        size_t size = 0;
+        for (size_t index : used)
+            size += get_data_size(*prepared[index]);
+        printf("%6u %6u %8u %8u\n", (unsigned)i, (unsigned)timbres[i].size(), (unsigned)used.size(), (unsigned)size);
+    }
+}
+
+bool SampleBankWriter::Write(const char *path) const
+{
+    std::vector<uint8_t> data = Build();
+    FILE *file = fopen(path, "wb");
+    if (file == nullptr)
+    {
+        LOGE("SampleBank", "Failed to open %s", path);
+        return false;
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok)
+        LOGE("SampleBank", "Failed to write %s", path);
+    return ok;
+}
+
+}
+}
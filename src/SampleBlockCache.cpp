@@ -0,0 +1,87 @@
+#include "SampleBlockCache.h"
+
+#include "Sampler.h"
+#include "Utils.h"
+
+namespace capsule
+{
+namespace sampler
+{
+
+SampleBlockCache::~SampleBlockCache()
+{
+    if (memory != nullptr)
+        resource->Deallocate(memory, SAMPLE_BLOCK_CACHE_SIZE * LOSSLESS_BLOCK_SIZE * sizeof(int16_t), alignof(int16_t));
+}
+
+void SampleBlockCache::Init()
+{
+    if (memory != nullptr)
+        return;
+    memory = (int16_t *)resource->Allocate(SAMPLE_BLOCK_CACHE_SIZE * LOSSLESS_BLOCK_SIZE * sizeof(int16_t), alignof(int16_t));
+    if (memory == nullptr)
+        LOGE("SampleBlockCache", "Failed to allocate the block cache");
+}
+
+void SampleBlockCache::Clear()
+{
+    for (auto &entry : entries)
+        entry = Entry();
+}
+
+bool SampleBlockCache::Matches(const Entry &entry, const Sample &sample, uint32_t block)
+{
+    // アドレスが同じでも所有者(管理ブロック)が異なれば、解放されたデータの跡に確保された別のデータである
+    return entry.data == sample.encoded.get() && entry.block == block && !entry.owner.owner_before(sample.encoded) && !sample.encoded.owner_before(entry.owner);
+}
+
+const int16_t *SampleBlockCache::Get(const Sample &sample, uint32_t block, int16_t &hint)
+{
+    if (memory == nullptr)
+        return nullptr;
+    const uint8_t *data = sample.encoded.get();
+    clock++;
+
+    // 前回と同じブロックであれば検索しない
+    if (hint >= 0 && Matches(entries[hint], sample, block))
+    {
+        entries[hint].lastUsed = clock;
+        hitCount++;
+        return &memory[hint * LOSSLESS_BLOCK_SIZE];
+    }
+
+    // キャッシュを検索しつつ、見つからなかった場合に追い出すエントリーを探しておく
+    // 所有者が解放されたエントリーは再び参照されることがないので、最も古いエントリーより優先して追い出す
+    int16_t oldest = 0;
+    bool released = false;
+    for (int16_t i = 0; i < SAMPLE_BLOCK_CACHE_SIZE; i++)
+    {
+        Entry &entry = entries[i];
+        if (Matches(entry, sample, block))
+        {
+            entry.lastUsed = clock;
+            hint = i;
+            hitCount++;
+            return &memory[i * LOSSLESS_BLOCK_SIZE];
+        }
+        if (released)
+            continue;
+        if (entry.owned && entry.owner.expired())
+        {
+            oldest = i;
+            released = true;
+        }
+        else if (entry.lastUsed < entries[oldest].lastUsed)
+            oldest = i;
+    }
+
+    int16_t *decoded = &memory[oldest * LOSSLESS_BLOCK_SIZE];
+    DecodeLosslessBlock(data, sample.length, block, decoded);
+    entries[oldest] = Entry{data, sample.encoded, sample.encoded.use_count() > 0, block, clock};
+    hint = oldest;
+    decodeCount++;
+    return decoded;
+}
+
+}
+}
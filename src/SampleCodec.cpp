@@ -0,0 +1,404 @@
+#include "SampleCodec.h"
+
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include "Sampler.h"
+#include "Utils.h"
+
+namespace capsule
+{
+namespace sampler
+{
+
+static constexpr int16_t MULAW_BIAS = 0x84;
+static constexpr int16_t MULAW_CLIP = 32635;
+
+static constexpr int16_t decode_mulaw(uint8_t value)
+{
+    value = ~value;
+    int16_t magnitude = (((value & 0x0F) << 3) + MULAW_BIAS) << ((value >> 4) & 0x07);
+    return (value & 0x80) ? (MULAW_BIAS - magnitude) : (magnitude - MULAW_BIAS);
+}
+
+// μ-lawのデコード結果はテーブルを引くだけで求める
+struct mulaw_table_t
+{
+    int16_t values[256];
+    constexpr mulaw_table_t() : values{}
+    {
+        for (int i = 0; i < 256; i++)
+            values[i] = decode_mulaw(i);
+    }
+};
+static constexpr mulaw_table_t mulawTable;
+
+static uint8_t encode_mulaw(int16_t value)
+{
+    int32_t v = value;
+    uint8_t sign = 0;
+    if (v < 0)
+    {
+        v = -v;
+        sign = 0x80;
+    }
+    if (v > MULAW_CLIP)
+        v = MULAW_CLIP;
+    v += MULAW_BIAS;
+    uint8_t exponent = 7;
+    for (int32_t mask = 0x4000; (v & mask) == 0 && exponent > 0; mask >>= 1)
+        exponent--;
+    uint8_t mantissa = (v >> (exponent + 3)) & 0x0F;
+    return ~(sign | (exponent << 4) | mantissa);
+}
+
+static constexpr int16_t adpcmStepTable[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+    19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+    130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+    876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+    5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
+static constexpr int8_t adpcmIndexTable[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8,
+    -1, -1, -1, -1, 2, 4, 6, 8};
+
+// 4bitの符号をひとつデコードしてstateを更新し、デコードしたサンプルを返す
+static inline int16_t decode_adpcm_nibble(uint8_t nibble, AdpcmState &state)
+{
+    int32_t step = adpcmStepTable[state.stepIndex];
+    int32_t diff = step >> 3;
+    if (nibble & 4) diff += step;
+    if (nibble & 2) diff += step >> 1;
+    if (nibble & 1) diff += step >> 2;
+    int32_t predictor = state.predictor + ((nibble & 8) ? -diff : diff);
+    if (predictor > 32767) predictor = 32767;
+    else if (predictor < -32768) predictor = -32768;
+    int32_t index = state.stepIndex + adpcmIndexTable[nibble];
+    if (index < 0) index = 0;
+    else if (index > 88) index = 88;
+    state.predictor = predictor;
+    state.stepIndex = index;
+    return predictor;
+}
+
+static uint8_t encode_adpcm_nibble(int16_t value, AdpcmState &state)
+{
+    int32_t step = adpcmStepTable[state.stepIndex];
+    int32_t diff = value - state.predictor;
+    uint8_t nibble = 0;
+    if (diff < 0)
+    {
+        nibble = 8;
+        diff = -diff;
+    }
+    if (diff >= step) { nibble |= 4; diff -= step; }
+    step >>= 1;
+    if (diff >= step) { nibble |= 2; diff -= step; }
+    step >>= 1;
+    if (diff >= step) nibble |= 1;
+    // デコーダーと同じ計算で状態を更新する
+    decode_adpcm_nibble(nibble, state);
+    return nibble;
+}
+
+// ロスレス形式
+// [ブロック数 uint32][各ブロックの開始位置 uint32 × (ブロック数+1)][ブロック...]
+// 各ブロックは [予測次数 uint8][Rice符号のパラメーター uint8][先頭サンプル int16 × 予測次数][残差のRice符号(MSBから詰める)]
+// 開始位置はデータ先頭からのバイト数で、最後の要素はデータ全体のバイト数を表す
+// 多バイトの値はリトルエンディアンで格納し、アラインされていない位置からも読めるようにする
+static constexpr uint8_t LOSSLESS_MAX_ORDER = 2;
+static constexpr uint32_t LOSSLESS_ESCAPE = 24;    // この数以上の商は符号化せずに生の値を書き込む
+static constexpr uint32_t LOSSLESS_RAW_BITS = 20;  // 生の値のビット数 (2次予測の残差が収まる)
+
+static inline uint32_t read_u32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+static inline void write_u32(std::vector<uint8_t> &out, uint32_t offset, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        out[offset + i] = value >> (i * 8);
+}
+
+// 予測次数orderでi番目のサンプルを予測した時の残差
+static inline int32_t lossless_residual(const int16_t *x, uint32_t i, uint8_t order)
+{
+    switch (order)
+    {
+    case 0: return x[i];
+    case 1: return x[i] - x[i - 1];
+    default: return x[i] - 2 * x[i - 1] + x[i - 2];
+    }
+}
+
+// 残差の符号を折り返して非負の整数にする
+static inline uint32_t zigzag(int32_t v) { return v >= 0 ? (uint32_t)v << 1 : ((uint32_t)(-v) << 1) - 1; }
+static inline int32_t unzigzag(uint32_t u) { return (int32_t)(u >> 1) ^ -(int32_t)(u & 1); }
+
+static inline uint32_t rice_bits(uint32_t u, uint8_t k)
+{
+    uint32_t q = u >> k;
+    return q < LOSSLESS_ESCAPE ? q + 1 + k : LOSSLESS_ESCAPE + LOSSLESS_RAW_BITS;
+}
+
+static void encode_lossless_block(const int16_t *x, uint32_t n, std::vector<uint8_t> &out)
+{
+    // 最も短くなる予測次数とパラメーターの組み合わせを総当たりで探す
+    uint8_t bestOrder = 0, bestK = 0;
+    uint32_t bestBits = UINT32_MAX;
+    for (uint8_t order = 0; order <= LOSSLESS_MAX_ORDER && order <= n; order++)
+    {
+        for (uint8_t k = 0; k < 16; k++)
+        {
+            uint32_t bits = order * 16;
+            for (uint32_t i = order; i < n && bits < bestBits; i++)
+                bits += rice_bits(zigzag(lossless_residual(x, i, order)), k);
+            if (bits < bestBits)
+            {
+                bestBits = bits;
+                bestOrder = order;
+                bestK = k;
+            }
+        }
+    }
+
+    out.push_back(bestOrder);
+    out.push_back(bestK);
+    for (uint8_t i = 0; i < bestOrder; i++)
+    {
+        out.push_back(x[i] & 0xFF);
+        out.push_back((x[i] >> 8) & 0xFF);
+    }
+    uint64_t acc = 0;
+    uint32_t accBits = 0;
+    auto put = [&](uint32_t value, uint32_t bits) {
+        acc = (acc << bits) | (value & ((1ull << bits) - 1));
+        accBits += bits;
+        while (accBits >= 8)
+        {
+            accBits -= 8;
+            out.push_back(acc >> accBits);
+        }
+    };
+    for (uint32_t i = bestOrder; i < n; i++)
+    {
+        uint32_t u = zigzag(lossless_residual(x, i, bestOrder));
+        uint32_t q = u >> bestK;
+        if (q < LOSSLESS_ESCAPE)
+        {
+            // 商をq個の1と終端の0で表し、余りをkビットで書き込む
+            for (; q >= 16; q -= 16)
+                put(0xFFFF, 16);
+            put(((1u << q) - 1) << 1, q + 1);
+            put(u, bestK);
+        }
+        else
+        {
+            put(0xFFFFFF, LOSSLESS_ESCAPE);
+            put(u, LOSSLESS_RAW_BITS);
+        }
+    }
+    if (accBits > 0)
+        out.push_back(acc << (8 - accBits));
+}
+
+void DecodeLosslessBlock(const uint8_t *data, uint32_t length, uint32_t block, int16_t *dst)
+{
+    const uint8_t *p = &data[read_u32(&data[4 + block * 4])];
+    uint32_t n = length - block * LOSSLESS_BLOCK_SIZE;
+    if (n > LOSSLESS_BLOCK_SIZE) n = LOSSLESS_BLOCK_SIZE;
+    uint8_t order = p[0];
+    uint8_t k = p[1];
+    p += 2;
+    for (uint8_t i = 0; i < order; i++, p += 2)
+        dst[i] = (int16_t)(p[0] | (p[1] << 8));
+
+    // 64bitのバッファに先読みしながらビット単位で読み出す
+    uint64_t acc = 0;
+    int32_t accBits = 0;
+    auto refill = [&]() {
+        while (accBits <= 56)
+        {
+            acc |= (uint64_t)*p++ << (56 - accBits);
+            accBits += 8;
+        }
+    };
+    auto take = [&](uint32_t bits) -> uint32_t {
+        if (bits == 0) return 0;
+        uint32_t value = acc >> (64 - bits);
+        acc <<= bits;
+        accBits -= bits;
+        return value;
+    };
+    for (uint32_t i = order; i < n; i++)
+    {
+        refill();
+        // 先頭から連続する1の数が商になる
+        uint64_t inverted = ~acc;
+        uint32_t q = inverted == 0 ? 64 : __builtin_clzll(inverted);
+        uint32_t u;
+        if (q < LOSSLESS_ESCAPE)
+        {
+            take(q + 1);
+            u = (q << k) | take(k);
+        }
+        else
+        {
+            take(LOSSLESS_ESCAPE);
+            refill();
+            u = take(LOSSLESS_RAW_BITS);
+        }
+        int32_t e = unzigzag(u);
+        switch (order)
+        {
+        case 0: dst[i] = e; break;
+        case 1: dst[i] = dst[i - 1] + e; break;
+        default: dst[i] = 2 * dst[i - 1] - dst[i - 2] + e; break;
+        }
+    }
+}
+
+uint32_t GetLosslessSize(const uint8_t *data)
+{
+    return read_u32(&data[4 + read_u32(data) * 4]);
+}
+
+bool ValidateLosslessData(const uint8_t *data, uint32_t size, uint32_t length)
+{
+    // デコーダーは読み終えた位置から最大8バイト先まで先読みするので、最後のブロックはその分だけ手前で終わっていなければならない
+    uint32_t blockCount = (length + LOSSLESS_BLOCK_SIZE - 1) / LOSSLESS_BLOCK_SIZE;
+    uint64_t indexSize = ((uint64_t)blockCount + 2) * 4;
+    if (size < 8 || indexSize > size - 8 || read_u32(data) != blockCount)
+        return false;
+    uint32_t end = size - 8;
+    for (uint32_t block = 0; block < blockCount; block++)
+    {
+        uint32_t start = read_u32(&data[4 + block * 4]);
+        uint32_t next = read_u32(&data[8 + block * 4]);
+        if (start < indexSize || next > end || next < start || next - start < 2)
+            return false;
+        uint32_t n = std::min<uint32_t>(length - block * LOSSLESS_BLOCK_SIZE, LOSSLESS_BLOCK_SIZE);
+        uint8_t order = data[start];
+        uint8_t k = data[start + 1];
+        if (order > LOSSLESS_MAX_ORDER || order > n || k >= 16)
+            return false;
+
+        // デコーダーと同じ規則で各残差のビット数を数え、ブロックの終わりを超えないことを確かめる
+        uint64_t pos = ((uint64_t)start + 2 + order * 2) * 8;
+        uint64_t limit = (uint64_t)next * 8;
+        for (uint32_t i = order; i < n; i++)
+        {
+            uint32_t q = 0;
+            while (q < LOSSLESS_ESCAPE && pos + q < limit && (data[(pos + q) >> 3] >> (7 - ((pos + q) & 7)) & 1))
+                q++;
+            pos += q < LOSSLESS_ESCAPE ? q + 1 + k : LOSSLESS_ESCAPE + LOSSLESS_RAW_BITS;
+            if (pos > limit)
+                return false;
+        }
+    }
+    return true;
+}
+
+uint32_t GetEncodedSize(SampleFormat format, uint32_t count)
+{
+    switch (format)
+    {
+    case SampleFormat::MULAW:
+        return count;
+    case SampleFormat::ADPCM:
+        return (count + 1) >> 1;
+    case SampleFormat::LOSSLESS:
+        return 0;
+    default:
+        return count * sizeof(int16_t);
+    }
+}
+
+void DecodeMulaw(const uint8_t *data, uint32_t pos, uint32_t count, int16_t *dst)
+{
+    const uint8_t *src = &data[pos];
+    for (uint32_t i = 0; i < count; i++)
+        dst[i] = mulawTable.values[src[i]];
+}
+
+void DecodeAdpcm(const uint8_t *data, uint32_t pos, uint32_t count, AdpcmState &state, int16_t *dst)
+{
+    const uint8_t *src = &data[pos >> 1];
+    // 奇数番目から始まる場合は上位4bitから読む
+    if ((pos & 1) && count > 0)
+    {
+        *dst++ = decode_adpcm_nibble(*src++ >> 4, state);
+        count--;
+    }
+    for (; count >= 2; count -= 2)
+    {
+        uint8_t byte = *src++;
+        *dst++ = decode_adpcm_nibble(byte & 0x0F, state);
+        *dst++ = decode_adpcm_nibble(byte >> 4, state);
+    }
+    if (count > 0)
+        *dst = decode_adpcm_nibble(*src & 0x0F, state);
+}
+
+std::shared_ptr<Sample> EncodeSample(const Sample &sample, SampleFormat format)
+{
+    if (!sample.IsDirect() || format == SampleFormat::PCM16)
+    {
+        LOGE("SampleCodec", "Only 16-bit linear PCM samples can be encoded");
+        return nullptr;
+    }
+    const int16_t *src = sample.sample.get();
+    if (format == SampleFormat::LOSSLESS)
+    {
+        uint32_t blockCount = (sample.length + LOSSLESS_BLOCK_SIZE - 1) / LOSSLESS_BLOCK_SIZE;
+        std::vector<uint8_t> out((blockCount + 2) * 4);
+        write_u32(out, 0, blockCount);
+        for (uint32_t block = 0; block < blockCount; block++)
+        {
+            write_u32(out, 4 + block * 4, out.size());
+            uint32_t start = block * LOSSLESS_BLOCK_SIZE;
+            encode_lossless_block(&src[start], std::min<uint32_t>(LOSSLESS_BLOCK_SIZE, sample.length - start), out);
+        }
+        write_u32(out, 4 + blockCount * 4, out.size());
+        // ビットの先読みでデータ末尾を超えて読まれることがあるため余白を設けておく
+        out.resize(out.size() + 8);
+        uint8_t *encoded = new uint8_t[out.size()];
+        memcpy(encoded, out.data(), out.size());
+        auto result = std::make_shared<Sample>(format, std::shared_ptr<const uint8_t>(encoded, std::default_delete<uint8_t[]>()), sample.length, sample.root, sample.loopStart, sample.loopEnd, sample.adsrEnabled, sample.attack, sample.decay, sample.sustain, sample.release);
+        result->tune = sample.tune;
+        result->sampleRate = sample.sampleRate;
+        return result;
+    }
+    uint32_t size = GetEncodedSize(format, sample.length);
+    uint8_t *encoded = new uint8_t[size]();
+    AdpcmState start = {0, 0};
+    AdpcmState loop = start;
+    if (format == SampleFormat::MULAW)
+    {
+        for (uint32_t i = 0; i < sample.length; i++)
+            encoded[i] = encode_mulaw(src[i]);
+    }
+    else
+    {
+        AdpcmState state = start;
+        for (uint32_t i = 0; i < sample.length; i++)
+        {
+            // ループ後はloopStartの直前の状態からデコードを再開できるように記録しておく
+            if (i == sample.loopStart)
+                loop = state;
+            uint8_t nibble = encode_adpcm_nibble(src[i], state);
+            encoded[i >> 1] |= (i & 1) ? nibble << 4 : nibble;
+        }
+    }
+    auto result = std::make_shared<Sample>(format, std::shared_ptr<const uint8_t>(encoded, std::default_delete<uint8_t[]>()), sample.length, sample.root, sample.loopStart, sample.loopEnd, sample.adsrEnabled, sample.attack, sample.decay, sample.sustain, sample.release, start, loop);
+    result->tune = sample.tune;
+    result->sampleRate = sample.sampleRate;
+    return result;
+}
+
+}
+}
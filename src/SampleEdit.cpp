@@ -0,0 +1,84 @@
+#include "SampleEdit.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "Utils.h"
+
+#if !defined(M_PI)
+#define M_PI 3.14159265359
+#endif
+
+namespace capsule
+{
+namespace sampler
+{
+
+static bool is_looping(const Sample &sample)
+{
+    return sample.adsrEnabled && sample.loopStart != sample.loopEnd;
+}
+
+// 波形データをdataに置き換え、その他のパラメーターを引き継いだサンプルを作成する
+static std::shared_ptr<Sample> create_edited_sample(const Sample &sample, std::shared_ptr<const int16_t> data, uint32_t length)
+{
+    auto result = std::make_shared<Sample>(std::move(data), length, sample.root, sample.loopStart, sample.loopEnd, sample.adsrEnabled, sample.attack, sample.decay, sample.sustain, sample.release);
+    result->tune = sample.tune;
+    result->sampleRate = sample.sampleRate;
+    return result;
+}
+
+static std::shared_ptr<Sample> create_edited_sample(const Sample &sample, int16_t *data, uint32_t length)
+{
+    return create_edited_sample(sample, std::shared_ptr<const int16_t>(data, std::default_delete<int16_t[]>()), length);
+}
+
+std::shared_ptr<Sample> BakeLoopCrossfade(const Sample &sample, uint32_t fadeLength)
+{
+    if (!sample.IsDirect() || !sample.sample)
+    {
+        LOGE("SampleEdit", "Only 16-bit linear PCM samples can be edited");
+        return nullptr;
+    }
+    const int16_t *src = sample.sample.get();
+    uint32_t guardLength = GetSampleGuardLength(sample);
+    uint32_t length = std::max(sample.length, sample.loopEnd + guardLength);
+    int16_t *dst = new int16_t[length + guardLength]();
+    memcpy(dst, src, sample.length * sizeof(int16_t));
+    if (!is_looping(sample))
+        return create_edited_sample(sample, dst, sample.length);
+
+    uint32_t loopLength = sample.loopEnd - sample.loopStart;
+    fadeLength = std::min({fadeLength, loopLength, sample.loopStart});
+    // ループ末尾を、loopStartの直前fadeLengthサンプルの波形に近づけていく
+    // 終わりではloopStartの直前の波形と一致するので、loopStartにそのままつながる
+    uint32_t fadeStart = sample.loopEnd - fadeLength;
+    for (uint32_t i = 0; i < fadeLength; i++)
+    {
+        double t = (i + 0.5) / fadeLength * M_PI / 2;
+        double mixed = src[fadeStart + i] * cos(t) + src[sample.loopStart - fadeLength + i] * sin(t);
+        dst[fadeStart + i] = (int16_t)std::min(std::max(lrint(mixed), -32768L), 32767L);
+    }
+    // loopEndの後ろは折り返し後の波形にしておく (折り返す直前の補間で読まれる)
+    for (uint32_t i = 0; i < guardLength; i++)
+        dst[sample.loopEnd + i] = dst[sample.loopStart + i % loopLength];
+    return create_edited_sample(sample, dst, sample.length);
+}
+
+std::shared_ptr<Sample> TrimAfterLoop(const Sample &sample, uint32_t guardLength)
+{
+    if (!sample.IsDirect() || !sample.sample)
+    {
+        LOGE("SampleEdit", "Only 16-bit linear PCM samples can be edited");
+        return nullptr;
+    }
+    if (guardLength == 0)
+        guardLength = GetSampleGuardLength(sample);
+    uint32_t length = sample.length;
+    if (is_looping(sample) && sample.loopEnd < length && length - sample.loopEnd > guardLength)
+        length = sample.loopEnd + guardLength;
+    return create_edited_sample(sample, sample.sample, length);
+}
+
+}
+}
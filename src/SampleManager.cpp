@@ -0,0 +1,335 @@
+#include "SampleManager.h"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include "Sampler.h"
+#include "Utils.h"
+
+#if defined(FREERTOS)
+#include <freertos/semphr.h>
+#endif
+#if !defined(ESP_PLATFORM)
+#include <chrono>
+#endif
+
+// 管理スレッドが本体の読み込みで一度に読み込むサンプル数
+// 読み込み中はストリーミング再生の読み込みを待たせるため、あまり大きくしないこと
+#ifndef SAMPLE_MANAGER_CHUNK_SIZE
+#define SAMPLE_MANAGER_CHUNK_SIZE 4096
+#endif
+
+namespace capsule
+{
+namespace sampler
+{
+
+struct SampleManager::Core
+{
+    std::atomic<size_t> budget;
+    std::atomic<size_t> resident{0};
+    std::atomic<uint32_t> clock{0}; // 最後に使われた順序を決めるためのカウンター
+    std::atomic<uint32_t> loadCount{0};
+    std::atomic<uint32_t> evictionCount{0};
+    std::mutex sourcesMutex;
+    std::vector<std::weak_ptr<ManagedSource>> sources;
+    MemoryResource *resource; // 本体の確保先
+
+    Core(size_t budget, MemoryResource *resource) : budget{budget}, resource{resource} {}
+};
+
+// 本体が読み込まれていればメモリから、そうでなければ元のsourceから読み込むStreamSource
+class SampleManager::ManagedSource : public StreamSource
+{
+public:
+    enum State : uint8_t
+    {
+        UNLOADED,
+        LOADED,
+    };
+
+    std::shared_ptr<Core> core;
+    std::shared_ptr<StreamSource> source;
+    uint32_t length;
+    uint32_t headLength;
+    int16_t *body = nullptr; // [headLength, length)の波形データ
+    std::atomic<uint8_t> state{UNLOADED};
+    std::atomic<uint16_t> pins{0};    // 再生中のボイスの数
+    std::atomic<uint16_t> readers{0}; // bodyを読み出し中のスレッドの数
+    std::atomic<uint32_t> lastUsed{0};
+    std::atomic<bool> requested{false}; // 発音されたが本体がまだ読み込まれていない
+
+    ManagedSource(std::shared_ptr<Core> core, std::shared_ptr<StreamSource> source, uint32_t length, uint32_t headLength)
+        : core{std::move(core)}, source{std::move(source)}, length{length}, headLength{std::min(headLength, length)}
+    {
+#if defined(FREERTOS)
+        mutex = xSemaphoreCreateMutex();
+#endif
+    }
+
+    ~ManagedSource()
+    {
+        if (body != nullptr)
+        {
+            core->resource->Deallocate(body, GetBodySize(), alignof(int16_t));
+            core->resident.fetch_sub(GetBodySize());
+        }
+#if defined(FREERTOS)
+        vSemaphoreDelete(mutex);
+#endif
+    }
+
+    size_t GetBodySize() const { return (size_t)(length - headLength) * sizeof(int16_t); }
+
+    void Acquire() override
+    {
+        pins.fetch_add(1);
+        lastUsed.store(core->clock.fetch_add(1, std::memory_order_relaxed), std::memory_order_relaxed);
+        if (state.load(std::memory_order_relaxed) == UNLOADED)
+            requested.store(true, std::memory_order_relaxed);
+    }
+
+    void Release() override
+    {
+        pins.fetch_sub(1);
+    }
+
+    uint32_t Read(uint32_t offset, int16_t *dst, uint32_t count) override
+    {
+        readers.fetch_add(1);
+        if (state.load() == LOADED && offset >= headLength)
+        {
+            count = std::min(count, length - std::min(offset, length));
+            memcpy(dst, &body[offset - headLength], count * sizeof(int16_t));
+            readers.fetch_sub(1);
+            return count;
+        }
+        readers.fetch_sub(1);
+        return ReadSource(offset, dst, count);
+    }
+
+    // 元のsourceから読み込む (管理スレッドとストリーミングのローダーの両方から呼ばれる)
+    uint32_t ReadSource(uint32_t offset, int16_t *dst, uint32_t count)
+    {
+#if defined(FREERTOS)
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        uint32_t read = source->Read(offset, dst, count);
+        xSemaphoreGive(mutex);
+        return read;
+#else
+        std::lock_guard<std::mutex> lock(mutex);
+        return source->Read(offset, dst, count);
+#endif
+    }
+
+private:
+#if defined(FREERTOS)
+    SemaphoreHandle_t mutex;
+#else
+    std::mutex mutex;
+#endif
+};
+
+SampleManager::SampleManager(size_t budget, MemoryResource *resource) : core{std::make_shared<Core>(budget, resource)}
+{
+    running.store(true);
+#if defined(FREERTOS)
+    xTaskCreate(TaskEntry, "SampleManager", 4096, this, 4, &task);
+#else
+    thread = std::thread([this]() { Run(); });
+#endif
+}
+
+SampleManager::~SampleManager()
+{
+    running.store(false);
+#if defined(FREERTOS)
+    while (!taskFinished.load())
+        vTaskDelay(1);
+#else
+    wakeCondition.notify_one();
+    thread.join();
+#endif
+}
+
+#if defined(FREERTOS)
+void SampleManager::TaskEntry(void *arg)
+{
+    SampleManager *manager = static_cast<SampleManager *>(arg);
+    manager->Run();
+    manager->taskFinished.store(true);
+    vTaskDelete(NULL);
+}
+#endif
+
+std::shared_ptr<Sample> SampleManager::AddSample(std::shared_ptr<StreamSource> source, uint32_t length, uint32_t headLength, uint8_t root, uint32_t loopStart, uint32_t loopEnd, bool adsrEnabled, float attack, float decay, float sustain, float release)
+{
+    auto managed = std::make_shared<ManagedSource>(core, std::move(source), length, headLength);
+    {
+        std::lock_guard<std::mutex> lock(core->sourcesMutex);
+        core->sources.push_back(managed);
+    }
+    return CreateStreamingSample(managed, length, headLength, root, loopStart, loopEnd, adsrEnabled, attack, decay, sustain, release);
+}
+
+void SampleManager::SetBudget(size_t budget)
+{
+    core->budget.store(budget);
+#if !defined(FREERTOS)
+    wakeCondition.notify_one();
+#endif
+}
+
+size_t SampleManager::GetBudget() const
+{
+    return core->budget.load();
+}
+
+size_t SampleManager::GetResidentSize() const
+{
+    return core->resident.load();
+}
+
+uint32_t SampleManager::GetLoadCount() const
+{
+    return core->loadCount.load();
+}
+
+uint32_t SampleManager::GetEvictionCount() const
+{
+    return core->evictionCount.load();
+}
+
+void SampleManager::Run()
+{
+    std::vector<std::shared_ptr<ManagedSource>> sources;
+    while (running.load())
+    {
+        // 破棄されたサンプルを取り除きつつ、管理しているサンプルの一覧を取得する
+        sources.clear();
+        {
+            std::lock_guard<std::mutex> lock(core->sourcesMutex);
+            auto &list = core->sources;
+            list.erase(std::remove_if(list.begin(), list.end(), [&sources](const std::weak_ptr<ManagedSource> &weak) {
+                           auto source = weak.lock();
+                           if (!source)
+                               return true;
+                           sources.push_back(std::move(source));
+                           return false;
+                       }),
+                       list.end());
+        }
+
+        // 発音されたサンプルの本体を、最近使われたものから順に読み込む
+        std::vector<ManagedSource *> requested;
+        for (auto &source : sources)
+        {
+            if (source->requested.exchange(false, std::memory_order_relaxed) && source->state.load() == ManagedSource::UNLOADED)
+                requested.push_back(source.get());
+        }
+        std::sort(requested.begin(), requested.end(), [](const ManagedSource *a, const ManagedSource *b) {
+            return (int32_t)(a->lastUsed.load(std::memory_order_relaxed) - b->lastUsed.load(std::memory_order_relaxed)) > 0;
+        });
+        for (auto *source : requested)
+        {
+            if (!running.load())
+                break;
+            Load(sources, *source);
+        }
+
+        // バジェットが減らされた場合などに超過分を解放する
+        MakeRoom(sources, 0, nullptr);
+        sources.clear();
+
+#if defined(FREERTOS)
+        vTaskDelay(pdMS_TO_TICKS(10));
+#else
+        std::unique_lock<std::mutex> lock(wakeMutex);
+        wakeCondition.wait_for(lock, std::chrono::milliseconds(10));
+#endif
+    }
+}
+
+bool SampleManager::Load(const std::vector<std::shared_ptr<ManagedSource>> &sources, ManagedSource &source)
+{
+    size_t size = source.GetBodySize();
+    if (size == 0 || size > core->budget.load())
+        return false;
+    if (!MakeRoom(sources, size, &source))
+        return false;
+
+    int16_t *body = (int16_t *)core->resource->Allocate(size, alignof(int16_t));
+    if (body == nullptr)
+    {
+        LOGE("SampleManager", "Failed to allocate %u bytes", (unsigned)size);
+        return false;
+    }
+    uint32_t count = source.length - source.headLength;
+    for (uint32_t pos = 0; pos < count;)
+    {
+        uint32_t n = std::min((uint32_t)SAMPLE_MANAGER_CHUNK_SIZE, count - pos);
+        uint32_t read = source.ReadSource(source.headLength + pos, &body[pos], n);
+        if (read == 0)
+        {
+            LOGE("SampleManager", "Failed to read a sample body (%u/%u)", (unsigned)pos, (unsigned)count);
+            core->resource->Deallocate(body, size, alignof(int16_t));
+            return false;
+        }
+        pos += read;
+    }
+    source.body = body;
+    source.state.store(ManagedSource::LOADED);
+    core->resident.fetch_add(size);
+    core->loadCount.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void SampleManager::Evict(ManagedSource &source)
+{
+    uint8_t expected = ManagedSource::LOADED;
+    if (!source.state.compare_exchange_strong(expected, ManagedSource::UNLOADED))
+        return;
+    // 状態を変える前に読み出しを始めたローダーが終わるのを待つ
+    while (source.readers.load() != 0)
+    {
+#if defined(FREERTOS)
+        vTaskDelay(1);
+#else
+        std::this_thread::yield();
+#endif
+    }
+    core->resource->Deallocate(source.body, source.GetBodySize(), alignof(int16_t));
+    source.body = nullptr;
+    core->resident.fetch_sub(source.GetBodySize());
+    core->evictionCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool SampleManager::MakeRoom(const std::vector<std::shared_ptr<ManagedSource>> &sources, size_t required, const ManagedSource *exclude)
+{
+    size_t budget = core->budget.load();
+    while (core->resident.load() + required > budget)
+    {
+        // 再生中でないもののうち、最も長く使われていないものを探す
+        ManagedSource *victim = nullptr;
+        uint32_t now = core->clock.load(std::memory_order_relaxed);
+        uint32_t oldest = 0;
+        for (auto &source : sources)
+        {
+            if (source.get() == exclude || source->state.load() != ManagedSource::LOADED || source->pins.load() != 0)
+                continue;
+            uint32_t age = now - source->lastUsed.load(std::memory_order_relaxed);
+            if (victim == nullptr || age > oldest)
+            {
+                victim = source.get();
+                oldest = age;
+            }
+        }
+        if (victim == nullptr)
+            return false;
+        Evict(*victim);
+    }
+    return true;
+}
+
+}
+}
@@ -0,0 +1,305 @@
+#include "SampleStream.h"
+
+#include <algorithm>
+#include <cstring>
+#include "Sampler.h"
+#include "Utils.h"
+
+#if !defined(ESP_PLATFORM)
+#include <chrono>
+#endif
+
+namespace capsule
+{
+namespace sampler
+{
+
+FileStreamSource::FileStreamSource(const char *path, uint32_t dataOffset) : dataOffset{dataOffset}
+{
+    file = fopen(path, "rb");
+    if (file == nullptr)
+        LOGE("SampleStream", "Failed to open %s", path);
+}
+
+FileStreamSource::~FileStreamSource()
+{
+    if (file != nullptr)
+        fclose(file);
+}
+
+uint32_t FileStreamSource::Read(uint32_t offset, int16_t *dst, uint32_t count)
+{
+    if (file == nullptr)
+        return 0;
+    if (fseek(file, dataOffset + offset * sizeof(int16_t), SEEK_SET) != 0)
+        return 0;
+    return fread(dst, sizeof(int16_t), count, file);
+}
+
+#if defined(ESP_PLATFORM)
+uint32_t PartitionStreamSource::Read(uint32_t offset, int16_t *dst, uint32_t count)
+{
+    size_t start = dataOffset + offset * sizeof(int16_t);
+    if (start >= partition->size)
+        return 0;
+    // パーティションの終端を超えないようにする
+    size_t available = (partition->size - start) / sizeof(int16_t);
+    if (count > available)
+        count = available;
+    if (esp_partition_read(partition, start, dst, count * sizeof(int16_t)) != ESP_OK)
+        return 0;
+    return count;
+}
+#endif
+
+std::shared_ptr<Sample> CreateStreamingSample(std::shared_ptr<StreamSource> source, uint32_t length, uint32_t headLength, uint8_t root, uint32_t loopStart, uint32_t loopEnd, bool adsrEnabled, float attack, float decay, float sustain, float release)
+{
+    if (headLength > length)
+        headLength = length;
+    int16_t *head = new int16_t[headLength];
+    uint32_t read = source->Read(0, head, headLength);
+    if (read < headLength)
+    {
+        LOGE("SampleStream", "Failed to read the head of a streaming sample (%u/%u)", (unsigned)read, (unsigned)headLength);
+        memset(&head[read], 0, (headLength - read) * sizeof(int16_t));
+    }
+    return std::make_shared<Sample>(std::shared_ptr<const int16_t>(head, std::default_delete<int16_t[]>()), headLength, std::move(source), length, root, loopStart, loopEnd, adsrEnabled, attack, decay, sustain, release);
+}
+
+SampleStreamer::~SampleStreamer()
+{
+    Stop();
+    for (auto &slot : slots)
+    {
+        if (slot.state.load() != FREE)
+            slot.sample->stream->Release();
+        slot.sample.reset();
+    }
+    if (memory != nullptr)
+        resource->Deallocate(memory, STREAM_SLOT_COUNT * RING_SIZE * sizeof(int16_t), alignof(int16_t));
+}
+
+void SampleStreamer::Start()
+{
+    if (running.load())
+        return;
+    if (memory == nullptr)
+    {
+        size_t size = STREAM_SLOT_COUNT * RING_SIZE * sizeof(int16_t);
+        memory = (int16_t *)resource->Allocate(size, alignof(int16_t));
+        if (memory == nullptr)
+        {
+            LOGE("SampleStream", "Failed to allocate ring buffers");
+            return;
+        }
+        for (uint_fast8_t i = 0; i < STREAM_SLOT_COUNT; i++)
+            slots[i].ring = &memory[i * RING_SIZE];
+    }
+    running.store(true);
+#if defined(FREERTOS)
+    taskFinished.store(false);
+    xTaskCreate(TaskEntry, "SampleStreamer", 4096, this, 5, &task);
+#else
+    thread = std::thread([this]() { Run(); });
+#endif
+}
+
+void SampleStreamer::Stop()
+{
+    if (!running.exchange(false))
+        return;
+    Wake();
+#if defined(FREERTOS)
+    while (!taskFinished.load())
+        vTaskDelay(1);
+    task = NULL;
+#else
+    thread.join();
+#endif
+}
+
+#if defined(FREERTOS)
+void SampleStreamer::TaskEntry(void *arg)
+{
+    SampleStreamer *streamer = static_cast<SampleStreamer *>(arg);
+    streamer->Run();
+    streamer->taskFinished.store(true);
+    vTaskDelete(NULL);
+}
+#endif
+
+void SampleStreamer::Wake()
+{
+#if defined(FREERTOS)
+    if (task != NULL)
+        xTaskNotifyGive(task);
+#else
+    wakeCondition.notify_one();
+#endif
+}
+
+int8_t SampleStreamer::Open(const std::shared_ptr<const Sample> &sample)
+{
+    if (!running.load(std::memory_order_relaxed))
+        return -1;
+    for (uint_fast8_t i = 0; i < STREAM_SLOT_COUNT; i++)
+    {
+        Slot &slot = slots[i];
+        if (slot.state.load(std::memory_order_acquire) != FREE)
+            continue;
+        slot.sample = sample;
+        sample->stream->Acquire();
+        slot.written.store(0, std::memory_order_relaxed);
+        slot.consumed.store(0, std::memory_order_relaxed);
+        slot.fetchPos = sample->headLength;
+        slot.state.store(ACTIVE, std::memory_order_release);
+        Wake();
+        return i;
+    }
+    return -1;
+}
+
+void SampleStreamer::Close(int8_t slot)
+{
+    if (slot < 0)
+        return;
+    // 参照の解放はローダースレッドで行う
+    slots[slot].state.store(CLOSING, std::memory_order_release);
+}
+
+uint32_t SampleStreamer::Consume(int8_t index, int16_t *dst, uint32_t count)
+{
+    if (index < 0)
+    {
+        memset(dst, 0, count * sizeof(int16_t));
+        return 0;
+    }
+    Slot &slot = slots[index];
+    uint32_t consumed = slot.consumed.load(std::memory_order_relaxed);
+    uint32_t written = slot.written.load(std::memory_order_acquire);
+    uint32_t available = (int32_t)(written - consumed) > 0 ? written - consumed : 0;
+    uint32_t n = std::min(available, count);
+
+    // リングバッファの終端をまたぐ場合は2回に分けてコピーする
+    uint32_t index0 = consumed % RING_SIZE;
+    uint32_t first = std::min(n, RING_SIZE - index0);
+    memcpy(dst, &slot.ring[index0], first * sizeof(int16_t));
+    memcpy(&dst[first], slot.ring, (n - first) * sizeof(int16_t));
+    if (n < count)
+    {
+        // 先読みが間に合わなかった部分は無音にする (ローダーは次回この分を読み飛ばす)
+        memset(&dst[n], 0, (count - n) * sizeof(int16_t));
+        underrunCount.fetch_add(1, std::memory_order_relaxed);
+    }
+    slot.consumed.store(consumed + count, std::memory_order_release);
+    return n;
+}
+
+// ストリーム上の位置posをcountサンプル進める
+static void advance_stream_position(const Sample &sample, uint32_t &pos, uint32_t count)
+{
+    bool looping = sample.adsrEnabled && sample.loopStart != sample.loopEnd;
+    if (!looping)
+    {
+        pos += count;
+        return;
+    }
+    // ループ後はヘッド以降の部分のみをストリームから読み込む
+    uint32_t loopHead = std::max(sample.loopStart, sample.headLength);
+    if (pos + count < sample.loopEnd)
+    {
+        pos += count;
+        return;
+    }
+    count -= sample.loopEnd - pos;
+    pos = loopHead + count % (sample.loopEnd - loopHead);
+}
+
+bool SampleStreamer::Fill(Slot &slot)
+{
+    const Sample &sample = *slot.sample;
+    bool looping = sample.adsrEnabled && sample.loopStart != sample.loopEnd;
+    // ループ区間がヘッドに収まっている場合はストリームを使用しない
+    if (looping && sample.loopEnd <= sample.headLength)
+        return false;
+    uint32_t end = sample.adsrEnabled ? sample.loopEnd : sample.length;
+    uint32_t loopHead = std::max(sample.loopStart, sample.headLength);
+
+    uint32_t written = slot.written.load(std::memory_order_relaxed);
+    uint32_t consumed = slot.consumed.load(std::memory_order_acquire);
+    if ((int32_t)(consumed - written) > 0)
+    {
+        // ボイスが先読みを追い越した分は読み飛ばす
+        advance_stream_position(sample, slot.fetchPos, consumed - written);
+        written = consumed;
+        slot.written.store(written, std::memory_order_release);
+    }
+
+    bool progressed = false;
+    while (written - consumed + STREAM_BLOCK_SIZE <= RING_SIZE)
+    {
+        if (slot.state.load(std::memory_order_acquire) != ACTIVE)
+            break;
+        uint32_t index = written % RING_SIZE;
+        uint32_t count = std::min((uint32_t)STREAM_BLOCK_SIZE, RING_SIZE - index);
+        int16_t *dst = &slot.ring[index];
+        uint32_t pos = slot.fetchPos;
+        if (pos >= end)
+        {
+            // 終端以降は無音で埋める (補間のために終端の先を読まれることがあるため)
+            memset(dst, 0, count * sizeof(int16_t));
+        }
+        else
+        {
+            count = std::min(count, end - pos);
+            uint32_t read = sample.stream->Read(pos, dst, count);
+            if (read < count)
+                memset(&dst[read], 0, (count - read) * sizeof(int16_t));
+            pos += count;
+            if (looping && pos >= sample.loopEnd)
+                pos = loopHead;
+            slot.fetchPos = pos;
+        }
+        written += count;
+        slot.written.store(written, std::memory_order_release);
+        progressed = true;
+        consumed = slot.consumed.load(std::memory_order_acquire);
+        if ((int32_t)(consumed - written) > 0)
+            break; // 追い越された場合は次回読み飛ばしてから再開する
+    }
+    return progressed;
+}
+
+void SampleStreamer::Run()
+{
+    while (running.load())
+    {
+        bool progressed = false;
+        for (auto &slot : slots)
+        {
+            uint8_t state = slot.state.load(std::memory_order_acquire);
+            if (state == CLOSING)
+            {
+                slot.sample->stream->Release();
+                slot.sample.reset();
+                slot.state.store(FREE, std::memory_order_release);
+            }
+            else if (state == ACTIVE)
+            {
+                progressed |= Fill(slot);
+            }
+        }
+        if (progressed)
+            continue;
+        // やることがなければ、ボイスの消費が進むかOpenされるまで待つ
+#if defined(FREERTOS)
+        ulTaskNotifyTake(pdTRUE, 1);
+#else
+        std::unique_lock<std::mutex> lock(wakeMutex);
+        wakeCondition.wait_for(lock, std::chrono::milliseconds(1));
+#endif
+    }
+}
+
+}
+}
@@ -1,13 +1,15 @@
 #include "Sampler.h"
 
 #include <algorithm>
+#include <cstring>
 #include <Tables.h>
 #include "Utils.h"
 
 #if defined(FREERTOS)
 // 長い処理ではセマフォを使用し、短い処理ではスピンロックを使用する
-#define ENTER_CRITICAL_SPINLOCK(mutex) portENTER_CRITICAL(&mutex)
-#define EXIT_CRITICAL_SPINLOCK(mutex) portEXIT_CRITICAL(&mutex)
+// 割り込みハンドラーからもメッセージを追加できるように、どちらの文脈でも使用できる版を使う
+#define ENTER_CRITICAL_SPINLOCK(mutex) portENTER_CRITICAL_SAFE(&mutex)
+#define EXIT_CRITICAL_SPINLOCK(mutex) portEXIT_CRITICAL_SAFE(&mutex)
 #define ENTER_CRITICAL_SEMAPHORE(mutex) xSemaphoreTake(mutex, portMAX_DELAY)
 #define EXIT_CRITICAL_SEMAPHORE(mutex) xSemaphoreGive(mutex)
 #else
@@ -41,6 +43,17 @@ void Sampler::InitializeMutexes() {
 
 std::shared_ptr<const Sample> Timbre::GetAppropriateSample(uint8_t noteNo, uint8_t velocity)
 {
+    if (!samples)
+    {
+        for (size_t i = 0; i < zoneCount; i++)
+        {
+            const Zone &zone = zones[i];
+            // 所有者を持たないshared_ptrを返す (参照カウントは操作されない)
+            if (zone.lowerNoteNo <= noteNo && noteNo <= zone.upperNoteNo && zone.lowerVelocity <= velocity && velocity <= zone.upperVelocity)
+                return std::shared_ptr<const Sample>(std::shared_ptr<const Sample>(), zone.sample);
+        }
+        return nullptr;
+    }
     for (const auto& ms : *samples)
     {
         if (ms->lowerNoteNo <= noteNo && noteNo <= ms->upperNoteNo && ms->lowerVelocity <= velocity && velocity <= ms->upperVelocity)
@@ -48,10 +61,135 @@ std::shared_ptr<const Sample> Timbre::GetAppropriateSample(uint8_t noteNo, uint8
     }
     return nullptr;
 }
+std::shared_ptr<Timbre> Timbre::CreateFromZones(std::vector<MappedSample> zones)
+{
+    // 各ゾーンの境界でノートナンバーとベロシティの範囲を区切り、重なりのない長方形に分割する
+    std::vector<uint16_t> keyBounds;
+    for (auto &c : zones)
+    {
+        keyBounds.push_back(c.lowerNoteNo);
+        keyBounds.push_back(c.upperNoteNo + 1);
+    }
+    std::sort(keyBounds.begin(), keyBounds.end());
+    keyBounds.erase(std::unique(keyBounds.begin(), keyBounds.end()), keyBounds.end());
+
+    std::vector<Timbre::MappedSample> mss;
+    size_t prevFirst = 0, prevCount = 0;
+    for (size_t k = 0; k + 1 < keyBounds.size(); k++)
+    {
+        uint8_t lowerNoteNo = keyBounds[k];
+        uint8_t upperNoteNo = keyBounds[k + 1] - 1;
+        std::vector<uint16_t> velBounds;
+        for (auto &c : zones)
+        {
+            if (c.lowerNoteNo <= lowerNoteNo && lowerNoteNo <= c.upperNoteNo)
+            {
+                velBounds.push_back(c.lowerVelocity);
+                velBounds.push_back(c.upperVelocity + 1);
+            }
+        }
+        std::sort(velBounds.begin(), velBounds.end());
+        velBounds.erase(std::unique(velBounds.begin(), velBounds.end()), velBounds.end());
+
+        size_t first = mss.size();
+        for (size_t v = 0; v + 1 < velBounds.size(); v++)
+        {
+            uint8_t lowerVelocity = velBounds[v];
+            for (auto &c : zones)
+            {
+                if (c.lowerNoteNo <= lowerNoteNo && lowerNoteNo <= c.upperNoteNo && c.lowerVelocity <= lowerVelocity && lowerVelocity <= c.upperVelocity)
+                {
+                    // 同じサンプルが続く場合はベロシティの範囲を広げる
+                    if (mss.size() > first && mss.back().sample == c.sample && mss.back().upperVelocity + 1 == lowerVelocity)
+                        mss.back().upperVelocity = velBounds[v + 1] - 1;
+                    else
+                        mss.emplace_back(c.sample, lowerNoteNo, upperNoteNo, lowerVelocity, velBounds[v + 1] - 1);
+                    break;
+                }
+            }
+        }
+        // 直前のノートナンバーの範囲と内容が同じ場合は結合する
+        size_t count = mss.size() - first;
+        bool same = count > 0 && count == prevCount && mss[prevFirst].upperNoteNo + 1 == lowerNoteNo;
+        for (size_t i = 0; same && i < count; i++)
+        {
+            const auto &a = mss[prevFirst + i];
+            const auto &b = mss[first + i];
+            same = a.sample == b.sample && a.lowerVelocity == b.lowerVelocity && a.upperVelocity == b.upperVelocity;
+        }
+        if (same)
+        {
+            mss.erase(mss.begin() + first, mss.end());
+            for (size_t i = 0; i < count; i++)
+                mss[prevFirst + i].upperNoteNo = upperNoteNo;
+        }
+        else if (count > 0)
+        {
+            prevFirst = first;
+            prevCount = count;
+        }
+    }
+    return std::make_shared<Timbre>(std::move(mss));
+}
+bool Timbre::HasStreamingSample() const
+{
+    for (size_t i = 0; i < zoneCount; i++)
+    {
+        if (zones[i].sample && zones[i].sample->stream)
+            return true;
+    }
+    if (!samples)
+        return false;
+    for (const auto& ms : *samples)
+    {
+        if (ms->sample && ms->sample->stream)
+            return true;
+    }
+    return false;
+}
+void Timbre::CollectSamples(std::vector<const Sample *> &out) const
+{
+    for (size_t i = 0; i < zoneCount; i++)
+    {
+        if (zones[i].sample)
+            out.push_back(zones[i].sample);
+    }
+    if (!samples)
+        return;
+    for (const auto& ms : *samples)
+    {
+        if (ms->sample)
+            out.push_back(ms->sample.get());
+    }
+}
+bool Timbre::HasSampleFormat(SampleFormat format) const
+{
+    for (size_t i = 0; i < zoneCount; i++)
+    {
+        if (zones[i].sample && zones[i].sample->format == format)
+            return true;
+    }
+    if (!samples)
+        return false;
+    for (const auto& ms : *samples)
+    {
+        if (ms->sample && ms->sample->format == format)
+            return true;
+    }
+    return false;
+}
 
 void Sampler::SetTimbre(uint8_t channel, shared_ptr<Timbre> t)
 {
-    if(channel < CH_COUNT) channels[channel].SetTimbre(t);
+    if (channel >= CH_COUNT) return;
+    // ストリーミング再生が必要になった時点でローダーを起動する
+    if (t && t->HasStreamingSample()) streamer.Start();
+    if (t && t->HasSampleFormat(SampleFormat::LOSSLESS)) blockCache.Init();
+    channels[channel].SetTimbre(t);
+}
+void Sampler::SetTimbre(uint8_t channel, Timbre &t)
+{
+    SetTimbre(channel, shared_ptr<Timbre>(shared_ptr<Timbre>(), &t));
 }
 void Sampler::Channel::SetTimbre(shared_ptr<Timbre> t)
 {
@@ -67,51 +205,163 @@ void Sampler::Channel::SetTimbre(shared_ptr<Timbre> t)
 
 void Sampler::NoteOn(uint8_t noteNo, uint8_t velocity, uint8_t channel)
 {
-    if (channel >= CH_COUNT) channel = 0; // 無効なチャンネルの場合は1CHにフォールバック
-    velocity &= 0b01111111; // velocityを0-127の範囲に収める
-    ENTER_CRITICAL_SPINLOCK(messageQueueMutex);
-    messageQueue.push_back(Message{MessageStatus::NOTE_ON, channel, noteNo, velocity, 0});
-    EXIT_CRITICAL_SPINLOCK(messageQueueMutex);
+    Message message;
+    if (ToMessage(Event{Event::NOTE_ON, channel, noteNo, velocity, 0}, message))
+        PostMessage(message);
 }
 void Sampler::NoteOff(uint8_t noteNo, uint8_t velocity, uint8_t channel)
 {
-    if (channel >= CH_COUNT) channel = 0; // 無効なチャンネルの場合は1CHにフォールバック
-    velocity &= 0b01111111; // velocityを0-127の範囲に収める
-    ENTER_CRITICAL_SPINLOCK(messageQueueMutex);
-    messageQueue.push_back(Message{MessageStatus::NOTE_OFF, channel, noteNo, velocity, 0});
-    EXIT_CRITICAL_SPINLOCK(messageQueueMutex);
+    Message message;
+    if (ToMessage(Event{Event::NOTE_OFF, channel, noteNo, velocity, 0}, message))
+        PostMessage(message);
 }
 void Sampler::PitchBend(int16_t pitchBend, uint8_t channel)
 {
-    if (channel >= CH_COUNT) return; // 無効なチャンネルの場合は何もしない
-    if (pitchBend < -8192) pitchBend = -8192;
-    else if (pitchBend > 8191) pitchBend = 8191;
+    Message message;
+    if (ToMessage(Event{Event::PITCH_BEND, channel, 0, 0, pitchBend}, message))
+        PostMessage(message);
+}
+bool Sampler::ToMessage(const Event &event, Message &message)
+{
+    uint8_t channel = event.channel;
+    switch (event.type)
+    {
+    case Event::NOTE_ON:
+    case Event::NOTE_OFF:
+        if (channel >= CH_COUNT) channel = 0; // 無効なチャンネルの場合は1CHにフォールバック
+        // velocityを0-127の範囲に収める
+        message = Message{(uint8_t)(event.type == Event::NOTE_ON ? MessageStatus::NOTE_ON : MessageStatus::NOTE_OFF), channel, event.noteNo, (uint8_t)(event.velocity & 0b01111111), 0};
+        return true;
+    case Event::PITCH_BEND:
+        if (channel >= CH_COUNT) return false; // 無効なチャンネルの場合は何もしない
+        message = Message{MessageStatus::PITCH_BEND, channel, 0, 0, std::min(std::max(event.pitchBend, (int16_t)-8192), (int16_t)8191)};
+        return true;
+    }
+    return false;
+}
+void Sampler::PostEvents(const Event *events, size_t count)
+{
+    Message messages[SAMPLER_POST_BATCH_SIZE];
+    size_t batch = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!ToMessage(events[i], messages[batch]))
+            continue;
+        if (++batch == SAMPLER_POST_BATCH_SIZE)
+        {
+            SortByChannel(messages, batch);
+            PostMessages(messages, batch);
+            batch = 0;
+        }
+    }
+    if (batch > 0)
+    {
+        SortByChannel(messages, batch);
+        PostMessages(messages, batch);
+    }
+}
+void Sampler::PostMessage(const Message &message)
+{
+    PostMessages(&message, 1);
+}
+void Sampler::SortByChannel(Message *messages, size_t count)
+{
+    // 同じチャンネル内の順序を保つように挿入ソートで並べ替える (メモリを確保しないようにstd::stable_sortは使わない)
+    for (size_t i = 1; i < count; i++)
+    {
+        Message message = messages[i];
+        size_t j = i;
+        for (; j > 0 && messages[j - 1].channel > message.channel; j--)
+            messages[j] = messages[j - 1];
+        messages[j] = message;
+    }
+}
+size_t Sampler::PostMessages(const Message *messages, size_t count)
+{
+    size_t accepted = count;
     ENTER_CRITICAL_SPINLOCK(messageQueueMutex);
-    messageQueue.push_back(Message{MessageStatus::PITCH_BEND, channel, 0, 0, pitchBend});
+    for (size_t i = 0; i < count; i++)
+    {
+#if SAMPLER_FIXED_CAPACITY
+        if (!messageQueue.push_back(messages[i]))
+        {
+            droppedMessageCount++;
+            accepted--;
+        }
+#else
+        messageQueue.push_back(messages[i]);
+#endif
+    }
+    if (messageQueue.size() > peakMessageQueueLength)
+        peakMessageQueueLength = messageQueue.size();
     EXIT_CRITICAL_SPINLOCK(messageQueueMutex);
+    return accepted;
+}
+size_t Sampler::PostMidi(MidiParser &parser, const uint8_t *data, size_t length)
+{
+    // 割り込みハンドラーから呼ばれてもメモリを確保しないように、スタック上に溜めてからまとめて追加する
+    Message messages[SAMPLER_POST_BATCH_SIZE];
+    size_t count = 0;
+    size_t posted = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        MidiParser::Message midi;
+        if (!parser.Parse(data[i], midi))
+            continue;
+        uint8_t channel = midi.status & 0x0F;
+        switch (midi.status & 0xF0)
+        {
+        case 0x90:
+            messages[count++] = Message{MessageStatus::NOTE_ON, channel, midi.data1, midi.data2, 0};
+            break;
+        case 0x80:
+            messages[count++] = Message{MessageStatus::NOTE_OFF, channel, midi.data1, midi.data2, 0};
+            break;
+        case 0xE0:
+            messages[count++] = Message{MessageStatus::PITCH_BEND, channel, 0, 0, (int16_t)((midi.data2 << 7 | midi.data1) - 8192)};
+            break;
+        default:
+            continue;
+        }
+        if (count == SAMPLER_POST_BATCH_SIZE)
+        {
+            posted += PostMessages(messages, count);
+            count = 0;
+        }
+    }
+    if (count > 0)
+        posted += PostMessages(messages, count);
+    return posted;
 }
 
 void Sampler::Channel::NoteOn(uint8_t noteNo, uint8_t velocity)
 {
     LOGD("Sampler", "NoteOn : %2x, %2x", noteNo, velocity);
-    // 空いているPlayerを探し、そのPlayerにサンプルをセットする
-    uint_fast8_t oldestPlayerId = 0;
     
     // 弱参照からの共有ポインタ取得を試みる
     auto samplerPtr = sampler.lock();
     if (!samplerPtr) return;  // サンプラーが既に解放されている場合は何もしない
     
     ENTER_CRITICAL_SEMAPHORE(samplerPtr->playersMutex);
+    NoteOn(*samplerPtr, noteNo, velocity);
+    EXIT_CRITICAL_SEMAPHORE(samplerPtr->playersMutex);
+}
+uint_fast8_t Sampler::Channel::NoteOn(Sampler &samplerRef, uint8_t noteNo, uint8_t velocity)
+{
+    // 空いているPlayerを探し、そのPlayerにサンプルをセットする
+    uint_fast8_t oldestPlayerId = 0;
+    Sampler *samplerPtr = &samplerRef;
     for (uint_fast8_t i = 0; i < MAX_SOUND; i++)
     {
         if (samplerPtr->players[i].playing == false)
         {
             // チャンネル情報を追加
             uint8_t channelIndex = std::distance(&samplerPtr->channels[0], this);
+            samplerPtr->ReleasePlayer(samplerPtr->players[i]);
             samplerPtr->players[i] = Sampler::SamplePlayer(timbre->GetAppropriateSample(noteNo, velocity), noteNo, velocityTable[velocity], pitchBend, channelIndex);
-            playingNotes.push_back(PlayingNote{noteNo, i});
-            EXIT_CRITICAL_SEMAPHORE(samplerPtr->playersMutex);
-            return;
+            samplerPtr->StartPlayer(samplerPtr->players[i]);
+            AddPlayingNote(*samplerPtr, PlayingNote{noteNo, i});
+            return i;
         }
         else
         {
@@ -121,9 +371,29 @@ void Sampler::Channel::NoteOn(uint8_t noteNo, uint8_t velocity)
     }
     // 全てのPlayerが再生中だった時には、最も昔に発音されたPlayerを停止する
     uint8_t channelIndex = std::distance(&samplerPtr->channels[0], this);
+    samplerPtr->ReleasePlayer(samplerPtr->players[oldestPlayerId]);
     samplerPtr->players[oldestPlayerId] = Sampler::SamplePlayer(timbre->GetAppropriateSample(noteNo, velocity), noteNo, velocityTable[velocity], pitchBend, channelIndex);
-    playingNotes.push_back(PlayingNote{noteNo, oldestPlayerId});
-    EXIT_CRITICAL_SEMAPHORE(samplerPtr->playersMutex);
+    samplerPtr->StartPlayer(samplerPtr->players[oldestPlayerId]);
+    AddPlayingNote(*samplerPtr, PlayingNote{noteNo, oldestPlayerId});
+    return oldestPlayerId;
+}
+void Sampler::Channel::AddPlayingNote([[maybe_unused]] Sampler &samplerRef, PlayingNote note)
+{
+#if SAMPLER_FIXED_CAPACITY
+    // 満杯の場合は最も古いノートを離鍵させて場所を空ける
+    if (playingNotes.full())
+    {
+        const PlayingNote &oldest = playingNotes.front();
+        SamplePlayer &player = samplerRef.players[oldest.playerId];
+        uint8_t channelIndex = std::distance(&samplerRef.channels[0], this);
+        if (player.noteNo == oldest.noteNo && player.channel == channelIndex)
+            player.released = true;
+        playingNotes.erase(playingNotes.begin());
+    }
+#endif
+    playingNotes.push_back(note);
+    if (playingNotes.size() > peakPlayingNoteCount)
+        peakPlayingNoteCount = playingNotes.size();
 }
 void Sampler::Channel::NoteOff(uint8_t noteNo, uint8_t velocity)
 {
@@ -134,6 +404,12 @@ void Sampler::Channel::NoteOff(uint8_t noteNo, uint8_t velocity)
     if (!samplerPtr) return;  // サンプラーが既に解放されている場合は何もしない
     
     ENTER_CRITICAL_SEMAPHORE(samplerPtr->playersMutex);
+    NoteOff(*samplerPtr, noteNo, velocity);
+    EXIT_CRITICAL_SEMAPHORE(samplerPtr->playersMutex);
+}
+void Sampler::Channel::NoteOff(Sampler &samplerRef, uint8_t noteNo, uint8_t velocity)
+{
+    Sampler *samplerPtr = &samplerRef;
     // 現在このチャンネルで発音しているノートの中で該当するnoteNoのものの発音を終わらせる
     for (auto itr = playingNotes.begin(); itr != playingNotes.end();)
     {
@@ -149,17 +425,21 @@ void Sampler::Channel::NoteOff(uint8_t noteNo, uint8_t velocity)
         }
         else itr++;
     }
-    EXIT_CRITICAL_SEMAPHORE(samplerPtr->playersMutex);
 }
 void Sampler::Channel::PitchBend(int16_t b)
 {
-    pitchBend = b * 12.0f / 8192.0f;
-    
     // 弱参照からの共有ポインタ取得を試みる
     auto samplerPtr = sampler.lock();
     if (!samplerPtr) return;  // サンプラーが既に解放されている場合は何もしない
     
     ENTER_CRITICAL_SEMAPHORE(samplerPtr->playersMutex);
+    PitchBend(*samplerPtr, b);
+    EXIT_CRITICAL_SEMAPHORE(samplerPtr->playersMutex);
+}
+void Sampler::Channel::PitchBend(Sampler &samplerRef, int16_t b)
+{
+    pitchBend = b * 12.0f / 8192.0f;
+    Sampler *samplerPtr = &samplerRef;
     // 既に発音中のノートに対してピッチベンドを適用する
     for (auto itr = playingNotes.begin(); itr != playingNotes.end(); itr++)
     {
@@ -171,15 +451,413 @@ void Sampler::Channel::PitchBend(int16_t b)
             player->UpdatePitch();
         }
     }
-    EXIT_CRITICAL_SEMAPHORE(samplerPtr->playersMutex);
+}
+
+bool Sampler::StartSequencer(std::shared_ptr<Sequencer> sequencer)
+{
+    if (!sequencer)
+        return false;
+    ENTER_CRITICAL_SEMAPHORE(playersMutex);
+    // 登録済みならその枠を、なければ空いている枠か停止したシーケンサーの枠を使う
+    std::shared_ptr<Sequencer> *slot = nullptr;
+    for (auto &s : sequencers)
+    {
+        if (s == sequencer)
+        {
+            slot = &s;
+            break;
+        }
+        if (slot == nullptr && (!s || !s->IsPlaying()))
+            slot = &s;
+    }
+    if (slot == nullptr)
+    {
+        EXIT_CRITICAL_SEMAPHORE(playersMutex);
+        LOGE("Sampler", "No free sequencer slot");
+        return false;
+    }
+    if (*slot == sequencer)
+        sequencer->ReleaseHeldNotes(*this, 0);
+    sequencer->Rewind();
+    *slot = std::move(sequencer);
+    EXIT_CRITICAL_SEMAPHORE(playersMutex);
+    return true;
+}
+
+void Sampler::ApplyMessage(const Message &message, uint32_t offset)
+{
+    Channel &channel = channels[message.channel];
+    switch (message.status)
+    {
+    case MessageStatus::NOTE_ON:
+        if (channel.timbre)
+        {
+            // カーネルは4サンプル単位で処理するので、発音の開始位置も4の倍数にする
+            SamplePlayer &player = players[channel.NoteOn(*this, message.noteNo, message.velocity)];
+            player.delay = offset & ~0b11;
+        }
+        break;
+    case MessageStatus::NOTE_OFF:
+        channel.NoteOff(*this, message.noteNo, message.velocity);
+        break;
+    case MessageStatus::PITCH_BEND:
+        channel.PitchBend(*this, message.pitchBend);
+        break;
+    }
+}
+
+void Sampler::ApplySequencerEvent(uint32_t offset, uint8_t status, uint8_t data1, uint8_t data2)
+{
+    Message message = {0, (uint8_t)(status & 0x0F), data1, data2, 0};
+    switch (status & 0xF0)
+    {
+    case 0x90:
+        message.status = MessageStatus::NOTE_ON;
+        break;
+    case 0x80:
+        message.status = MessageStatus::NOTE_OFF;
+        break;
+    case 0xE0:
+        message.status = MessageStatus::PITCH_BEND;
+        message.pitchBend = (int16_t)((data2 << 7 | data1) - 8192);
+        break;
+    default:
+        return;
+    }
+    ApplyMessage(message, offset);
+}
+
+uint64_t Sampler::GetSampleTime()
+{
+    ENTER_CRITICAL_SPINLOCK(messageQueueMutex);
+    uint64_t time = scheduler.GetCurrentTick() * ADSR_UPDATE_SAMPLE_COUNT;
+    EXIT_CRITICAL_SPINLOCK(messageQueueMutex);
+    return time;
+}
+
+size_t Sampler::GetScheduledEventCount()
+{
+    ENTER_CRITICAL_SPINLOCK(messageQueueMutex);
+    size_t count = scheduler.GetCount();
+    EXIT_CRITICAL_SPINLOCK(messageQueueMutex);
+    return count;
+}
+
+bool Sampler::ScheduleEvent(const Event &event, uint64_t time)
+{
+    ScheduledMessage scheduled;
+    if (!ToMessage(event, scheduled.message))
+        return false;
+    scheduled.time = time;
+    ENTER_CRITICAL_SPINLOCK(messageQueueMutex);
+    scheduled.sequence = scheduleSequence++;
+    bool result = scheduler.Schedule(time / ADSR_UPDATE_SAMPLE_COUNT, scheduled);
+    if (!result)
+        droppedMessageCount++;
+    EXIT_CRITICAL_SPINLOCK(messageQueueMutex);
+    return result;
+}
+
+void Sampler::ApplyScheduledMessages()
+{
+    ENTER_CRITICAL_SPINLOCK(messageQueueMutex);
+    uint64_t start = scheduler.GetCurrentTick() * ADSR_UPDATE_SAMPLE_COUNT;
+    auto list = scheduler.PopNext([](const ScheduledMessage &a, const ScheduledMessage &b) {
+        return a.time < b.time || (a.time == b.time && (int32_t)(a.sequence - b.sequence) < 0);
+    });
+    EXIT_CRITICAL_SPINLOCK(messageQueueMutex);
+    if (list.head == scheduler.NONE)
+        return;
+
+    // 取り出したリストはReleaseするまで書き換えられないので、ロックの外で反映する
+    for (uint16_t index = list.head; index != scheduler.NONE; index = scheduler.GetNext(index))
+    {
+        const ScheduledMessage &scheduled = scheduler.Get(index);
+        ApplyMessage(scheduled.message, scheduled.time > start ? (uint32_t)(scheduled.time - start) : 0);
+    }
+
+    ENTER_CRITICAL_SPINLOCK(messageQueueMutex);
+    scheduler.Release(list);
+    EXIT_CRITICAL_SPINLOCK(messageQueueMutex);
+}
+
+void Sampler::SetFloatCacheBudget(size_t budget)
+{
+    ENTER_CRITICAL_SEMAPHORE(playersMutex);
+    for (auto &player : players)
+    {
+        // 破棄される可能性があるので、変換済みのデータへの参照を取り直させる
+        player.floatLevel = nullptr;
+        player.floatData = nullptr;
+    }
+    floatCache.SetBudget(budget);
+    EXIT_CRITICAL_SEMAPHORE(playersMutex);
+}
+
+SamplerFootprint Sampler::GetFootprint()
+{
+    SamplerFootprint footprint;
+    footprint.voices.current = footprint.voices.peak = sizeof(players) + sizeof(grains);
+    footprint.effects.current = footprint.effects.peak = reverb.GetMemorySize();
+    // 波形生成のバッファ・キューから取り出したメッセージ・グラニュラー再生の粒のバッファ・リバーブの作業領域
+    footprint.stack.current = footprint.stack.peak = SAMPLE_BUFFER_SIZE * sizeof(float) + SAMPLER_POST_BATCH_SIZE * sizeof(Message) + ADSR_UPDATE_SAMPLE_COUNT * sizeof(float) + reverb.GetStackSize();
+
+    ENTER_CRITICAL_SPINLOCK(messageQueueMutex);
+    size_t queueLength = messageQueue.size();
+    size_t peakQueueLength = peakMessageQueueLength;
+    EXIT_CRITICAL_SPINLOCK(messageQueueMutex);
+#if SAMPLER_FIXED_CAPACITY
+    // 固定容量のコンテナはSampler本体に含まれている
+    (void)queueLength;
+    (void)peakQueueLength;
+    size_t queues = sizeof(messageQueue) + sizeof(scheduler) + CH_COUNT * sizeof(FixedVector<Channel::PlayingNote, SAMPLER_CHANNEL_NOTE_CAPACITY>);
+    footprint.queues.current = footprint.queues.peak = queues;
+    footprint.object.current = footprint.object.peak = sizeof(Sampler) - footprint.voices.current - queues;
+#else
+    // 予約したイベントのタイマーホイールは固定容量でSampler本体に含まれている
+    footprint.queues.current = queueLength * sizeof(Message) + sizeof(scheduler);
+    footprint.queues.peak = peakQueueLength * sizeof(Message) + sizeof(scheduler);
+    footprint.object.current = footprint.object.peak = sizeof(Sampler) - footprint.voices.current - sizeof(scheduler);
+#endif
+
+    std::vector<const Sample *> samples;
+    ENTER_CRITICAL_SEMAPHORE(playersMutex);
+#if !SAMPLER_FIXED_CAPACITY
+    for (const auto &channel : channels)
+    {
+        footprint.queues.current += channel.GetPlayingNoteCount() * sizeof(Channel::PlayingNote);
+        footprint.queues.peak += channel.GetPeakPlayingNoteCount() * sizeof(Channel::PlayingNote);
+    }
+#endif
+    footprint.streaming.current = footprint.streaming.peak = streamer.GetMemorySize();
+    footprint.caches.current = blockCache.GetMemorySize() + floatCache.GetUsedSize();
+    footprint.caches.peak = blockCache.GetMemorySize() + floatCache.GetPeakUsedSize();
+    // サンプルはティンバーが保持しているので、ロックしている間に数える
+    for (const auto &channel : channels)
+    {
+        if (channel.GetTimbre())
+            channel.GetTimbre()->CollectSamples(samples);
+    }
+    std::sort(samples.begin(), samples.end());
+    samples.erase(std::unique(samples.begin(), samples.end()), samples.end());
+    for (const Sample *sample : samples)
+        footprint.sampleData.current += GetSampleDataSize(*sample);
+    EXIT_CRITICAL_SEMAPHORE(playersMutex);
+    footprint.sampleData.peak = footprint.sampleData.current;
+    return footprint;
+}
+
+void Sampler::StartPlayer(SamplePlayer &player)
+{
+    if (!player.sample || player.sample->IsDirect()) return;
+    if (player.sample->wavetable)
+    {
+        player.frame = player.sample->wavetableFrame;
+        return;
+    }
+    if (player.sample->granular)
+    {
+        const GranularSettings &settings = *player.sample->granular;
+        player.grainPosition = settings.position * settings.source->length;
+        player.grainCountdown = 0.0f;
+        // ボイスごとに異なる揺らぎになるようにする (xorshiftの状態は0以外であること)
+        player.grainSeed = (2463534242u ^ (uint32_t)(&player - players) * 2654435761u ^ (uint32_t)player.createdAt) | 1;
+        return;
+    }
+    player.fetchPos = 0;
+    player.windowLength = 0;
+    player.adpcm = player.sample->adpcmStart;
+    player.cacheEntry = -1;
+    if (player.sample->stream)
+        player.streamSlot = streamer.Open(player.sample);
+}
+void Sampler::ReleasePlayer(SamplePlayer &player)
+{
+    if (player.sample && player.sample->granular)
+    {
+        int8_t index = &player - players;
+        for (auto &grain : grains)
+        {
+            if (grain.player == index)
+                grain.player = -1;
+        }
+    }
+    if (player.streamSlot >= 0)
+    {
+        streamer.Close(player.streamSlot);
+        player.streamSlot = -1;
+    }
+}
+
+std::shared_ptr<Sample> CreateSampleSlice(const std::shared_ptr<const Sample> &parent, uint32_t offset, uint32_t length, uint8_t root, uint32_t loopStart, uint32_t loopEnd, bool adsrEnabled, float attack, float decay, float sustain, float release)
+{
+    if (!parent || !parent->IsDirect() || !parent->sample)
+    {
+        LOGE("Sampler", "Only 16-bit linear PCM samples can be sliced");
+        return nullptr;
+    }
+    if (offset > parent->length || length > parent->length - offset || loopStart > loopEnd || loopEnd > length)
+    {
+        LOGE("Sampler", "Slice is out of range (%u+%u/%u)", (unsigned)offset, (unsigned)length, (unsigned)parent->length);
+        return nullptr;
+    }
+    // 親のサンプルの参照カウントを共有する (親がバンクなどのエイリアスであれば、さらにその所有者も保持される)
+    std::shared_ptr<const int16_t> data(parent, &parent->sample.get()[offset]);
+    auto slice = std::make_shared<Sample>(std::move(data), length, root, loopStart, loopEnd, adsrEnabled, attack, decay, sustain, release);
+    slice->tune = parent->tune;
+    slice->sampleRate = parent->sampleRate;
+    return slice;
+}
+
+// fastから確保した領域にsrcのcountサンプルをコピーし、後ろをpaddingサンプルの無音で埋める
+static std::shared_ptr<const int16_t> copy_to_fast_memory(const std::shared_ptr<MemoryResource> &fast, const int16_t *src, uint32_t count, uint32_t padding)
+{
+    size_t size = (count + padding) * sizeof(int16_t);
+    int16_t *dst = (int16_t *)fast->Allocate(size, 16);
+    if (dst == nullptr)
+        return nullptr;
+    memcpy(dst, src, count * sizeof(int16_t));
+    memset(&dst[count], 0, padding * sizeof(int16_t));
+    // 確保元のリソースは解放されるまで保持しておく
+    return std::shared_ptr<const int16_t>(dst, [fast, size](const int16_t *p) { fast->Deallocate((void *)p, size, 16); });
+}
+
+size_t PlaceHotRegions(Sample &sample, std::shared_ptr<MemoryResource> fast, uint32_t headLength)
+{
+    if (!sample.IsDirect() || !sample.sample)
+        return 0;
+    size_t placed = 0;
+    const int16_t *src = sample.sample.get();
+    bool looping = sample.adsrEnabled && sample.loopStart != sample.loopEnd;
+    if (looping && !sample.fastLoop)
+    {
+        // loopEndの後ろもカーネルが読むので、サンプルの終端まではそのままコピーする
+        uint32_t count = std::min(sample.loopEnd + SAMPLE_GUARD_LENGTH, sample.length) - sample.loopStart;
+        uint32_t padding = sample.loopEnd + SAMPLE_GUARD_LENGTH - sample.loopStart - count;
+        sample.fastLoop = copy_to_fast_memory(fast, &src[sample.loopStart], count, padding);
+        if (sample.fastLoop)
+            placed += (count + padding) * sizeof(int16_t);
+    }
+    headLength = std::min(headLength, sample.length);
+    if (headLength > 0 && !sample.fastHead)
+    {
+        sample.fastHead = copy_to_fast_memory(fast, src, headLength, 0);
+        if (sample.fastHead)
+        {
+            sample.fastHeadLength = headLength;
+            placed += headLength * sizeof(int16_t);
+        }
+    }
+    return placed;
+}
+
+size_t GetSampleDataSize(const Sample &sample)
+{
+    size_t size = 0;
+    if (sample.format == SampleFormat::PCM16)
+        size += (size_t)(sample.stream ? sample.headLength : sample.length) * sizeof(int16_t);
+    else if (sample.format == SampleFormat::LOSSLESS)
+        size += sample.encoded ? GetLosslessSize(sample.encoded.get()) : 0;
+    else
+        size += GetEncodedSize(sample.format, sample.length);
+    if (sample.fastHead)
+        size += sample.fastHeadLength * sizeof(int16_t);
+    if (sample.fastLoop)
+        size += (sample.loopEnd + SAMPLE_GUARD_LENGTH - sample.loopStart) * sizeof(int16_t);
+    if (sample.halfRate)
+        size += GetSampleDataSize(*sample.halfRate);
+    if (sample.wavetable)
+        size += sample.wavetable->GetMemorySize();
+    if (sample.granular)
+        size += GetSampleDataSize(*sample.granular->source);
+    return size;
+}
+
+std::shared_ptr<Sample> CreateWavetableSample(std::shared_ptr<const Wavetable> wavetable, uint8_t root, float attack, float decay, float sustain, float release, uint32_t sampleRate)
+{
+    if (!wavetable)
+        return nullptr;
+    auto sample = std::make_shared<Sample>(std::shared_ptr<const int16_t>(), 0, root, 0, 0, true, attack, decay, sustain, release);
+    sample->sampleRate = sampleRate;
+    sample->wavetable = std::move(wavetable);
+    return sample;
+}
+
+std::shared_ptr<Sample> CreateGranularSample(const GranularSettings &settings, float attack, float decay, float sustain, float release)
+{
+    if (!settings.source || !settings.source->IsDirect() || !settings.source->sample)
+    {
+        LOGE("Sampler", "Only 16-bit linear PCM samples can be played granularly");
+        return nullptr;
+    }
+    const Sample &source = *settings.source;
+    auto sample = std::make_shared<Sample>(std::shared_ptr<const int16_t>(), 0, source.root, 0, 0, true, attack, decay, sustain, release);
+    sample->tune = source.tune;
+    sample->sampleRate = source.sampleRate;
+    sample->granular = std::make_shared<GranularSettings>(settings);
+    return sample;
+}
+
+uint32_t GetSampleGuardLength(const Sample &sample, uint8_t highestNote)
+{
+    return GetSampleGuardLength(highestNote - sample.root + sample.tune * 0.01f, sample.sampleRate);
+}
+uint32_t GetSampleGuardLength(float semitones, uint32_t sampleRate)
+{
+    // ピッチベンドは最大で12半音上げる (Channel::PitchBend)
+    float pitch = powf(2.0f, (semitones + 12.0f) / 12.0f) * ((float)sampleRate / SAMPLE_RATE);
+    uint32_t length = (uint32_t)ceilf(ADSR_UPDATE_SAMPLE_COUNT * pitch) + 2;
+    return std::max<uint32_t>(length, SAMPLE_GUARD_LENGTH);
+}
+
+float GetAttackFromSeconds(float seconds)
+{
+    // 64サンプルごとに足される量
+    float updates = seconds * SAMPLE_RATE / ADSR_UPDATE_SAMPLE_COUNT;
+    if (updates <= 1.0f)
+        return 1.0f;
+    return 1.0f / updates;
+}
+float GetDecayFromSeconds(float seconds)
+{
+    // 64サンプルごとに掛けられる割合 (100dB = 振幅1/100000)
+    float updates = seconds * SAMPLE_RATE / ADSR_UPDATE_SAMPLE_COUNT;
+    if (updates < 1.0f)
+        updates = 1.0f;
+    return powf(0.00001f, 1.0f / updates);
 }
 
 void Sampler::SamplePlayer::UpdatePitch()
 {
     if (!sample) return;
 
-    float delta = noteNo - sample->root + pitchBend;
-    pitch = ((powf(2.0f, delta / 12.0f)));
+    // ピッチが1を超える場合は、間隔が1以下になるまでサンプリング周波数の低いレベルを選ぶ
+    const Sample *s = sample.get();
+    float delta = noteNo - s->root + pitchBend + s->tune * 0.01f;
+    float p = powf(2.0f, delta / 12.0f) * ((float)s->sampleRate / SAMPLE_RATE);
+    while (p > 1.0f && s->halfRate)
+    {
+        s = s->halfRate.get();
+        delta = noteNo - s->root + pitchBend + s->tune * 0.01f;
+        p = powf(2.0f, delta / 12.0f) * ((float)s->sampleRate / SAMPLE_RATE);
+    }
+    // ウェーブテーブルの場合は1サンプルあたりに進む周期数にする
+    if (s->wavetable)
+        p /= s->wavetable->GetFrameLength();
+    if (level != nullptr && level != s)
+    {
+        // 再生中にレベルが変わった場合は、再生位置を新しいレベルの位置に換算する
+        double scale = (s->sampleRate * pow(2.0, s->tune / 1200.0)) / (level->sampleRate * pow(2.0, level->tune / 1200.0));
+        double position = (pos + pos_f) * scale;
+        pos = (uint32_t)position;
+        pos_f = position - pos;
+        if (s->adsrEnabled && s->loopStart != s->loopEnd && pos >= s->loopEnd)
+            pos = s->loopStart + (pos - s->loopStart) % (s->loopEnd - s->loopStart);
+        else if (pos > s->length)
+            pos = s->length;
+    }
+    level = s;
+    pitch = p;
 }
 void Sampler::SamplePlayer::UpdateGain()
 {
@@ -288,53 +966,377 @@ void sampler_process_inner(sampler_process_inner_work_t *work, uint32_t length)
 
 #endif
 
+// sampler_process_inner のfloatに変換済みのデータを読む版
+struct sampler_process_inner_float_work_t
+{
+    const float *src;
+    float *dst;
+    float pos_f;
+    float gain;
+    float pitch;
+};
+
+// int16_tの差はfloatで正確に表せるので、sampler_process_innerと同じ結果になる
+__attribute((optimize("-O3")))
+static void sampler_process_inner_float(sampler_process_inner_float_work_t *work, uint32_t length)
+{
+    const float *s = work->src;
+    float *d = work->dst;
+    float pos_f = work->pos_f;
+    float gain = work->gain;
+    float pitch = work->pitch;
+    do
+    {
+        float s0 = s[0];
+        float val = s0 + (s[1] - s0) * pos_f;
+        *d++ += val * gain;
+        pos_f += pitch;
+        uint32_t intval = pos_f;
+        pos_f -= intval;
+        s += intval;
+    } while (--length);
+    work->src = s;
+    work->dst = d;
+    work->pos_f = pos_f;
+}
+
+// ウェーブテーブルの波形生成処理に必要なデータ類をまとめた構造体
+struct sampler_process_wavetable_work_t
+{
+    const int16_t *src;  // 現在のフレームのテーブル
+    const int16_t *next; // クロスフェード先のフレームのテーブル (クロスフェードしない場合はnullptr)
+    float *dst;
+    uint32_t phase;      // 1周期を2^32とした位相
+    uint32_t increment;  // 1サンプルあたりに進める位相
+    uint32_t shift;      // 位相からテーブル上の位置を取り出すシフト量 (32 - log2(テーブルのサンプル数))
+    float gain;
+    float mix;           // nextの割合
+};
+
+// 位相の上位ビットをテーブル上の位置、残りのビットを補間の割合として読む
+// 位相は32bitで1周するため、ループの折り返しの処理は不要
+__attribute((optimize("-O3")))
+static void sampler_process_wavetable(sampler_process_wavetable_work_t *work, uint32_t length)
+{
+    const int16_t *s = work->src;
+    float *d = work->dst;
+    uint32_t phase = work->phase;
+    uint32_t increment = work->increment;
+    uint32_t shift = work->shift;
+    uint32_t mask = (1u << shift) - 1;
+    float scale = 1.0f / (1u << shift);
+    float gain = work->gain;
+    if (work->next == nullptr)
+    {
+        do
+        {
+            uint32_t i = phase >> shift;
+            float pos_f = (phase & mask) * scale;
+            float s0 = s[i];
+            *d++ += (s0 + (s[i + 1] - s0) * pos_f) * gain;
+            phase += increment;
+        } while (--length);
+    }
+    else
+    {
+        const int16_t *n = work->next;
+        float mix = work->mix;
+        do
+        {
+            uint32_t i = phase >> shift;
+            float pos_f = (phase & mask) * scale;
+            float s0 = s[i];
+            float n0 = n[i];
+            float a = s0 + (s[i + 1] - s0) * pos_f;
+            float b = n0 + (n[i + 1] - n0) * pos_f;
+            *d++ += (a + (b - a) * mix) * gain;
+            phase += increment;
+        } while (--length);
+    }
+    work->dst = d;
+    work->phase = phase;
+}
+
+void Sampler::ProcessWavetable(SamplePlayer &player, const Sample &sample, float *dst, uint32_t length, float gain, float pitch)
+{
+    const Wavetable &wavetable = *sample.wavetable;
+    // 1サンプルあたりに読み進める量が2以下になる、最も倍音の多いテーブルを選ぶ
+    uint32_t level = 0;
+    float step = pitch * wavetable.GetTableLength();
+    while (step > 2.0f && level + 1 < wavetable.GetLevelCount())
+    {
+        step *= 0.5f;
+        level++;
+    }
+    uint32_t shift = 32 - __builtin_ctz(wavetable.GetTableLength() >> level);
+    // ナイキスト周波数を超える場合は基音も折り返すので、そこで頭打ちにする
+    if (pitch > 0.5f)
+        pitch = 0.5f;
+
+    uint32_t lastFrame = wavetable.GetFrameCount() - 1;
+    float frame = std::min(std::max(player.frame, 0.0f), (float)lastFrame);
+    uint32_t current = (uint32_t)frame;
+    float mix = frame - current;
+    const int16_t *next = nullptr;
+    if (!sample.wavetableCrossfade)
+    {
+        if (mix >= 0.5f)
+            current++;
+    }
+    else if (mix > 0.0f)
+    {
+        next = wavetable.GetTable(current + 1, level);
+    }
+
+    sampler_process_wavetable_work_t work = {wavetable.GetTable(current, level), next, dst, player.pos, (uint32_t)(pitch * 4294967296.0f), shift, gain, mix};
+    sampler_process_wavetable(&work, length);
+    player.pos = work.phase;
+    player.frame = std::min(frame + sample.wavetableScan * ((float)length / SAMPLE_RATE), (float)lastFrame);
+}
+
+// 放物線の窓を掛けながらsrcをdstに足し合わせる 窓の位置(0〜1)はtから1サンプルごとにdtずつ進める
+// 依存関係のない単純なループなので、コンパイラによってSIMD命令に展開される
+__attribute((optimize("-O3")))
+static void sampler_mix_grain(const float *__restrict__ src, float *__restrict__ dst, uint32_t length, float t, float dt, float gain)
+{
+    for (uint32_t i = 0; i < length; i++)
+    {
+        float x = t + dt * i;
+        dst[i] += src[i] * (gain * 4.0f * x * (1.0f - x));
+    }
+}
+
+// 粒の揺らぎに使用する乱数 (xorshift32) -1〜1を返す
+static float granular_random(uint32_t &state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return (int32_t)state * (1.0f / 2147483648.0f);
+}
+
+void Sampler::ProcessGranular(SamplePlayer &player, const Sample &sample, float *dst, float gain, float pitch)
+{
+    const GranularSettings &settings = *sample.granular;
+    const Sample &source = *settings.source;
+    int8_t index = &player - players;
+
+    float cost = 0.0f;
+    for (const auto &grain : grains)
+    {
+        if (grain.player == index)
+            cost += grain.cost;
+    }
+
+    // このブロックで発生させる粒 (カーネルは4サンプル単位で処理するので、開始位置と長さは4の倍数にする)
+    uint32_t length = std::max((uint32_t)(settings.grainLength * SAMPLE_RATE) & ~0b11u, 4u);
+    while (settings.density > 0.0f && player.grainCountdown < ADSR_UPDATE_SAMPLE_COUNT)
+    {
+        uint32_t offset = (uint32_t)std::max(player.grainCountdown, 0.0f) & ~0b11u;
+        player.grainCountdown += SAMPLE_RATE / settings.density;
+        float grainPitch = pitch;
+        if (settings.pitchJitter != 0.0f)
+            grainPitch *= powf(2.0f, settings.pitchJitter * granular_random(player.grainSeed) / 12.0f);
+        // 処理コストの上限を超える場合と、読み進める範囲がsourceに収まらない場合は発生させない
+        float grainCost = GetGrainCost(grainPitch);
+        if (cost + grainCost > GRANULAR_VOICE_BUDGET)
+            continue;
+        uint32_t span = (uint32_t)(grainPitch * length) + 2;
+        if (span >= source.length)
+            continue;
+        float position = player.grainPosition;
+        if (settings.positionJitter != 0.0f)
+            position += settings.positionJitter * source.length * granular_random(player.grainSeed);
+        uint32_t start = (uint32_t)std::min(std::max(position, 0.0f), (float)(source.length - span));
+        Grain *grain = std::find_if(std::begin(grains), std::end(grains), [](const Grain &g) { return g.player < 0; });
+        if (grain == std::end(grains))
+            break; // 空いている粒がない
+        *grain = Grain{index, (uint8_t)offset, start, 0.0f, grainPitch, 0, length, grainCost};
+        cost += grainCost;
+    }
+    player.grainCountdown -= ADSR_UPDATE_SAMPLE_COUNT;
+
+    // 切り出す位置を進める 終端に達すると先頭に戻る
+    player.grainPosition += settings.speed * ADSR_UPDATE_SAMPLE_COUNT * ((float)source.sampleRate / SAMPLE_RATE);
+    player.grainPosition = fmodf(player.grainPosition, (float)source.length);
+    if (player.grainPosition < 0.0f)
+        player.grainPosition += source.length;
+
+    // 相関のない粒を重ねると重なった数の平方根に比例して大きくなるので、その分を打ち消す (重なる数はコストの上限で頭打ちになる)
+    float overlap = std::min(settings.density * settings.grainLength, GRANULAR_VOICE_BUDGET / GetGrainCost(pitch));
+    gain /= sqrtf(std::max(1.0f, overlap));
+
+    float buffer[ADSR_UPDATE_SAMPLE_COUNT] __attribute__((aligned(16)));
+    const int16_t *src = source.sample.get();
+    for (auto &grain : grains)
+    {
+        if (grain.player != index)
+            continue;
+        uint32_t count = std::min<uint32_t>(ADSR_UPDATE_SAMPLE_COUNT - grain.offset, grain.length - grain.age);
+        // 補間はボイスと同じカーネルで行い、窓を掛けながら足し合わせる
+        memset(buffer, 0, count * sizeof(float));
+        sampler_process_inner_work_t work = {&src[grain.pos], buffer, grain.pos_f, 1.0f, grain.pitch};
+        sampler_process_inner(&work, count);
+        float dt = 1.0f / grain.length;
+        sampler_mix_grain(buffer, &dst[grain.offset], count, grain.age * dt, dt, gain);
+        grain.pos = work.src - src;
+        grain.pos_f = work.pos_f;
+        grain.age += count;
+        grain.offset = 0;
+        if (grain.age >= grain.length)
+            grain.player = -1;
+    }
+}
+
+void Sampler::FillWindow(SamplePlayer &player, const Sample &sample, uint32_t need)
+{
+    bool looping = sample.adsrEnabled && sample.loopStart != sample.loopEnd;
+    uint32_t end = sample.adsrEnabled ? sample.loopEnd : sample.length;
+    // windowの有効なサンプル数がneedになるまで、ループを考慮しながら続きのサンプルを読み込む
+    while (player.windowLength < need)
+    {
+        int16_t *dst = &player.window[player.windowLength];
+        uint32_t count = need - player.windowLength;
+        uint32_t pos = player.fetchPos;
+        if (pos >= end)
+        { // 終端以降は無音として扱う
+            memset(dst, 0, count * sizeof(int16_t));
+            player.windowLength = need;
+            return;
+        }
+        if (count > end - pos) count = end - pos;
+        if (sample.format == SampleFormat::MULAW)
+        {
+            DecodeMulaw(sample.encoded.get(), pos, count, dst);
+        }
+        else if (sample.format == SampleFormat::ADPCM)
+        {
+            DecodeAdpcm(sample.encoded.get(), pos, count, player.adpcm, dst);
+        }
+        else if (sample.format == SampleFormat::LOSSLESS)
+        { // デコード済みのブロックをキャッシュから取り出す
+            uint32_t offset = pos % LOSSLESS_BLOCK_SIZE;
+            if (count > LOSSLESS_BLOCK_SIZE - offset) count = LOSSLESS_BLOCK_SIZE - offset;
+            const int16_t *decoded = blockCache.Get(sample, pos / LOSSLESS_BLOCK_SIZE, player.cacheEntry);
+            if (decoded) memcpy(dst, &decoded[offset], count * sizeof(int16_t));
+            else memset(dst, 0, count * sizeof(int16_t));
+        }
+        else if (pos < sample.headLength)
+        { // ストリーミング再生: メモリ上にある先頭部分
+            if (count > sample.headLength - pos) count = sample.headLength - pos;
+            memcpy(dst, &sample.sample.get()[pos], count * sizeof(int16_t));
+        }
+        else
+        { // ストリーミング再生: 先読みされたストリーム
+            streamer.Consume(player.streamSlot, dst, count);
+        }
+        player.windowLength += count;
+        pos += count;
+        if (looping && pos >= sample.loopEnd)
+        {
+            pos = sample.loopStart;
+            // ADPCMはloopStartの時点のデコーダーの状態に戻す
+            player.adpcm = sample.adpcmLoop;
+        }
+        player.fetchPos = pos;
+    }
+}
+
+bool Sampler::ProcessWindowed(SamplePlayer &player, const Sample &sample, float *dst, uint32_t remain, float gain, float pitch)
+{
+    bool looping = sample.adsrEnabled && sample.loopStart != sample.loopEnd;
+    uint32_t end = sample.adsrEnabled ? sample.loopEnd : sample.length;
+    // 少なくとも4サンプルぶんの補間に必要なデータがwindowに収まるようにピッチを制限する
+    constexpr float maxPitch = (SAMPLE_WINDOW_SIZE - 3) / 4.0f;
+    if (pitch > maxPitch) pitch = maxPitch;
+
+    float pos_f = player.pos_f;
+    while (remain > 0)
+    {
+        // windowに収まる範囲で一度に処理するサンプル数を決める (カーネルは4サンプル単位で処理する)
+        uint32_t length = (uint32_t)((SAMPLE_WINDOW_SIZE - 2 - pos_f) / pitch) & ~0b11;
+        if (length > remain) length = remain;
+        uint32_t need = (uint32_t)(pos_f + pitch * length) + 2;
+        if (need > SAMPLE_WINDOW_SIZE) need = SAMPLE_WINDOW_SIZE;
+        FillWindow(player, sample, need);
+
+        sampler_process_inner_work_t work = {player.window, dst, pos_f, gain, pitch};
+        sampler_process_inner(&work, length);
+        dst += length;
+        remain -= length;
+        pos_f = work.pos_f;
+
+        // 消費したサンプルをwindowから取り除く
+        uint32_t consumed = work.src - player.window;
+        player.windowLength -= consumed;
+        memmove(player.window, &player.window[consumed], player.windowLength * sizeof(int16_t));
+
+        uint32_t pos = player.pos + consumed;
+        if (pos >= end)
+        {
+            if (!looping) return false; // 終端に達したので再生を停止する
+            pos = sample.loopStart + (pos - sample.loopStart) % (sample.loopEnd - sample.loopStart);
+        }
+        player.pos = pos;
+    }
+    player.pos_f = pos_f;
+    return true;
+}
+
 __attribute((optimize("-O2")))
 void Sampler::Process(int16_t* __restrict__ output)
 {
     // キューを処理する
-    ENTER_CRITICAL_SPINLOCK(messageQueueMutex);
-    while (!messageQueue.empty())
+    // SAMPLER_POST_BATCH_SIZE個ずつまとめて取り出し、プレイヤーのミューテックスも1回の取得で処理する
+    Message messages[SAMPLER_POST_BATCH_SIZE];
+    while (true)
     {
-        Message message = messageQueue.front();
-        messageQueue.pop_front();
-        EXIT_CRITICAL_SPINLOCK(messageQueueMutex);
-        
-        // ミューテックスの外でメッセージを処理
-        switch (message.status)
+        size_t count = 0;
+        ENTER_CRITICAL_SPINLOCK(messageQueueMutex);
+        while (count < SAMPLER_POST_BATCH_SIZE && !messageQueue.empty())
         {
-        case MessageStatus::NOTE_ON:
-            channels[message.channel].NoteOn(message.noteNo, message.velocity);
-            break;
-        case MessageStatus::NOTE_OFF:
-            channels[message.channel].NoteOff(message.noteNo, message.velocity);
-            break;
-        case MessageStatus::PITCH_BEND:
-            channels[message.channel].PitchBend(message.pitchBend);
-            break;
+            messages[count++] = messageQueue.front();
+            messageQueue.pop_front();
         }
-        
-        ENTER_CRITICAL_SPINLOCK(messageQueueMutex);
+        EXIT_CRITICAL_SPINLOCK(messageQueueMutex);
+        if (count == 0)
+            break;
+
+        // キューのミューテックスの外でメッセージを処理
+        ENTER_CRITICAL_SEMAPHORE(playersMutex);
+        for (size_t i = 0; i < count; i++)
+            ApplyMessage(messages[i], 0);
+        EXIT_CRITICAL_SEMAPHORE(playersMutex);
     }
-    EXIT_CRITICAL_SPINLOCK(messageQueueMutex);
 
     // 波形を生成
     float data[SAMPLE_BUFFER_SIZE] __attribute__ ((aligned (16))) = {0.0f};
     
     ENTER_CRITICAL_SEMAPHORE(playersMutex);
-    for (uint_fast8_t i = 0; i < MAX_SOUND; i++)
+    // ADSRの更新周期ごとに、予約されたイベントとシーケンサーのイベントを反映してから全プレイヤーの波形を生成する
+    for (uint_fast8_t j = 0; j < SAMPLE_BUFFER_SIZE / ADSR_UPDATE_SAMPLE_COUNT; j++)
     {
-        SamplePlayer *player = &players[i];
-        if (player->playing == false)
-            continue;
+        ApplyScheduledMessages();
+        for (auto &sequencer : sequencers)
+        {
+            if (sequencer)
+                sequencer->Advance(*this, ADSR_UPDATE_SAMPLE_COUNT);
+        }
 
-        for (uint_fast8_t j = 0; j < SAMPLE_BUFFER_SIZE / ADSR_UPDATE_SAMPLE_COUNT; j++)
+        for (uint_fast8_t i = 0; i < MAX_SOUND; i++)
         {
-            if (!player->sample) break;
+            SamplePlayer *player = &players[i];
+            if (player->playing == false)
+                continue;
+            if (!player->sample) continue;
             const Sample &sample = *player->sample;
             if (sample.adsrEnabled)
                 player->UpdateGain();
             if (player->playing == false)
-                break;
+            {
+                ReleasePlayer(*player);
+                continue;
+            }
 
             float pitch = player->pitch;
             float gain = player->gain;
@@ -343,30 +1345,91 @@ void Sampler::Process(int16_t* __restrict__ output)
             // 後処理で float から int16_t への変換時処理を行う際の高速化の都合で、事前に 65536倍しておく
             gain *= masterVolume * 65536;
 
-            auto src = sample.sample.get();
-            sampler_process_inner_work_t work = {&src[player->pos], &data[j * ADSR_UPDATE_SAMPLE_COUNT], player->pos_f, gain, pitch};
-            // 波形生成処理を行う
-            sampler_process_inner(&work, ADSR_UPDATE_SAMPLE_COUNT);
+            // ブロックの途中から発音する場合は、その位置から書き込む
+            uint32_t delay = player->delay;
+            player->delay = 0;
+            float *dst = &data[j * ADSR_UPDATE_SAMPLE_COUNT + delay];
+            uint32_t length = ADSR_UPDATE_SAMPLE_COUNT - delay;
 
-            int32_t loopEnd = sample.length;
+            if (sample.granular)
+            {
+                // 粒はブロック内の任意の位置から発生できるので、最初の粒を遅らせる
+                player->grainCountdown += delay;
+                ProcessGranular(*player, sample, &data[j * ADSR_UPDATE_SAMPLE_COUNT], gain, pitch);
+                continue;
+            }
+            if (sample.wavetable)
+            {
+                ProcessWavetable(*player, sample, dst, length, gain, pitch);
+                continue;
+            }
+            if (!sample.IsDirect())
+            {
+                if (!ProcessWindowed(*player, sample, dst, length, gain, pitch))
+                {
+                    player->playing = false;
+                    ReleasePlayer(*player);
+                }
+                continue;
+            }
+
+            // ミップマップがある場合は選ばれたレベルの波形データを読む (エンベロープはどのレベルも同じ)
+            const Sample &level = *player->level;
+            uint32_t reach = player->pos + (uint32_t)(pitch * length) + 2;
+            if (floatCache.GetBudget() > 0 && player->floatLevel != player->level)
+            {
+                player->floatData = floatCache.Get(level);
+                player->floatLevel = player->level;
+            }
+            uint32_t pos;
+            float pos_f;
+            if (player->floatData && reach <= level.length + SAMPLE_GUARD_LENGTH)
+            {
+                // floatに変換済みのデータから波形生成処理を行う
+                sampler_process_inner_float_work_t work = {&player->floatData[player->pos], dst, player->pos_f, gain, pitch};
+                sampler_process_inner_float(&work, length);
+                pos = work.src - player->floatData;
+                pos_f = work.pos_f;
+            }
+            else
+            {
+                // 今回読み進める範囲が高速なメモリ上のコピーに収まっていれば、そちらを参照する
+                auto src = level.sample.get();
+                uint32_t base = 0; // srcの先頭のサンプル上の位置
+                if (reach <= level.fastHeadLength)
+                {
+                    src = level.fastHead.get();
+                }
+                else if (level.fastLoop && player->pos >= level.loopStart && reach <= level.loopEnd + SAMPLE_GUARD_LENGTH)
+                {
+                    src = level.fastLoop.get();
+                    base = level.loopStart;
+                }
+                sampler_process_inner_work_t work = {&src[player->pos - base], dst, player->pos_f, gain, pitch};
+                // 波形生成処理を行う
+                sampler_process_inner(&work, length);
+                // 現在のサンプル位置に基づいてposがどこまで進んだか求める
+                pos = work.src - src + base;
+                pos_f = work.pos_f;
+            }
+
+            int32_t loopEnd = level.length;
             int32_t loopBack = 0;
             // adsrEnabledが有効の場合はループポイントを使用する。
-            if (sample.adsrEnabled)
+            if (level.adsrEnabled)
             {
-                loopEnd = sample.loopEnd;
-                loopBack = sample.loopStart - loopEnd;
+                loopEnd = level.loopEnd;
+                loopBack = level.loopStart - loopEnd;
             }
 
-            // 現在のサンプル位置に基づいてposがどこまで進んだか求める
-            uint32_t pos = work.src - src;
-
             // ループポイント or 終端を超えた場合の処理
             if (pos >= loopEnd)
             {
                 if (loopBack == 0)
                 { // ループポイントが設定されていない場合は終端として扱い再生を停止する
                     player->playing = false;
-                    break;
+                    ReleasePlayer(*player);
+                    continue;
                 }
                 do
                 {
@@ -375,7 +1438,7 @@ void Sampler::Process(int16_t* __restrict__ output)
             }
 
             player->pos = pos;
-            player->pos_f = work.pos_f;
+            player->pos_f = pos_f;
         }
     }
     EXIT_CRITICAL_SEMAPHORE(playersMutex);
@@ -0,0 +1,245 @@
+#include "Sequencer.h"
+
+#include <algorithm>
+#include "Sampler.h"
+#include "Utils.h"
+
+namespace capsule
+{
+namespace sampler
+{
+
+Sequencer::Sequencer(const MidiMessage *song) : song{song}, songEnd{song}, songCursor{song}
+{
+    while (!IsEndOfSong(*songEnd))
+        songEnd++;
+    songLength = songEnd->time;
+}
+
+Sequencer::Sequencer(std::shared_ptr<const MidiFile> file) : file{std::move(file)}
+{
+    if (!this->file)
+        return;
+    // 読み出し位置の状態はトラックの数に比例する大きさで、作成時に確保しておく
+    fileCursor.emplace(*this->file);
+    loopFileCursor.emplace(*this->file);
+    songLength = this->file->GetLength();
+}
+
+void Sequencer::SetTempo(float value)
+{
+    if (!(value > 0.0f))
+    {
+        LOGE("Sequencer", "Tempo must be positive");
+        return;
+    }
+    tempo = value;
+}
+
+bool Sequencer::SetLoop(uint32_t start, uint32_t end)
+{
+    if (start >= end)
+    {
+        LOGE("Sequencer", "Invalid loop region");
+        return false;
+    }
+    // 音声処理スレッドから読まれるので、区間が一時的に空にならない順に書き換える
+    loopEnd = 0;
+    loopStart = start;
+    loopEnd = end;
+    return true;
+}
+
+void Sequencer::ClearLoop()
+{
+    loopEnd = 0;
+}
+
+void Sequencer::Stop()
+{
+    stopRequested = true;
+}
+
+void Sequencer::Rewind()
+{
+    songCursor = song;
+    if (fileCursor)
+        fileCursor->Reset();
+    previousTime = -1;
+    hasNext = false;
+    Fetch();
+    position = 0;
+    positionFraction = 0.0f;
+    for (auto &bits : heldNotes)
+        std::fill(std::begin(bits), std::end(bits), 0);
+    stopRequested = false;
+    playing = true;
+}
+
+void Sequencer::Advance(Sampler &sampler, uint32_t length)
+{
+    if (stopRequested.exchange(false))
+    {
+        ReleaseHeldNotes(sampler, 0);
+        playing = false;
+        return;
+    }
+    if (!playing)
+        return;
+
+    float speed = tempo;
+    float elapsed = 0.0f; // このブロックで処理済みの出力サンプル数
+    while (true)
+    {
+        uint32_t start = loopStart;
+        uint32_t end = loopEnd;
+        bool looping = end > start;
+        uint32_t boundary = looping ? std::min(end, songLength) : songLength;
+        // ブロックの残りで進む曲上のサンプル数と、ループの終端または曲の終わりまでの距離
+        float remain = (length - elapsed) * speed;
+        float distance = (float)((int64_t)boundary - position) - positionFraction;
+        bool wrap = distance <= remain;
+        float limit = wrap ? distance : remain;
+
+        while (hasNext)
+        {
+            float ahead = next.time >= position ? (float)(next.time - position) - positionFraction : 0.0f;
+            if (ahead >= limit)
+                break;
+            uint32_t offset = (uint32_t)(elapsed + std::max(ahead, 0.0f) / speed);
+            Dispatch(sampler, std::min(offset, length - 1), next.status, next.data1, next.data2);
+            Fetch();
+        }
+        if (!wrap)
+        {
+            positionFraction += remain;
+            uint32_t whole = (uint32_t)positionFraction;
+            position += whole;
+            positionFraction -= whole;
+            return;
+        }
+
+        // ループの終端または曲の終わりに達した 戻った先で鳴らし直されるので、鳴っているノートは離鍵させる
+        elapsed += std::max(distance, 0.0f) / speed;
+        ReleaseHeldNotes(sampler, std::min((uint32_t)elapsed, length - 1));
+        if (!looping || start >= boundary)
+        {
+            position = boundary;
+            positionFraction = 0.0f;
+            playing = false;
+            return;
+        }
+        Seek(start);
+        position = start;
+        positionFraction = 0.0f;
+        if (elapsed >= length)
+            return;
+    }
+}
+
+void Sequencer::Fetch()
+{
+    if (hasNext)
+        previousTime = next.time;
+    if (song != nullptr)
+    {
+        hasNext = !IsEndOfSong(*songCursor);
+        if (hasNext)
+            next = *songCursor++;
+        return;
+    }
+    if (!fileCursor)
+    {
+        hasNext = false;
+        return;
+    }
+    hasNext = fileCursor->Next(next);
+    // ループの先頭以降の最初のメッセージを読み出した時は、戻る先として読み出し位置の状態を保存しておく
+    uint32_t start = loopStart;
+    if (hasNext && loopEnd > start && (!loopNextValid || loopNextStart != start) && next.time >= start && previousTime < (int64_t)start)
+    {
+        *loopFileCursor = *fileCursor;
+        loopNext = next;
+        loopNextStart = start;
+        loopNextValid = true;
+    }
+}
+
+void Sequencer::Seek(uint32_t start)
+{
+    if (song != nullptr)
+    {
+        // 配列の場合は二分探索する
+        songCursor = std::lower_bound(song, songEnd, start, [](const MidiMessage &message, uint32_t time) { return message.time < time; });
+        hasNext = false;
+        Fetch();
+        return;
+    }
+    if (!fileCursor)
+        return;
+    if (!loopNextValid || loopNextStart != start)
+    {
+        // 保存した状態がない場合は先頭から読み直す (読み直す途中でFetchが状態を保存する)
+        fileCursor->Reset();
+        previousTime = -1;
+        hasNext = false;
+        Fetch();
+        while (hasNext && next.time < start)
+            Fetch();
+        return;
+    }
+    *fileCursor = *loopFileCursor;
+    next = loopNext;
+    hasNext = true;
+}
+
+void Sequencer::Dispatch(Sampler &sampler, uint32_t offset, uint8_t status, uint8_t data1, uint8_t data2)
+{
+    uint8_t channel = status & 0x0F;
+    data1 &= 0x7F;
+    data2 &= 0x7F;
+    uint32_t &bits = heldNotes[channel][data1 >> 5];
+    uint32_t mask = 1u << (data1 & 31);
+    switch (status & 0xF0)
+    {
+    case 0x90:
+        if (data2 != 0)
+        {
+            bits |= mask;
+            break;
+        }
+        // ベロシティ0のノートオンはノートオフとして扱う
+        status = 0x80 | channel;
+        bits &= ~mask;
+        break;
+    case 0x80:
+        bits &= ~mask;
+        break;
+    case 0xE0:
+        break;
+    default:
+        return; // その他のメッセージとメタイベントは無視する
+    }
+    sampler.ApplySequencerEvent(offset, status, data1, data2);
+}
+
+void Sequencer::ReleaseHeldNotes(Sampler &sampler, uint32_t offset)
+{
+    for (uint8_t channel = 0; channel < 16; channel++)
+    {
+        for (uint8_t word = 0; word < 4; word++)
+        {
+            uint32_t bits = heldNotes[channel][word];
+            heldNotes[channel][word] = 0;
+            while (bits != 0)
+            {
+                uint8_t noteNo = word * 32 + __builtin_ctz(bits);
+                bits &= bits - 1;
+                sampler.ApplySequencerEvent(offset, 0x80 | channel, noteNo, 0);
+            }
+        }
+    }
+}
+
+}
+}
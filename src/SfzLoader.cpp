@@ -0,0 +1,513 @@
+#include "SfzLoader.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include "MappedFile.h"
+#include "Resampler.h"
+#include "Utils.h"
+
+namespace capsule
+{
+namespace sampler
+{
+
+typedef std::map<std::string, std::string> sfz_opcodes_t;
+
+// 読み込んだWAVファイル (SAMPLE_RATEに変換済み)
+struct sfz_wave_t
+{
+    std::string path;
+    std::shared_ptr<const int16_t> data;
+    uint32_t length = 0;
+    double ratio = 1.0; // 元のファイルの位置からdata上の位置への倍率
+    bool hasLoop = false;
+    uint32_t loopStart = 0; // 元のファイル上の位置
+    uint32_t loopEnd = 0;   // 元のファイル上の位置 (自身を含む)
+    float semitones = 0.0f; // 参照するリージョンが再生する最も高いノートの、ルートからの半音数 (波形データの後ろの余白を決める)
+};
+
+static uint16_t read_u16(const uint8_t *p)
+{
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+static uint32_t read_u32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// WAVファイルを読み込み、モノラルにしてSAMPLE_RATEにリサンプリングする
+static bool load_wave(sfz_wave_t &wave)
+{
+    auto file = MappedFile::Open(wave.path.c_str());
+    if (!file)
+        return false;
+    const uint8_t *data = file->GetData();
+    size_t size = file->GetSize();
+    if (size < 12 || memcmp(data, "RIFF", 4) != 0 || memcmp(&data[8], "WAVE", 4) != 0)
+    {
+        LOGE("SfzLoader", "%s is not a WAV file", wave.path.c_str());
+        return false;
+    }
+    uint16_t format = 0, channels = 0, bits = 0, blockAlign = 0;
+    uint32_t sampleRate = 0;
+    const uint8_t *pcm = nullptr;
+    uint32_t pcmSize = 0;
+    for (size_t pos = 12; pos + 8 <= size;)
+    {
+        const uint8_t *id = &data[pos];
+        uint32_t chunkSize = std::min<size_t>(read_u32(&data[pos + 4]), size - pos - 8);
+        const uint8_t *body = &data[pos + 8];
+        if (memcmp(id, "fmt ", 4) == 0 && chunkSize >= 16)
+        {
+            format = read_u16(body);
+            channels = read_u16(&body[2]);
+            sampleRate = read_u32(&body[4]);
+            blockAlign = read_u16(&body[12]);
+            bits = read_u16(&body[14]);
+            // WAVE_FORMAT_EXTENSIBLEの場合はサブフォーマットを使用する
+            if (format == 0xFFFE && chunkSize >= 26)
+                format = read_u16(&body[24]);
+        }
+        else if (memcmp(id, "data", 4) == 0)
+        {
+            pcm = body;
+            pcmSize = chunkSize;
+        }
+        else if (memcmp(id, "smpl", 4) == 0 && chunkSize >= 36 + 24 && read_u32(&body[28]) > 0)
+        {
+            wave.hasLoop = true;
+            wave.loopStart = read_u32(&body[36 + 8]);
+            wave.loopEnd = read_u32(&body[36 + 12]);
+        }
+        pos += 8 + chunkSize + (chunkSize & 1);
+    }
+    bool supported = (format == 1 && (bits == 8 || bits == 16 || bits == 24 || bits == 32)) || (format == 3 && bits == 32);
+    if (pcm == nullptr || !supported || channels == 0 || sampleRate == 0 || blockAlign < channels * bits / 8)
+    {
+        LOGE("SfzLoader", "%s has unsupported format", wave.path.c_str());
+        return false;
+    }
+
+    // 全チャンネルの平均を取ってモノラルにする
+    uint32_t frames = pcmSize / blockAlign;
+    std::vector<float> mono(frames);
+    uint32_t bytes = bits / 8;
+    for (uint32_t i = 0; i < frames; i++)
+    {
+        const uint8_t *frame = &pcm[i * blockAlign];
+        float sum = 0.0f;
+        for (uint16_t c = 0; c < channels; c++)
+        {
+            const uint8_t *p = &frame[c * bytes];
+            switch (bits)
+            {
+            case 8:
+                sum += (p[0] - 128) / 128.0f;
+                break;
+            case 16:
+                sum += (int16_t)read_u16(p) / 32768.0f;
+                break;
+            case 24:
+                sum += (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) / 2147483648.0f;
+                break;
+            default:
+                if (format == 3)
+                {
+                    float f;
+                    memcpy(&f, p, sizeof(f));
+                    sum += f;
+                }
+                else
+                    sum += (int32_t)read_u32(p) / 2147483648.0f;
+                break;
+            }
+        }
+        mono[i] = sum / channels;
+    }
+
+    wave.length = GetResampledLength(frames, sampleRate, SAMPLE_RATE);
+    wave.ratio = (double)SAMPLE_RATE / sampleRate;
+    int16_t *buffer = new int16_t[wave.length + GetSampleGuardLength(wave.semitones)]();
+    Resample(mono.data(), frames, sampleRate, SAMPLE_RATE, buffer);
+    wave.data = std::shared_ptr<const int16_t>(buffer, std::default_delete<int16_t[]>());
+    return true;
+}
+
+// "c4"のような音名またはノートナンバーを読み取る (c4 = 60)
+static int parse_note(const std::string &value, int fallback)
+{
+    if (value.empty())
+        return fallback;
+    if (isdigit((unsigned char)value[0]) || value[0] == '-')
+        return atoi(value.c_str());
+    static const int offsets[] = {9, 11, 0, 2, 4, 5, 7}; // a-g
+    char letter = tolower((unsigned char)value[0]);
+    if (letter < 'a' || letter > 'g')
+        return fallback;
+    int note = offsets[letter - 'a'];
+    size_t i = 1;
+    if (i < value.size() && value[i] == '#')
+        note++, i++;
+    else if (i < value.size() && value[i] == 'b')
+        note--, i++;
+    return (atoi(&value[i]) + 1) * 12 + note;
+}
+
+static std::string trim(const std::string &s)
+{
+    size_t first = s.find_first_not_of(" \t\r\n");
+    if (first == std::string::npos)
+        return "";
+    return s.substr(first, s.find_last_not_of(" \t\r\n") - first + 1);
+}
+
+static std::string get_directory(const std::string &path)
+{
+    size_t slash = path.find_last_of("/\\");
+    return slash == std::string::npos ? "" : path.substr(0, slash + 1);
+}
+
+// コメントを取り除き、#includeを展開し、#defineを置換したテキストを作成する
+static bool preprocess(const std::string &path, const std::string &baseDirectory, std::vector<std::pair<std::string, std::string>> &defines, std::string &out, int depth)
+{
+    auto file = MappedFile::Open(path.c_str());
+    if (!file || depth > 16)
+    {
+        LOGE("SfzLoader", "Failed to read %s", path.c_str());
+        return false;
+    }
+    std::string text((const char *)file->GetData(), file->GetSize());
+    // ブロックコメントと行コメントを取り除く
+    for (size_t pos = 0; (pos = text.find("/*", pos)) != std::string::npos;)
+    {
+        size_t end = text.find("*/", pos + 2);
+        text.erase(pos, end == std::string::npos ? std::string::npos : end + 2 - pos);
+    }
+    size_t lineStart = 0;
+    while (lineStart < text.size())
+    {
+        size_t lineEnd = text.find('\n', lineStart);
+        if (lineEnd == std::string::npos)
+            lineEnd = text.size();
+        std::string line = text.substr(lineStart, lineEnd - lineStart);
+        lineStart = lineEnd + 1;
+        size_t comment = line.find("//");
+        if (comment != std::string::npos)
+            line.erase(comment);
+        std::string trimmed = trim(line);
+        if (trimmed.compare(0, 7, "#define") == 0)
+        {
+            size_t nameStart = trimmed.find('$');
+            if (nameStart == std::string::npos)
+                continue;
+            size_t nameEnd = trimmed.find_first_of(" \t", nameStart);
+            if (nameEnd == std::string::npos)
+                continue;
+            defines.emplace_back(trimmed.substr(nameStart, nameEnd - nameStart), trim(trimmed.substr(nameEnd)));
+            // 長い名前から置換されるようにする
+            std::sort(defines.begin(), defines.end(), [](const std::pair<std::string, std::string> &a, const std::pair<std::string, std::string> &b) { return a.first.size() > b.first.size(); });
+            continue;
+        }
+        if (trimmed.compare(0, 8, "#include") == 0)
+        {
+            size_t open = trimmed.find('"');
+            size_t close = trimmed.find('"', open + 1);
+            if (open == std::string::npos || close == std::string::npos)
+                continue;
+            // #includeのパスは最初に読み込んだファイルからの相対パス
+            if (!preprocess(baseDirectory + trimmed.substr(open + 1, close - open - 1), baseDirectory, defines, out, depth + 1))
+                return false;
+            continue;
+        }
+        for (auto &define : defines)
+        {
+            for (size_t pos = 0; (pos = line.find(define.first, pos)) != std::string::npos; pos += define.second.size())
+                line.replace(pos, define.first.size(), define.second);
+        }
+        out += line;
+        out += '\n';
+    }
+    return true;
+}
+
+// 1行分のヘッダーとオペコードを読み取る
+// 値には空白が含まれることがあるため(sample=など)、値は次のヘッダーかオペコードの直前までとする
+template <typename OnHeader, typename OnOpcode>
+static void parse_line(const std::string &line, OnHeader onHeader, OnOpcode onOpcode)
+{
+    size_t i = 0;
+    while (i < line.size())
+    {
+        i = line.find_first_not_of(" \t\r", i);
+        if (i == std::string::npos)
+            break;
+        if (line[i] == '<')
+        {
+            size_t close = line.find('>', i);
+            if (close == std::string::npos)
+                break;
+            onHeader(line.substr(i + 1, close - i - 1));
+            i = close + 1;
+            continue;
+        }
+        size_t eq = line.find('=', i);
+        if (eq == std::string::npos)
+            break;
+        std::string name = trim(line.substr(i, eq - i));
+        size_t end = line.size();
+        for (size_t k = eq + 1; k < line.size(); k++)
+        {
+            if (line[k] != ' ' && line[k] != '\t')
+                continue;
+            size_t next = line.find_first_not_of(" \t\r", k);
+            if (next == std::string::npos)
+                break;
+            if (line[next] == '<')
+            {
+                end = k;
+                break;
+            }
+            size_t n = next;
+            while (n < line.size() && (isalnum((unsigned char)line[n]) || line[n] == '_'))
+                n++;
+            if (n > next && n < line.size() && line[n] == '=')
+            {
+                end = k;
+                break;
+            }
+        }
+        onOpcode(name, trim(line.substr(eq + 1, end - eq - 1)));
+        i = end;
+    }
+}
+
+static const std::string &get_opcode(const sfz_opcodes_t &opcodes, const char *name, const char *alias = nullptr)
+{
+    static const std::string empty;
+    auto it = opcodes.find(name);
+    if (it == opcodes.end() && alias != nullptr)
+        it = opcodes.find(alias);
+    return it == opcodes.end() ? empty : it->second;
+}
+
+static float get_float(const sfz_opcodes_t &opcodes, const char *name, float fallback)
+{
+    const std::string &value = get_opcode(opcodes, name);
+    return value.empty() ? fallback : (float)atof(value.c_str());
+}
+
+// リージョンのルートと鍵盤の範囲を読み取る (範囲は0〜127に制限しない)
+static void get_key_range(const sfz_opcodes_t &r, int &root, int &lowerNoteNo, int &upperNoteNo)
+{
+    root = parse_note(get_opcode(r, "pitch_keycenter"), 60);
+    lowerNoteNo = parse_note(get_opcode(r, "lokey"), 0);
+    upperNoteNo = parse_note(get_opcode(r, "hikey"), 127);
+    const std::string &key = get_opcode(r, "key");
+    if (!key.empty())
+    {
+        lowerNoteNo = upperNoteNo = parse_note(key, 60);
+        if (get_opcode(r, "pitch_keycenter").empty())
+            root = lowerNoteNo;
+    }
+}
+
+// リージョンのルートに対する音高の補正 (セント単位)
+static float get_tune(const sfz_opcodes_t &r)
+{
+    return get_float(r, "tune", 0.0f) + get_float(r, "transpose", 0.0f) * 100.0f;
+}
+
+std::shared_ptr<Timbre> LoadSfz(const char *path, unsigned threadCount)
+{
+    std::string directory = get_directory(path);
+    std::vector<std::pair<std::string, std::string>> defines;
+    std::string text;
+    if (!preprocess(path, directory, defines, text, 0))
+        return nullptr;
+
+    // 各階層のオペコードを上書きしながらリージョンを集める
+    sfz_opcodes_t control, global, master, group, region;
+    sfz_opcodes_t *current = nullptr;
+    std::vector<sfz_opcodes_t> regions;
+    auto finishRegion = [&]() {
+        if (current != &region)
+            return;
+        sfz_opcodes_t merged = global;
+        for (auto *level : {&master, &group, &region})
+        {
+            for (auto &opcode : *level)
+                merged[opcode.first] = opcode.second;
+        }
+        regions.push_back(std::move(merged));
+    };
+    auto onHeader = [&](const std::string &header) {
+        finishRegion();
+        if (header == "region")
+        {
+            region.clear();
+            current = &region;
+        }
+        else if (header == "group")
+        {
+            group.clear();
+            current = &group;
+        }
+        else if (header == "master")
+        {
+            master.clear();
+            group.clear();
+            current = &master;
+        }
+        else if (header == "global")
+        {
+            global.clear();
+            master.clear();
+            group.clear();
+            current = &global;
+        }
+        else if (header == "control")
+            current = &control;
+        else
+            current = nullptr; // 対応していないヘッダー
+    };
+    auto onOpcode = [&](const std::string &name, const std::string &value) {
+        if (current != nullptr)
+            (*current)[name] = value;
+    };
+    size_t lineStart = 0;
+    while (lineStart < text.size())
+    {
+        size_t lineEnd = text.find('\n', lineStart);
+        parse_line(text.substr(lineStart, lineEnd - lineStart), onHeader, onOpcode);
+        lineStart = lineEnd + 1;
+    }
+    finishRegion();
+
+    // 参照されているWAVファイルを重複なく列挙する
+    std::string defaultPath = get_opcode(control, "default_path");
+    std::vector<sfz_wave_t> waves;
+    std::unordered_map<std::string, size_t> waveIndices;
+    std::vector<size_t> regionWaves(regions.size(), SIZE_MAX);
+    for (size_t i = 0; i < regions.size(); i++)
+    {
+        const std::string &sample = get_opcode(regions[i], "sample");
+        const std::string &trigger = get_opcode(regions[i], "trigger");
+        if (sample.empty() || sample[0] == '*' || (!trigger.empty() && trigger != "attack"))
+            continue;
+        std::string samplePath = directory + defaultPath + sample;
+        std::replace(samplePath.begin(), samplePath.end(), '\\', '/');
+        auto it = waveIndices.find(samplePath);
+        if (it == waveIndices.end())
+        {
+            it = waveIndices.emplace(samplePath, waves.size()).first;
+            waves.emplace_back();
+            waves.back().path = samplePath;
+        }
+        regionWaves[i] = it->second;
+        // 最も高く再生するリージョンに合わせて、読み込む時に波形データの後ろの余白を確保する
+        int root, lowerNoteNo, upperNoteNo;
+        get_key_range(regions[i], root, lowerNoteNo, upperNoteNo);
+        float semitones = std::min(upperNoteNo, 127) - root + get_tune(regions[i]) * 0.01f;
+        waves[it->second].semitones = std::max(waves[it->second].semitones, semitones);
+    }
+
+    // WAVファイルをスレッドプールで並列に読み込む
+    std::vector<char> loaded(waves.size(), 0);
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t i; (i = next++) < waves.size();)
+            loaded[i] = load_wave(waves[i]);
+    };
+    if (threadCount == 0)
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    threadCount = std::min<size_t>(threadCount, std::max<size_t>(waves.size(), 1));
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < threadCount; i++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto &thread : threads)
+        thread.join();
+
+    std::vector<Timbre::MappedSample> zones;
+    for (size_t i = 0; i < regions.size(); i++)
+    {
+        if (regionWaves[i] == SIZE_MAX || !loaded[regionWaves[i]])
+            continue;
+        const sfz_opcodes_t &r = regions[i];
+        const sfz_wave_t &wave = waves[regionWaves[i]];
+
+        // 範囲は元のファイル上の位置で指定されているため、リサンプリング後の位置に変換する
+        auto toPosition = [&](double pos) { return (uint32_t)std::min<double>(std::max(0.0, std::round(pos * wave.ratio)), wave.length); };
+        const std::string &endValue = get_opcode(r, "end");
+        uint32_t start = toPosition(atof(get_opcode(r, "offset").c_str()));
+        uint32_t end = endValue.empty() ? wave.length : toPosition(atof(endValue.c_str()) + 1);
+        if (start >= end)
+            continue;
+        uint32_t length = end - start;
+
+        std::string loopMode = get_opcode(r, "loop_mode", "loopmode");
+        if (loopMode.empty())
+            loopMode = wave.hasLoop ? "loop_continuous" : "no_loop";
+        const std::string &loopStartValue = get_opcode(r, "loop_start", "loopstart");
+        const std::string &loopEndValue = get_opcode(r, "loop_end", "loopend");
+        double loopStart = loopStartValue.empty() ? wave.loopStart : atof(loopStartValue.c_str());
+        double loopEnd = (loopEndValue.empty() ? wave.loopEnd : atof(loopEndValue.c_str())) + 1;
+        uint32_t sampleLoopStart = length;
+        uint32_t sampleLoopEnd = length;
+        if ((loopMode == "loop_continuous" || loopMode == "loop_sustain") && (wave.hasLoop || !loopEndValue.empty()))
+        {
+            uint32_t ls = toPosition(loopStart);
+            uint32_t le = toPosition(loopEnd);
+            if (start <= ls && ls < le && le <= end)
+            {
+                sampleLoopStart = ls - start;
+                sampleLoopEnd = le - start;
+            }
+        }
+
+        int root, lowerNoteNo, upperNoteNo;
+        get_key_range(r, root, lowerNoteNo, upperNoteNo);
+        int lowerVelocity = (int)get_float(r, "lovel", 0);
+        int upperVelocity = (int)get_float(r, "hivel", 127);
+        lowerNoteNo = std::max(lowerNoteNo, 0);
+        upperNoteNo = std::min(upperNoteNo, 127);
+        lowerVelocity = std::max(lowerVelocity, 0);
+        upperVelocity = std::min(upperVelocity, 127);
+        if (lowerNoteNo > upperNoteNo || lowerVelocity > upperVelocity || root < 0 || root > 127)
+            continue;
+
+        // ワンショットはノートオフを無視して最後まで再生する
+        bool adsrEnabled = loopMode != "one_shot";
+        float attack = GetAttackFromSeconds(get_float(r, "ampeg_attack", 0.0f));
+        float decay = GetDecayFromSeconds(get_float(r, "ampeg_decay", 0.0f));
+        float sustain = std::min(std::max(get_float(r, "ampeg_sustain", 100.0f) / 100.0f, 0.0f), 1.0f);
+        float release = GetReleaseFromSeconds(get_float(r, "ampeg_release", 0.001f));
+
+        // 同じファイルを参照するリージョンは波形データを共有する
+        std::shared_ptr<const int16_t> data(wave.data, wave.data.get() + start);
+        auto sample = std::make_shared<Sample>(std::move(data), length, (uint8_t)root, sampleLoopStart, sampleLoopEnd, adsrEnabled, attack, decay, sustain, release);
+        sample->tune = get_tune(r);
+        zones.emplace_back(std::move(sample), lowerNoteNo, upperNoteNo, lowerVelocity, upperVelocity);
+    }
+    if (zones.empty())
+    {
+        LOGE("SfzLoader", "No playable region in %s", path);
+        return nullptr;
+    }
+    return Timbre::CreateFromZones(std::move(zones));
+}
+
+}
+}
@@ -0,0 +1,360 @@
+#include "SoundFont.h"
+
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include "Utils.h"
+
+// ESP32・x86・ARMなどリトルエンディアンの環境でのみ使用できる (smplチャンクを16bitのPCMとして直接参照する)
+
+namespace capsule
+{
+namespace sampler
+{
+
+// 各レコードのバイト数
+#define SF2_PHDR_SIZE 38
+#define SF2_BAG_SIZE 4
+#define SF2_GEN_SIZE 4
+#define SF2_INST_SIZE 22
+#define SF2_SHDR_SIZE 46
+
+// 使用するジェネレーターの番号
+enum Sf2Generator : uint16_t
+{
+    GEN_START_ADDRS_OFFSET = 0,
+    GEN_END_ADDRS_OFFSET = 1,
+    GEN_STARTLOOP_ADDRS_OFFSET = 2,
+    GEN_ENDLOOP_ADDRS_OFFSET = 3,
+    GEN_START_ADDRS_COARSE_OFFSET = 4,
+    GEN_END_ADDRS_COARSE_OFFSET = 12,
+    GEN_ATTACK_VOL_ENV = 34,
+    GEN_DECAY_VOL_ENV = 36,
+    GEN_SUSTAIN_VOL_ENV = 37,
+    GEN_RELEASE_VOL_ENV = 38,
+    GEN_INSTRUMENT = 41,
+    GEN_KEY_RANGE = 43,
+    GEN_VEL_RANGE = 44,
+    GEN_STARTLOOP_ADDRS_COARSE_OFFSET = 45,
+    GEN_ENDLOOP_ADDRS_COARSE_OFFSET = 50,
+    GEN_COARSE_TUNE = 51,
+    GEN_FINE_TUNE = 52,
+    GEN_SAMPLE_ID = 53,
+    GEN_SAMPLE_MODES = 54,
+    GEN_OVERRIDING_ROOT_KEY = 58,
+    GEN_COUNT = 61,
+};
+
+struct SoundFont::Zone
+{
+    int16_t gens[GEN_COUNT];
+};
+
+static uint16_t read_u16(const uint8_t *p)
+{
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+static uint32_t read_u32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// インストゥルメントのゾーンで指定されていないジェネレーターの値
+static void set_default_generators(int16_t *gens)
+{
+    memset(gens, 0, sizeof(int16_t) * GEN_COUNT);
+    gens[GEN_ATTACK_VOL_ENV] = -12000;
+    gens[GEN_DECAY_VOL_ENV] = -12000;
+    gens[GEN_RELEASE_VOL_ENV] = -12000;
+    gens[GEN_KEY_RANGE] = 127 << 8;
+    gens[GEN_VEL_RANGE] = 127 << 8;
+    gens[GEN_OVERRIDING_ROOT_KEY] = -1;
+}
+
+// countサンプルがすべて無音かどうか
+static bool is_silent(const int16_t *p, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (p[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+// タイムセント(絶対値)を秒に変換する
+static float timecents_to_seconds(int32_t tc)
+{
+    return powf(2.0f, std::min<int32_t>(std::max<int32_t>(tc, -12000), 8000) / 1200.0f);
+}
+
+std::shared_ptr<SoundFont> SoundFont::Load(const char *path)
+{
+    auto file = MappedFile::Open(path);
+    if (!file)
+        return nullptr;
+    return Load(std::move(file));
+}
+
+std::shared_ptr<SoundFont> SoundFont::Load(std::shared_ptr<MappedFile> file)
+{
+    std::shared_ptr<SoundFont> sf(new SoundFont(std::move(file)));
+    if (!sf->Parse())
+        return nullptr;
+    return sf;
+}
+
+bool SoundFont::Parse()
+{
+    const uint8_t *data = file->GetData();
+    size_t size = file->GetSize();
+    if (size < 12 || memcmp(data, "RIFF", 4) != 0 || memcmp(&data[8], "sfbk", 4) != 0)
+    {
+        LOGE("SoundFont", "Not a SoundFont 2 file");
+        return false;
+    }
+    size = std::min<size_t>(size, (size_t)read_u32(&data[4]) + 8);
+
+    // RIFFの最上位にあるLISTチャンクを順に見ていく
+    for (size_t pos = 12; pos + 12 <= size;)
+    {
+        uint32_t chunkSize = read_u32(&data[pos + 4]);
+        if (chunkSize > size - pos - 8)
+            break;
+        if (memcmp(&data[pos], "LIST", 4) == 0)
+        {
+            const uint8_t *type = &data[pos + 8];
+            size_t end = pos + 8 + chunkSize;
+            for (size_t sub = pos + 12; sub + 8 <= end;)
+            {
+                const uint8_t *id = &data[sub];
+                uint32_t subSize = read_u32(&data[sub + 4]);
+                if (subSize > end - sub - 8)
+                    break;
+                const uint8_t *body = &data[sub + 8];
+                if (memcmp(type, "sdta", 4) == 0 && memcmp(id, "smpl", 4) == 0)
+                {
+                    smpl = (const int16_t *)body;
+                    smplCount = subSize / sizeof(int16_t);
+                }
+                else if (memcmp(type, "pdta", 4) == 0)
+                {
+                    static const struct
+                    {
+                        char id[5];
+                        uint32_t recordSize;
+                        Records SoundFont::*records;
+                    } tables[] = {
+                        {"phdr", SF2_PHDR_SIZE, &SoundFont::phdr},
+                        {"pbag", SF2_BAG_SIZE, &SoundFont::pbag},
+                        {"pgen", SF2_GEN_SIZE, &SoundFont::pgen},
+                        {"inst", SF2_INST_SIZE, &SoundFont::inst},
+                        {"ibag", SF2_BAG_SIZE, &SoundFont::ibag},
+                        {"igen", SF2_GEN_SIZE, &SoundFont::igen},
+                        {"shdr", SF2_SHDR_SIZE, &SoundFont::shdr},
+                    };
+                    for (auto &t : tables)
+                    {
+                        if (memcmp(id, t.id, 4) == 0)
+                        {
+                            (this->*t.records).data = body;
+                            (this->*t.records).count = subSize / t.recordSize;
+                        }
+                    }
+                }
+                // チャンクは2バイト境界に配置される
+                sub += 8 + subSize + (subSize & 1);
+            }
+        }
+        pos += 8 + chunkSize + (chunkSize & 1);
+    }
+
+    // いずれの表も末尾に終端のレコードを持つ
+    if (smpl == nullptr || ((uintptr_t)smpl & 1) != 0 || phdr.count < 2 || pbag.count < 1 || pgen.count < 1 ||
+        inst.count < 2 || ibag.count < 1 || igen.count < 1 || shdr.count < 2)
+    {
+        LOGE("SoundFont", "Required chunks are missing");
+        return false;
+    }
+    // バッグとジェネレーターの番号が範囲内に収まっていることを確かめておく
+    auto validate = [](const Records &headers, uint32_t recordSize, uint32_t bagOffset, const Records &bags, const Records &gens) {
+        uint32_t prev = 0;
+        for (uint32_t i = 0; i < headers.count; i++)
+        {
+            uint16_t bag = read_u16(&headers.data[i * recordSize + bagOffset]);
+            if (bag < prev || bag >= bags.count)
+                return false;
+            prev = bag;
+        }
+        prev = 0;
+        for (uint32_t i = 0; i < bags.count; i++)
+        {
+            uint16_t gen = read_u16(&bags.data[i * SF2_BAG_SIZE]);
+            if (gen < prev || gen >= gens.count)
+                return false;
+            prev = gen;
+        }
+        return true;
+    };
+    if (!validate(phdr, SF2_PHDR_SIZE, 24, pbag, pgen) || !validate(inst, SF2_INST_SIZE, 20, ibag, igen))
+    {
+        LOGE("SoundFont", "Invalid preset or instrument table");
+        return false;
+    }
+
+    presets.resize(phdr.count - 1);
+    for (uint32_t i = 0; i < phdr.count - 1; i++)
+    {
+        const uint8_t *r = &phdr.data[i * SF2_PHDR_SIZE];
+        memcpy(presets[i].name, r, 20);
+        presets[i].name[20] = '\0';
+        presets[i].program = read_u16(&r[20]);
+        presets[i].bank = read_u16(&r[22]);
+    }
+    return true;
+}
+
+void SoundFont::ReadZones(const Records &bags, const Records &gens, uint32_t bag, uint32_t bagEnd, uint16_t terminal, std::vector<Zone> &zones, Zone &global) const
+{
+    for (uint32_t b = bag; b < bagEnd; b++)
+    {
+        uint32_t gen = read_u16(&bags.data[b * SF2_BAG_SIZE]);
+        uint32_t genEnd = read_u16(&bags.data[(b + 1) * SF2_BAG_SIZE]);
+        Zone zone = global;
+        bool hasTerminal = false;
+        for (uint32_t g = gen; g < genEnd; g++)
+        {
+            uint16_t oper = read_u16(&gens.data[g * SF2_GEN_SIZE]);
+            int16_t amount = (int16_t)read_u16(&gens.data[g * SF2_GEN_SIZE + 2]);
+            if (oper < GEN_COUNT)
+                zone.gens[oper] = amount;
+            if (oper == terminal)
+            {
+                hasTerminal = true;
+                break; // 終端のジェネレーターより後ろは無視する
+            }
+        }
+        if (hasTerminal)
+            zones.push_back(zone);
+        else if (b == bag)
+            global = zone; // 最初のゾーンが終端のジェネレーターを持たない場合はグローバルゾーン
+    }
+}
+
+std::shared_ptr<Timbre> SoundFont::GetTimbre(uint16_t bank, uint8_t program) const
+{
+    for (size_t i = 0; i < presets.size(); i++)
+    {
+        if (presets[i].bank == bank && presets[i].program == program)
+            return GetTimbre(i);
+    }
+    return nullptr;
+}
+
+std::shared_ptr<Timbre> SoundFont::GetTimbre(size_t presetIndex) const
+{
+    if (presetIndex >= presets.size())
+        return nullptr;
+
+    // 優先度の高い順に並べたゾーン (範囲は重なっていることがある)
+    std::vector<Timbre::MappedSample> zones;
+
+    // プリセットのジェネレーターはインストゥルメントの値に加算される
+    Zone presetGlobal;
+    memset(&presetGlobal, 0, sizeof(presetGlobal));
+    presetGlobal.gens[GEN_KEY_RANGE] = 127 << 8;
+    presetGlobal.gens[GEN_VEL_RANGE] = 127 << 8;
+    std::vector<Zone> presetZones;
+    uint32_t bag = read_u16(&phdr.data[presetIndex * SF2_PHDR_SIZE + 24]);
+    uint32_t bagEnd = read_u16(&phdr.data[(presetIndex + 1) * SF2_PHDR_SIZE + 24]);
+    ReadZones(pbag, pgen, bag, bagEnd, GEN_INSTRUMENT, presetZones, presetGlobal);
+
+    for (const Zone &pz : presetZones)
+    {
+        uint16_t instrument = pz.gens[GEN_INSTRUMENT];
+        if (instrument >= inst.count - 1)
+            continue;
+        Zone instGlobal;
+        set_default_generators(instGlobal.gens);
+        std::vector<Zone> instZones;
+        uint32_t ibagStart = read_u16(&inst.data[instrument * SF2_INST_SIZE + 20]);
+        uint32_t ibagEnd = read_u16(&inst.data[(instrument + 1) * SF2_INST_SIZE + 20]);
+        ReadZones(ibag, igen, ibagStart, ibagEnd, GEN_SAMPLE_ID, instZones, instGlobal);
+
+        for (const Zone &iz : instZones)
+        {
+            uint16_t sampleId = iz.gens[GEN_SAMPLE_ID];
+            if (sampleId >= shdr.count - 1)
+                continue;
+            // ノートナンバーとベロシティの範囲はプリセットとインストゥルメントの共通部分
+            uint8_t lowerNoteNo = std::max<uint8_t>(iz.gens[GEN_KEY_RANGE] & 0xFF, pz.gens[GEN_KEY_RANGE] & 0xFF);
+            uint8_t upperNoteNo = std::min<uint8_t>(std::min<uint8_t>((uint16_t)iz.gens[GEN_KEY_RANGE] >> 8, (uint16_t)pz.gens[GEN_KEY_RANGE] >> 8), 127);
+            uint8_t lowerVelocity = std::max<uint8_t>(iz.gens[GEN_VEL_RANGE] & 0xFF, pz.gens[GEN_VEL_RANGE] & 0xFF);
+            uint8_t upperVelocity = std::min<uint8_t>(std::min<uint8_t>((uint16_t)iz.gens[GEN_VEL_RANGE] >> 8, (uint16_t)pz.gens[GEN_VEL_RANGE] >> 8), 127);
+            if (lowerNoteNo > upperNoteNo || lowerVelocity > upperVelocity)
+                continue;
+
+            const uint8_t *sh = &shdr.data[sampleId * SF2_SHDR_SIZE];
+            uint16_t sampleType = read_u16(&sh[44]);
+            if (sampleType & 0x8000)
+                continue; // ROMサンプルには対応しない
+            auto gen = [&](uint16_t g) { return (int32_t)iz.gens[g]; };
+            int64_t start = (int64_t)read_u32(&sh[20]) + gen(GEN_START_ADDRS_OFFSET) + gen(GEN_START_ADDRS_COARSE_OFFSET) * 32768;
+            int64_t end = (int64_t)read_u32(&sh[24]) + gen(GEN_END_ADDRS_OFFSET) + gen(GEN_END_ADDRS_COARSE_OFFSET) * 32768;
+            int64_t loopStart = (int64_t)read_u32(&sh[28]) + gen(GEN_STARTLOOP_ADDRS_OFFSET) + gen(GEN_STARTLOOP_ADDRS_COARSE_OFFSET) * 32768;
+            int64_t loopEnd = (int64_t)read_u32(&sh[32]) + gen(GEN_ENDLOOP_ADDRS_OFFSET) + gen(GEN_ENDLOOP_ADDRS_COARSE_OFFSET) * 32768;
+            if (start < 0 || end > smplCount || start >= end)
+            {
+                LOGE("SoundFont", "Sample %d is out of range", sampleId);
+                continue;
+            }
+            uint32_t length = end - start;
+            bool loop = (gen(GEN_SAMPLE_MODES) & 1) && start <= loopStart && loopStart < loopEnd && loopEnd <= end;
+            // ループしない場合は終端で再生を終える
+            uint32_t sampleLoopStart = loop ? loopStart - start : length;
+            uint32_t sampleLoopEnd = loop ? loopEnd - start : length;
+
+            int32_t rootKey = gen(GEN_OVERRIDING_ROOT_KEY) >= 0 ? gen(GEN_OVERRIDING_ROOT_KEY) : sh[40];
+            if (rootKey > 127)
+                rootKey = 60;
+            uint32_t sampleRate = read_u32(&sh[36]);
+            float tune = (gen(GEN_COARSE_TUNE) + pz.gens[GEN_COARSE_TUNE]) * 100.0f + gen(GEN_FINE_TUNE) + pz.gens[GEN_FINE_TUNE] + (int8_t)sh[41];
+
+            int32_t sustainCb = std::min<int32_t>(std::max<int32_t>(gen(GEN_SUSTAIN_VOL_ENV) + pz.gens[GEN_SUSTAIN_VOL_ENV], 0), 1440);
+            float attack = GetAttackFromSeconds(timecents_to_seconds(gen(GEN_ATTACK_VOL_ENV) + pz.gens[GEN_ATTACK_VOL_ENV]));
+            float decay = GetDecayFromSeconds(timecents_to_seconds(gen(GEN_DECAY_VOL_ENV) + pz.gens[GEN_DECAY_VOL_ENV]));
+            float sustain = powf(10.0f, -sustainCb / 200.0f);
+            float release = GetReleaseFromSeconds(timecents_to_seconds(gen(GEN_RELEASE_VOL_ENV) + pz.gens[GEN_RELEASE_VOL_ENV]));
+
+            // カーネルは終端を超えて読み進めるため、ゾーンの最も高いノートまで再生できる分の無音が後ろに続いている必要がある
+            // 仕様上の無音(46サンプル)では足りない場合や終端をずらしている場合は、無音を付け足した領域にコピーする
+            uint32_t guardLength = GetSampleGuardLength(upperNoteNo - rootKey + tune * 0.01f, sampleRate > 0 ? sampleRate : SAMPLE_RATE);
+            std::shared_ptr<const int16_t> data;
+            if (guardLength <= smplCount - end && is_silent(&smpl[end], guardLength))
+            {
+                // 波形データはファイルを所有するshared_ptrのエイリアスとして参照する
+                data = std::shared_ptr<const int16_t>(file, &smpl[start]);
+            }
+            else
+            {
+                int16_t *buffer = new int16_t[length + guardLength]();
+                memcpy(buffer, &smpl[start], length * sizeof(int16_t));
+                data = std::shared_ptr<const int16_t>(buffer, std::default_delete<int16_t[]>());
+            }
+            auto sample = std::make_shared<Sample>(std::move(data), length, (uint8_t)rootKey, sampleLoopStart, sampleLoopEnd, true, attack, decay, sustain, release);
+            sample->tune = tune;
+            if (sampleRate > 0)
+                sample->sampleRate = sampleRate;
+            zones.emplace_back(std::move(sample), lowerNoteNo, upperNoteNo, lowerVelocity, upperVelocity);
+        }
+    }
+
+    return Timbre::CreateFromZones(std::move(zones));
+}
+
+}
+}
@@ -0,0 +1,153 @@
+#include "Wavetable.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "Utils.h"
+
+#if !defined(M_PI)
+#define M_PI 3.14159265359
+#endif
+
+namespace capsule
+{
+namespace sampler
+{
+
+Wavetable::Wavetable(uint32_t frameLength, uint32_t frameCount, uint32_t tableLength, MemoryResource *resource)
+    : frameLength{frameLength}, frameCount{frameCount}, tableLength{tableLength}, resource{resource}
+{
+    for (uint32_t length = tableLength; length >= WAVETABLE_MIN_TABLE_LENGTH; length >>= 1)
+    {
+        levelOffsets[levelCount++] = frameStride;
+        frameStride += length + 1;
+    }
+    size_t size = (size_t)frameStride * frameCount * sizeof(int16_t);
+    memory = (int16_t *)resource->Allocate(size, 16);
+    if (memory != nullptr)
+        memorySize = size;
+}
+
+Wavetable::~Wavetable()
+{
+    if (memory != nullptr)
+        resource->Deallocate(memory, memorySize, 16);
+}
+
+// 1周期の波形の倍音成分 (cos・sinの係数)
+struct harmonics_t
+{
+    std::vector<float> a;
+    std::vector<float> b;
+};
+
+// lengthサンプルのframeを1周期とみなして、1〜count次の倍音の係数を求める
+static void analyze_frame(const int16_t *frame, uint32_t length, const std::vector<float> &cosTable, const std::vector<float> &sinTable, uint32_t count, harmonics_t &harmonics)
+{
+    for (uint32_t h = 1; h <= count; h++)
+    {
+        double a = 0.0;
+        double b = 0.0;
+        uint32_t phase = 0; // h * n mod length
+        for (uint32_t n = 0; n < length; n++)
+        {
+            a += frame[n] * cosTable[phase];
+            b += frame[n] * sinTable[phase];
+            phase += h;
+            if (phase >= length)
+                phase -= length;
+        }
+        harmonics.a[h - 1] = a * 2.0 / length;
+        harmonics.b[h - 1] = b * 2.0 / length;
+    }
+}
+
+// 倍音の係数からlengthサンプルのテーブルを合成してdstに書き込む (末尾に先頭のコピーを付ける)
+// tableLengthサンプルで1周期のcosTableを、tableLength / length サンプルおきに読む
+// 飽和させる前の絶対値の最大値を返す
+static float synthesize_table(const harmonics_t &harmonics, uint32_t count, const std::vector<float> &cosTable, uint32_t tableLength, uint32_t length, float scale, int16_t *dst)
+{
+    uint32_t stride = tableLength / length;
+    float peak = 0.0f;
+    for (uint32_t n = 0; n < length; n++)
+    {
+        float value = 0.0f;
+        for (uint32_t h = 1; h <= count; h++)
+        {
+            uint32_t phase = (h * n * stride) & (tableLength - 1);
+            // sin(x) = cos(x - π/2) なので、1/4周期ずらした位置を読む
+            uint32_t sinPhase = (phase + tableLength - tableLength / 4) & (tableLength - 1);
+            value += harmonics.a[h - 1] * cosTable[phase] + harmonics.b[h - 1] * cosTable[sinPhase];
+        }
+        value *= scale;
+        peak = std::max(peak, fabsf(value));
+        dst[n] = (int16_t)std::min(std::max(lrintf(value), -32768L), 32767L);
+    }
+    dst[length] = dst[0];
+    return peak;
+}
+
+std::shared_ptr<Wavetable> Wavetable::Create(const int16_t *frames, uint32_t frameLength, uint32_t frameCount, uint32_t tableLength, MemoryResource *resource)
+{
+    if (frames == nullptr || frameLength < 4 || frameCount == 0)
+    {
+        LOGE("Wavetable", "Invalid frames");
+        return nullptr;
+    }
+    if (tableLength < WAVETABLE_MIN_TABLE_LENGTH || (tableLength & (tableLength - 1)) != 0)
+    {
+        LOGE("Wavetable", "Table length must be a power of two");
+        return nullptr;
+    }
+    std::shared_ptr<Wavetable> wavetable(new Wavetable(frameLength, frameCount, tableLength, resource));
+    if (wavetable->memory == nullptr)
+    {
+        LOGE("Wavetable", "Failed to allocate %u bytes", (unsigned)(wavetable->frameStride * frameCount * sizeof(int16_t)));
+        return nullptr;
+    }
+
+    std::vector<float> frameCos(frameLength);
+    std::vector<float> frameSin(frameLength);
+    for (uint32_t i = 0; i < frameLength; i++)
+    {
+        frameCos[i] = cos(2.0 * M_PI * i / frameLength);
+        frameSin[i] = sin(2.0 * M_PI * i / frameLength);
+    }
+    std::vector<float> tableCos(tableLength);
+    for (uint32_t i = 0; i < tableLength; i++)
+        tableCos[i] = cos(2.0 * M_PI * i / tableLength);
+
+    // 作成元のナイキスト周波数を超える倍音は含まれていないので求めない
+    uint32_t harmonicCount = std::min(tableLength / 4, (frameLength - 1) / 2);
+    std::vector<harmonics_t> harmonics(frameCount);
+    for (uint32_t f = 0; f < frameCount; f++)
+    {
+        harmonics[f].a.resize(harmonicCount);
+        harmonics[f].b.resize(harmonicCount);
+        analyze_frame(&frames[f * frameLength], frameLength, frameCos, frameSin, harmonicCount, harmonics[f]);
+    }
+
+    // 帯域制限するとギブズ現象で振幅が元より大きくなることがあるので、飽和した場合はすべてのフレームを縮小して作り直す
+    float scale = 1.0f;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        float peak = 0.0f;
+        for (uint32_t f = 0; f < frameCount; f++)
+        {
+            for (uint32_t level = 0; level < wavetable->levelCount; level++)
+            {
+                uint32_t length = tableLength >> level;
+                uint32_t count = std::min(length / 4, harmonicCount);
+                int16_t *dst = &wavetable->memory[f * wavetable->frameStride + wavetable->levelOffsets[level]];
+                peak = std::max(peak, synthesize_table(harmonics[f], count, tableCos, tableLength, length, scale, dst));
+            }
+        }
+        if (peak <= 32767.0f)
+            break;
+        scale = 32767.0f / peak;
+    }
+    return wavetable;
+}
+
+}
+}